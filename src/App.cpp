@@ -6,10 +6,12 @@
 #include <vector>
 #include <exception>
 #include <sstream>
+#include <chrono>
 
 #include <glm/gtx/string_cast.hpp>
 
 #include "nfd.h"
+#include "BVHBenchmark.hpp"
 
 #define ILUT_USE_OPENGL
 #include <IL/il.h>
@@ -25,6 +27,8 @@ App::App() :
 #ifdef ENABLE_CUDA
     cudaRenderer(),
 #endif
+    cpuRenderer(),
+    model(),
     glmodel(),
     gllight(),
     glcanvas(glm::ivec2(WWIDTH, WHEIGHT)),
@@ -60,15 +64,35 @@ void App::MainLoop()
 {
   while (glcontext.isAlive())
   {
+    finishModelLoad();
+
     glcontext.clear();
     float dTime = glcontext.getDTime();
     handleControl(dTime);
 
+#ifdef ENABLE_CUDA
+    // The GPU tracers need the flat BVH, which is not built with instancing
+    if (!model.getTwoLevelBVH().empty() && (activeRenderer == ActiveRenderer::RAYTRACER || activeRenderer == ActiveRenderer::PATHTRACER))
+      activeRenderer = ActiveRenderer::GL;
+#endif
+
     switch (activeRenderer)
     {
     case ActiveRenderer::GL:
       glcontext.draw(glmodel, gllight, camera);
       break;
+    case ActiveRenderer::CPU_RAYTRACER:
+      cpuRenderer.rayTraceToCanvas(glcanvas, camera, model, gllight.getLight());
+      glcontext.draw(glcanvas);
+      break;
+    case ActiveRenderer::CPU_PATHTRACER:
+      cpuRenderer.pathTraceToCanvas(glcanvas, camera, model, gllight.getLight());
+      glcontext.draw(glcanvas);
+      break;
+    case ActiveRenderer::CPU_WAVEFRONT_PATHTRACER:
+      cpuRenderer.wavefrontPathTraceToCanvas(glcanvas, camera, model, gllight.getLight());
+      glcontext.draw(glcanvas);
+      break;
 #ifdef ENABLE_CUDA
       case ActiveRenderer::RAYTRACER: // Draw image to OpenGL texture and draw with opengl
       cudaRenderer.rayTraceToCanvas(glcanvas, camera, glmodel, gllight);
@@ -79,6 +103,8 @@ void App::MainLoop()
       glcontext.draw(glcanvas);
       break;
 #endif
+    default:
+      break;
     }
 
     if (debugMode != DebugMode::NONE)
@@ -86,10 +112,18 @@ void App::MainLoop()
       drawDebugInfo();
     }
 
-    glcontext.drawUI(activeRenderer, debugMode);
+    const bool cpuRendering = activeRenderer == ActiveRenderer::CPU_RAYTRACER || activeRenderer == ActiveRenderer::CPU_PATHTRACER || activeRenderer == ActiveRenderer::CPU_WAVEFRONT_PATHTRACER;
+    glcontext.drawUI(activeRenderer, debugMode, pendingModel.valid() ? &loadProgress : nullptr, cpuRendering ? cpuRenderer.getSamplesPerSecond() : 0.f);
     glcontext.swapBuffers();
   }
 
+  // The worker still uses the loader, so it is stopped before the app shuts down
+  if (pendingModel.valid())
+  {
+    loadProgress.cancelled = true;
+    pendingModel.wait();
+  }
+
   if (glmodel.getFileName() != "") // Check if model is loaded
     createSceneFile(LAST_SCENEFILE_NAME);
 }
@@ -234,10 +268,17 @@ void App::keyboardCallback(int key, int /*scancode*/, int action, int modifiers)
       free(outPath);
     }
   }
+  else if (key == GLFW_KEY_ESCAPE && action == GLFW_PRESS && pendingModel.valid())
+  {
+    std::cout << "Cancelling model load" << std::endl;
+    loadProgress.cancelled = true;
+    queuedModelFile.clear();
+  }
   else if (key == GLFW_KEY_ENTER && action == GLFW_PRESS)
   {
-    activeRenderer = static_cast<ActiveRenderer>((activeRenderer + 1) % 3);
+    activeRenderer = static_cast<ActiveRenderer>((activeRenderer + 1) % RENDERER_COUNT);
     debugPoints.clear();
+    cpuRenderer.reset();
 #ifdef ENABLE_CUDA
     cudaRenderer.reset();
 #endif
@@ -265,6 +306,20 @@ void App::keyboardCallback(int key, int /*scancode*/, int action, int modifiers)
       loadSceneFile(outPath);
       free(outPath);
     }
+  }
+  else if (key == GLFW_KEY_T && action == GLFW_PRESS)
+  {
+    // Only the flat BVH can be refitted, there is none with instancing
+    if (model.getBVH().empty())
+      return;
+
+    model.refit(twistVertices(model.getVertices(), BVH_REFIT_TWIST));
+    glmodel.updateGeometry(model);
+
+    cpuRenderer.reset();
+#ifdef ENABLE_CUDA
+    cudaRenderer.reset();
+#endif
   }else if (key == GLFW_KEY_D && action == GLFW_PRESS && (modifiers & GLFW_MOD_CONTROL))
   {
     debugMode = static_cast<DebugMode>((debugMode + 1) % 3);
@@ -320,14 +375,94 @@ void App::createSceneFile(const std::string& filename)
   std::cout << "Wrote scene file " << filename << std::endl;
 }
 
-void App::loadModel(const std::string& modelFile)
+void App::loadModel(const std::string& modelFile, const bool background)
 {
-  Model scene = loader.loadOBJ(modelFile);
-  model = scene;
-  glmodel.load(scene);
+  if (pendingModel.valid())
+  {
+    loadProgress.cancelled = true;
+
+    if (background)
+    {
+      queuedModelFile = modelFile;
+      return;
+    }
+
+    pendingModel.wait();
+    queuedModelFile.clear();
+    finishModelLoad();
+  }
+
+  if (!background)
+  {
+    Model scene = loader.loadOBJ(modelFile);
+
+    if (!scene.getTriangleIndices().empty())
+    {
+      model = std::move(scene);
+      glmodel.load(model);
+    }
+
+    return;
+  }
+
+  loadProgress.stage = LOAD_CACHE;
+  loadProgress.fraction = 0.f;
+  loadProgress.cancelled = false;
+
+  // Only the loader and loadProgress are touched by the worker, the GL upload happens in finishModelLoad()
+  pendingModel = std::async(std::launch::async, [this, modelFile]
+      {
+        return loader.loadOBJ(modelFile, &loadProgress);
+      });
 }
 
-void App::loadSceneFile(const std::string& filename)
+// Called by the render thread every frame, swaps in the model once the worker has finished
+void App::finishModelLoad()
+{
+  if (!pendingModel.valid() || pendingModel.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+    return;
+
+  try
+  {
+    Model scene = pendingModel.get();
+
+    // A failed or cancelled load keeps the current model
+    if (!loadProgress.cancelled && !scene.getTriangleIndices().empty())
+    {
+      model = std::move(scene);
+      glmodel.load(model);
+      debugBboxPtr = 0;
+      cpuRenderer.reset();
+
+#ifdef ENABLE_CUDA
+      cudaRenderer.reset();
+#endif
+    }
+  }
+  catch (std::exception& e)
+  {
+    std::cerr << "Error loading model: " << e.what() << std::endl;
+  }
+
+  if (!queuedModelFile.empty())
+  {
+    const std::string modelFile = queuedModelFile;
+    queuedModelFile.clear();
+    loadModel(modelFile);
+  }
+}
+
+void App::setBVHBuildParameters(const BVHBuildParameters& parameters)
+{
+  loader.setBVHBuildParameters(parameters);
+}
+
+void App::setModelCache(const bool enabled, const std::string& directory)
+{
+  loader.setCache(enabled, directory);
+}
+
+void App::loadSceneFile(const std::string& filename, const bool background)
 {
   std::ifstream sceneFile;
   sceneFile.open(filename);
@@ -346,7 +481,7 @@ void App::loadSceneFile(const std::string& filename)
 
   std::string modelName;
   std::getline(sceneFile, modelName);
-  loadModel(modelName);
+  loadModel(modelName, background);
 
   Light newLight;
   sceneFile >> newLight;
@@ -361,7 +496,7 @@ void App::loadSceneFile(const std::string& filename)
 #ifdef ENABLE_CUDA
 void App::rayTraceToFile(const std::string& sceneFile, const std::string& outfile)
 {
-  loadSceneFile(sceneFile);
+  loadSceneFile(sceneFile, false);
 
 #ifdef ENABLE_CUDA
   cudaEvent_t start, stop;
@@ -385,7 +520,7 @@ void App::rayTraceToFile(const std::string& sceneFile, const std::string& outfil
 
 void App::pathTraceToFile(const std::string& sceneFile, const std::string& outfile, const int paths)
 {
-  loadSceneFile(sceneFile);
+  loadSceneFile(sceneFile, false);
 
   cudaEvent_t start, stop;
   cudaEventCreate(&start);
@@ -410,6 +545,42 @@ void App::pathTraceToFile(const std::string& sceneFile, const std::string& outfi
 }
 #endif
 
+void App::cpuRayTraceToFile(const std::string& sceneFile, const std::string& outfile)
+{
+  loadSceneFile(sceneFile, false);
+
+  const auto start = std::chrono::high_resolution_clock::now();
+  cpuRenderer.rayTraceToCanvas(glcanvas, camera, model, gllight.getLight());
+  const auto stop = std::chrono::high_resolution_clock::now();
+
+  writeTextureToFile(glcanvas, outfile);
+  std::cout << "Rendering time [ms]: " << std::chrono::duration<float, std::milli>(stop - start).count() << std::endl;
+}
+
+void App::cpuPathTraceToFile(const std::string& sceneFile, const std::string& outfile, const int paths, const bool wavefront)
+{
+  loadSceneFile(sceneFile, false);
+
+  const auto start = std::chrono::high_resolution_clock::now();
+
+  for (int i = 0; i < paths; ++i)
+  {
+    if (wavefront)
+      cpuRenderer.wavefrontPathTraceToCanvas(glcanvas, camera, model, gllight.getLight(), false);
+    else
+      cpuRenderer.pathTraceToCanvas(glcanvas, camera, model, gllight.getLight(), false);
+  }
+
+  const auto stop = std::chrono::high_resolution_clock::now();
+  const float seconds = std::chrono::duration<float>(stop - start).count();
+  const glm::ivec2 size = glcanvas.getSize();
+
+  cpuRenderer.uploadToCanvas(glcanvas);
+  writeTextureToFile(glcanvas, outfile);
+  std::cout << "Rendering time [ms]: " << seconds * 1000.f << std::endl;
+  std::cout << "Samples per second: " << size.x * size.y * (float) paths / seconds << std::endl;
+}
+
 void App::writeTextureToFile(const GLTexture& texture, const std::string& fileName)
 {
   ILuint imgID;
@@ -4,10 +4,14 @@
 #define GLM_ENABLE_EXPERIMENTAL
 #include <glm/glm.hpp>
 
+#include <future>
+
 #include "ModelLoader.hpp"
 #include "GLContext.hpp"
 #include "GLTexture.hpp"
 
+#include "ISPCRenderer.hpp"
+
 #ifdef ENABLE_CUDA
   #include "CudaRenderer.hpp"
 #endif
@@ -34,9 +38,15 @@ public:
     void handleControl(float dTime);
     void addLight();
     void createSceneFile(const std::string& filename);
-    void loadSceneFile(const std::string& filename);
-    void loadModel(const std::string& modelFile);
+    // In the background by default, the current model is drawn until the new one is ready
+    void loadSceneFile(const std::string& filename, const bool background = true);
+    void loadModel(const std::string& modelFile, const bool background = true);
+    void finishModelLoad();
+    void setBVHBuildParameters(const BVHBuildParameters& parameters);
+    void setModelCache(const bool enabled, const std::string& directory);
     void writeTextureToFile(const GLTexture& texture, const std::string& fileName);
+    void cpuRayTraceToFile(const std::string& sceneFile, const std::string& outFile);
+    void cpuPathTraceToFile(const std::string& sceneFile, const std::string& outFile, const int paths, const bool wavefront = false);
 
 #ifdef ENABLE_CUDA
     void rayTraceToFile(const std::string& sceneFile, const std::string& outFile);
@@ -55,6 +65,7 @@ private:
 #ifdef ENABLE_CUDA
     CudaRenderer cudaRenderer;
 #endif
+    ISPCRenderer cpuRenderer;
     Model model;
     GLModel glmodel;
     GLLight gllight;
@@ -63,6 +74,11 @@ private:
     Camera camera;
     ModelLoader loader;
 
+    // At most one load runs at a time, a newer request waits until the cancelled one returns
+    LoadProgress loadProgress;
+    std::future<Model> pendingModel;
+    std::string queuedModelFile;
+
     enum DebugMode debugMode;
     unsigned int debugBboxPtr;
 };
@@ -0,0 +1,259 @@
+#include "BVHBenchmark.hpp"
+
+#include <random>
+#include <chrono>
+#include <iomanip>
+#include <limits>
+
+#include "WideBVH.hpp"
+#include "BinaryBVH.hpp"
+#include "RayPacket.hpp"
+
+namespace
+{
+  std::vector<Ray> generateRays(const AABB& bbox, const unsigned int nRays)
+  {
+    // Rays start on a sphere around the model and point at random points inside it
+    const glm::fvec3 center = (bbox.min + bbox.max) * 0.5f;
+    const float radius = glm::length(bbox.max - bbox.min);
+
+    std::mt19937 generator(0);
+    std::uniform_real_distribution<float> uniform(0.f, 1.f);
+    std::normal_distribution<float> normal(0.f, 1.f);
+
+    std::vector<Ray> rays(nRays);
+
+    for (auto& ray : rays)
+    {
+      glm::fvec3 d(normal(generator), normal(generator), normal(generator));
+
+      if (glm::length(d) <= 0.f)
+        d = glm::fvec3(0.f, 0.f, 1.f);
+
+      const glm::fvec3 target = bbox.min + (bbox.max - bbox.min) * glm::fvec3(uniform(generator), uniform(generator), uniform(generator));
+
+      ray.origin = center + glm::normalize(d) * radius;
+      ray.direction = glm::normalize(target - ray.origin);
+    }
+
+    return rays;
+  }
+
+  // Pinhole camera rays looking at the model, ordered in blocks of 4 x 2 pixels like the packets of the CPU renderer
+  std::vector<Ray> generateCoherentRays(const AABB& bbox, const unsigned int nRays)
+  {
+    const glm::fvec3 center = (bbox.min + bbox.max) * 0.5f;
+    const float radius = glm::length(bbox.max - bbox.min);
+
+    const glm::fvec3 eye = center + glm::normalize(glm::fvec3(0.3f, 0.4f, 1.f)) * radius;
+    const glm::fvec3 forward = glm::normalize(center - eye);
+    const glm::fvec3 right = glm::normalize(glm::cross(forward, glm::fvec3(0.f, 1.f, 0.f)));
+    const glm::fvec3 up = glm::cross(right, forward);
+
+    const int width = std::max(4, (int) std::sqrt((float) nRays) / 4 * 4);
+    const int height = std::max(2, (int) nRays / width / 2 * 2);
+
+    std::vector<Ray> rays;
+    rays.reserve(width * height);
+
+    for (int y0 = 0; y0 < height; y0 += 2)
+    {
+      for (int x0 = 0; x0 < width; x0 += 4)
+      {
+        for (int l = 0; l < RAY_PACKET_SIZE; ++l)
+        {
+          const float x = (x0 + l % 4 + 0.5f) / width * 2.f - 1.f;
+          const float y = (y0 + l / 4 + 0.5f) / height * 2.f - 1.f;
+
+          rays.push_back(Ray(eye, glm::normalize(forward + 0.5f * (x * right + y * up))));
+        }
+      }
+    }
+
+    return rays;
+  }
+
+  void printRow(const std::string& name, const std::size_t nNodes, const std::size_t nodeBytes, const int nRays, const float seconds, const int mismatches)
+  {
+    std::cout << std::left << std::setw(8) << name
+              << std::right << std::setw(10) << nNodes
+              << std::setw(12) << nodeBytes
+              << std::setw(12) << std::fixed << std::setprecision(2) << nNodes * nodeBytes / (1024.f * 1024.f)
+              << std::setw(12) << nRays / seconds * 1e-6f
+              << std::setw(12) << mismatches << std::endl;
+  }
+
+  void printHeader()
+  {
+    std::cout << std::left << std::setw(8) << "Layout"
+              << std::right << std::setw(10) << "Nodes"
+              << std::setw(12) << "Bytes/node"
+              << std::setw(12) << "MiB"
+              << std::setw(12) << "Mrays/s"
+              << std::setw(12) << "Mismatches" << std::endl;
+  }
+
+  int countMismatches(const std::vector<float>& t, std::vector<float>& reference)
+  {
+    if (reference.empty())
+      reference = t;
+
+    int mismatches = 0;
+
+    for (std::size_t i = 0; i < t.size(); ++i)
+    {
+      if (t[i] != reference[i])
+        ++mismatches;
+    }
+
+    return mismatches;
+  }
+
+  template <typename BVHType>
+  void benchmarkLayout(const std::string& name, const BVHType& bvh, const std::size_t nodeBytes, const std::vector<Ray>& rays, const IndexedTriangles& triangles, std::vector<float>& reference)
+  {
+    const int nRays = rays.size();
+    std::vector<float> t(nRays);
+
+    const auto start = std::chrono::high_resolution_clock::now();
+
+#pragma omp parallel for schedule(dynamic, 1024)
+    for (int i = 0; i < nRays; ++i)
+    {
+      const RaycastResult result = bvh.intersect(rays[i], triangles, std::numeric_limits<float>::max(), false);
+      t[i] = result ? result.t : -1.f;
+    }
+
+    const auto end = std::chrono::high_resolution_clock::now();
+    const float seconds = std::chrono::duration<float>(end - start).count();
+
+    printRow(name, bvh.getNodes().size(), nodeBytes, nRays, seconds, countMismatches(t, reference));
+  }
+
+  // Rays are packed in the order they were generated
+  void benchmarkPackets(const std::string& name, const BinaryBVH& bvh, const std::vector<Ray>& rays, const IndexedTriangles& triangles, std::vector<float>& reference)
+  {
+    const int nPackets = rays.size() / RAY_PACKET_SIZE;
+    std::vector<float> t(rays.size(), -1.f);
+
+    const auto start = std::chrono::high_resolution_clock::now();
+
+#pragma omp parallel for schedule(dynamic, 128)
+    for (int p = 0; p < nPackets; ++p)
+    {
+      RayPacket packet;
+      RaycastResult results[RAY_PACKET_SIZE];
+
+      for (int l = 0; l < RAY_PACKET_SIZE; ++l)
+        packet.set(l, rays[p * RAY_PACKET_SIZE + l], std::numeric_limits<float>::max());
+
+      intersectPacket(bvh, triangles, packet, false, results);
+
+      for (int l = 0; l < RAY_PACKET_SIZE; ++l)
+        t[p * RAY_PACKET_SIZE + l] = results[l] ? results[l].t : -1.f;
+    }
+
+    const auto end = std::chrono::high_resolution_clock::now();
+
+    printRow(name, bvh.getNodes().size(), sizeof(LayoutNode), nPackets * RAY_PACKET_SIZE, std::chrono::duration<float>(end - start).count(), countMismatches(t, reference));
+  }
+}
+
+void benchmarkBVH(const Model& model, const unsigned int nRays)
+{
+  const std::vector<Node>& bvh = model.getBVH();
+
+  if (bvh.empty())
+  {
+    std::cerr << "No BVH to benchmark" << std::endl;
+    return;
+  }
+
+  const std::vector<Ray> rays = generateRays(bvh[0].bbox, nRays);
+  const IndexedTriangles triangles(model.getVertices().data(), model.getTriangleIndices().data());
+
+  const BinaryBVH depthFirst(bvh, NodeLayout::DEPTH_FIRST);
+  const BinaryBVH siblings(bvh, NodeLayout::SIBLING_ADJACENT);
+  const BinaryBVH vanEmdeBoas(bvh, NodeLayout::VAN_EMDE_BOAS);
+  const BVH4 bvh4(bvh);
+  const BVH8 bvh8(bvh);
+  const QuantizedWideBVH<4> qbvh4(bvh4);
+  const QuantizedWideBVH<8> qbvh8(bvh8);
+
+  std::cout << std::endl << "Binary BVH: " << bvh.size() << " nodes, " << sizeof(Node) << " bytes/node" << std::endl;
+  std::cout << "Tracing " << nRays << " rays" << std::endl;
+  printHeader();
+
+  std::vector<float> reference;
+
+  benchmarkLayout("DF", depthFirst, sizeof(LayoutNode), rays, triangles, reference);
+  benchmarkLayout("SIB", siblings, sizeof(LayoutNode), rays, triangles, reference);
+  benchmarkLayout("VEB", vanEmdeBoas, sizeof(LayoutNode), rays, triangles, reference);
+  benchmarkLayout("BVH4", bvh4, sizeof(WideNode<4>), rays, triangles, reference);
+  benchmarkLayout("BVH8", bvh8, sizeof(WideNode<8>), rays, triangles, reference);
+  benchmarkLayout("QBVH4", qbvh4, sizeof(QuantizedWideNode<4>), rays, triangles, reference);
+  benchmarkLayout("QBVH8", qbvh8, sizeof(QuantizedWideNode<8>), rays, triangles, reference);
+
+  // Packets only pay off for rays that visit the same nodes
+  const std::vector<Ray> coherentRays = generateCoherentRays(bvh[0].bbox, nRays);
+
+  std::cout << std::endl << "Tracing " << coherentRays.size() << " coherent camera rays" << std::endl;
+  printHeader();
+
+  std::vector<float> coherentReference;
+
+  benchmarkLayout("DF", depthFirst, sizeof(LayoutNode), coherentRays, triangles, coherentReference);
+  benchmarkLayout("BVH8", bvh8, sizeof(WideNode<8>), coherentRays, triangles, coherentReference);
+  benchmarkPackets("PKT DF", depthFirst, coherentRays, triangles, coherentReference);
+  benchmarkPackets("PKT SIB", siblings, coherentRays, triangles, coherentReference);
+  benchmarkPackets("PKT VEB", vanEmdeBoas, coherentRays, triangles, coherentReference);
+}
+
+void benchmarkRefit(Model& model, const int nFrames)
+{
+  if (model.getBVH().empty())
+  {
+    std::cerr << "No BVH to refit" << std::endl;
+    return;
+  }
+
+  // Every frame twists the loaded vertices, so the deformation does not depend on the earlier frames
+  const std::vector<Vertex> restVertices = model.getVertices();
+
+  for (int frame = 1; frame <= nFrames; ++frame)
+  {
+    std::cout << "Frame " << frame << ", twist " << frame * BVH_REFIT_TWIST << " rad: ";
+    model.refit(twistVertices(restVertices, frame * BVH_REFIT_TWIST));
+  }
+}
+
+std::vector<Vertex> twistVertices(const std::vector<Vertex>& vertices, const float angle)
+{
+  AABB bounds = vertices.empty() ? AABB() : AABB(vertices[0].p, vertices[0].p);
+
+  for (const auto& v : vertices)
+    bounds.add(v.p);
+
+  const glm::fvec3 center = (bounds.min + bounds.max) * 0.5f;
+  const float height = std::max(bounds.max.y - bounds.min.y, std::numeric_limits<float>::min());
+
+  std::vector<Vertex> twisted(vertices);
+
+#pragma omp parallel for
+  for (int i = 0; i < static_cast<int>(twisted.size()); ++i)
+  {
+    Vertex& v = twisted[i];
+
+    const float a = angle * (v.p.y - bounds.min.y) / height;
+    const float c = std::cos(a);
+    const float s = std::sin(a);
+
+    const glm::fvec2 p(v.p.x - center.x, v.p.z - center.z);
+
+    v.p.x = center.x + c * p.x - s * p.y;
+    v.p.z = center.z + s * p.x + c * p.y;
+    v.n = glm::fvec3(c * v.n.x - s * v.n.z, v.n.y, s * v.n.x + c * v.n.z);
+  }
+
+  return twisted;
+}
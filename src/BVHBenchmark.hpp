@@ -0,0 +1,21 @@
+#ifndef BVHBENCHMARK_HPP
+#define BVHBENCHMARK_HPP
+
+#include "Model.hpp"
+
+#define BVH_BENCH_RAYS (1 << 20)
+#define BVH_REFIT_FRAMES 16
+#define BVH_REFIT_TWIST 0.2f // Radians added every frame
+
+// Traces the same random rays through every CPU node layout and reports memory use and throughput
+void benchmarkBVH(const Model& model, const unsigned int nRays = BVH_BENCH_RAYS);
+
+// Twists the model a little further every frame and refits its BVH, which reports the refit time and
+// the SAH cost, and rebuilds the BVH once the cost grew past refitRebuildRatio
+void benchmarkRefit(Model& model, const int nFrames = BVH_REFIT_FRAMES);
+
+// Rotates the vertices around the vertical axis through the middle of their bounds, from no rotation at
+// the bottom to angle radians at the top
+std::vector<Vertex> twistVertices(const std::vector<Vertex>& vertices, const float angle);
+
+#endif // BVHBENCHMARK_HPP
@@ -1,8 +1,18 @@
 #include "BVHBuilder.hpp"
+#include "WorkStealingPool.hpp"
+#include "BVHStatistics.hpp"
 
 #include <stack>
+#include <array>
+#include <chrono>
+#include <functional>
+#include <cstring>
 #include <parallel/algorithm>
 
+#ifdef _OPENMP
+  #include <omp.h>
+#endif
+
 BVHBuilder::BVHBuilder()
 {
   
@@ -33,11 +43,10 @@ AABB BVHBuilder::computeBB(const Node node)
   {
     for (int ti = node.startTri; ti < node.startTri + node.nTri; ++ti)
     {
-      glm::fvec3 pmin = trisWithIds[ti].first.min();
-      glm::fvec3 pmax = trisWithIds[ti].first.max();
+      const AABB& box = triBoxes[triIds[ti]];
 
-      minXYZ = glm::min(pmin, minXYZ);
-      maxXYZ = glm::max(pmax, maxXYZ);
+      minXYZ = glm::min(box.min, minXYZ);
+      maxXYZ = glm::max(box.max, maxXYZ);
     }
   }
   else
@@ -51,67 +60,142 @@ AABB BVHBuilder::computeBB(const Node node)
   return ret;
 }
 
-std::vector<unsigned int> BVHBuilder::getMortonCodes(const std::vector<Triangle>& triangles, const AABB& boundingBox)
+// Same trick for 21 bits per axis, giving 63 bit codes
+unsigned long long BVHBuilder::expandBits64(unsigned long long v)
 {
-  // Create Morton codes
-  const AABB& modelBbox = boundingBox;
-  const glm::vec3 diff = modelBbox.max - modelBbox.min;
-  const float maxDiff = std::max(std::max(diff.x, diff.y), diff.z);
+    v &= 0x1FFFFFull;
+    v = (v | v << 32) & 0x1F00000000FFFFull;
+    v = (v | v << 16) & 0x1F0000FF0000FFull;
+    v = (v | v << 8)  & 0x100F00F00F00F00Full;
+    v = (v | v << 4)  & 0x10C30C30C30C30C3ull;
+    v = (v | v << 2)  & 0x1249249249249249ull;
+    return v;
+}
 
-  std::vector<unsigned int> mortonCodes(triangles.size());
+template <>
+unsigned int BVHBuilder::encodeMorton<unsigned int>(const glm::fvec3& p)
+{
+  // Normalized coordinates, encode every dimension as a 10 bit integer
+  const glm::fvec3 q = glm::clamp(p * 1024.f, 0.f, 1023.f);
 
-  std::vector<Triangle> normTris = triangles;
+  return 4 * expandBits(static_cast<unsigned int>(q.x)) + 2 * expandBits(static_cast<unsigned int>(q.y)) + expandBits(static_cast<unsigned int>(q.z));
+}
 
-  glm::fvec3 toAdd = -modelBbox.min;
+template <>
+unsigned long long BVHBuilder::encodeMorton<unsigned long long>(const glm::fvec3& p)
+{
+  const glm::fvec3 q = glm::clamp(p * 2097152.f, 0.f, 2097151.f);
 
-  for (std::size_t d = 0; d < 3; ++d)
-  {
-    if (toAdd[d] < 0.f)
-      toAdd[d] = 0.f;
-  }
+  return 4 * expandBits64(static_cast<unsigned long long>(q.x)) + 2 * expandBits64(static_cast<unsigned long long>(q.y)) + expandBits64(static_cast<unsigned long long>(q.z));
+}
 
-  for (auto& tri : normTris)
-  {
-    for (auto& v : tri.vertices)
-    {
-      v.p += toAdd;
-    }
-  }
+template <typename MortonCode>
+std::vector<MortonCode> BVHBuilder::getMortonCodes(const std::vector<glm::fvec3>& centroids, const AABB& centroidBox)
+{
+  const glm::fvec3 diff = centroidBox.max - centroidBox.min;
+  glm::fvec3 scale;
 
-  for (auto& tri : normTris)
-  {
-    for (auto& v : tri.vertices)
-    {
-      v.p /= maxDiff;
-    }
-  }
+  for (unsigned int a = 0; a < 3; ++a)
+    scale[a] = diff[a] > 0.f ? 1.f / diff[a] : 0.f;
 
-  // Normalization done, now get the the centroids and encode every dimension as a 10 bit integer
-  for (std::size_t triIdx = 0; triIdx < triangles.size(); ++triIdx)
-  {
-    const auto& tri = triangles[triIdx];
+  std::vector<MortonCode> mortonCodes(centroids.size());
 
-    glm::fvec3 centr(0.f);
+#pragma omp parallel for
+  for (int i = 0; i < static_cast<int>(centroids.size()); ++i)
+    mortonCodes[i] = encodeMorton<MortonCode>((centroids[i] - centroidBox.min) * scale);
 
-    for (const auto& v : tri.vertices)
-    {
-      centr += v.p;
-    }
+  return mortonCodes;
+}
 
-    centr /= 3.f;
+// Stable parallel LSD radix sort with 8 bit digits. Every thread histograms a contiguous chunk
+// and then scatters it to offsets computed from all histograms.
+template <typename Key>
+void BVHBuilder::radixSort(std::vector<Key>& keys, std::vector<unsigned int>& values)
+{
+  const int n = keys.size();
+
+  std::vector<Key> keysTmp(n);
+  std::vector<unsigned int> valuesTmp(n);
 
+#ifdef _OPENMP
+  const int nThreads = n > 65536 ? omp_get_max_threads() : 1;
+#else
+  const int nThreads = 1;
+#endif
 
-    glm::ivec3 zOrder = glm::ivec3(centr.x * 1023, centr.y * 1023, centr.z * 1023); // 10 bits
+  std::vector<std::array<int, 256>> offsets(nThreads);
+
+  for (unsigned int shift = 0; shift < sizeof(Key) * 8; shift += 8)
+  {
+    bool skipPass = false;
 
-    unsigned int xExpanded = expandBits(zOrder.x);
-    unsigned int yExpanded = expandBits(zOrder.y);
-    unsigned int zExpanded = expandBits(zOrder.z);
+#pragma omp parallel num_threads(nThreads)
+    {
+#ifdef _OPENMP
+      const int t = omp_get_thread_num();
+#else
+      const int t = 0;
+#endif
+      const int begin = static_cast<long long>(n) * t / nThreads;
+      const int end = static_cast<long long>(n) * (t + 1) / nThreads;
+
+      std::array<int, 256>& histogram = offsets[t];
+      histogram.fill(0);
+
+      for (int i = begin; i < end; ++i)
+        ++histogram[(keys[i] >> shift) & 0xFF];
+
+#pragma omp barrier
+#pragma omp single
+      {
+        int sum = 0;
+
+        for (int d = 0; d < 256; ++d)
+        {
+          for (int ti = 0; ti < nThreads; ++ti)
+          {
+            const int count = offsets[ti][d];
+
+            // All keys share this digit, nothing to do
+            if (count == n)
+              skipPass = true;
+
+            offsets[ti][d] = sum;
+            sum += count;
+          }
+        }
+      }
 
+      if (!skipPass)
+      {
+        for (int i = begin; i < end; ++i)
+        {
+          const int dst = histogram[(keys[i] >> shift) & 0xFF]++;
+          keysTmp[dst] = keys[i];
+          valuesTmp[dst] = values[i];
+        }
+      }
+    }
 
-    mortonCodes[triIdx] = 4 * xExpanded + 2 * yExpanded + zExpanded;
+    if (!skipPass)
+    {
+      keys.swap(keysTmp);
+      values.swap(valuesTmp);
+    }
   }
+}
 
-  return mortonCodes;
+template <typename MortonCode>
+std::vector<unsigned int> BVHBuilder::sortOnMorton(const std::vector<glm::fvec3>& centroids, const AABB& centroidBox, std::vector<MortonCode>& sortedCodes)
+{
+  sortedCodes = getMortonCodes<MortonCode>(centroids, centroidBox);
+
+  std::vector<unsigned int> order(centroids.size());
+  std::iota(order.begin(), order.end(), 0);
+
+  radixSort(sortedCodes, order);
+
+  return order;
 }
 
 void BVHBuilder::createBVHColors()
@@ -133,10 +217,14 @@ void BVHBuilder::createBVHColors()
       material.colorDiffuse = glm::fvec3(r, g, b);
 
       MeshDescriptor descr;
-      descr.vertexIds = std::vector<unsigned int>(node.nTri * 3);
-      std::iota(descr.vertexIds.begin(), descr.vertexIds.end(), node.startTri * 3);
       descr.materialIdx = materials.size();
 
+      for (int ti = node.startTri; ti < node.startTri + node.nTri; ++ti)
+      {
+        for (int v = 0; v < 3; ++v)
+          descr.vertexIds.push_back(triangleIndices[ti][v]);
+      }
+
       materials.push_back(material);
       descriptors.push_back(descr);
     }
@@ -146,106 +234,628 @@ void BVHBuilder::createBVHColors()
   bvhBoxDescriptors = descriptors;
 }
 
-std::vector<std::pair<Triangle, unsigned int>> BVHBuilder::sortOnMorton(std::vector<Triangle> triangles, const AABB& boundingBox)
+namespace
 {
-  std::vector<std::pair<Triangle, unsigned int>> triIdx;
-  
-  unsigned int idx = 0;
-  for (auto t : triangles)
+  inline int countLeadingZeros(const unsigned int v)
   {
-    triIdx.push_back(std::make_pair(t, idx++));
+    return __builtin_clz(v);
   }
-  
-  const auto& mortonCodes = getMortonCodes(triangles, boundingBox);
 
-  std::sort(triIdx.begin(), triIdx.end(), [&mortonCodes] (auto l, auto r)
+  inline int countLeadingZeros(const unsigned long long v)
   {
-    return mortonCodes[l.second] < mortonCodes[r.second];
-  });
-  
-  return triIdx;
+    return __builtin_clzll(v);
+  }
+
+  // Length of the common prefix of the keys at i and j. Equal codes are made unique by their index.
+  template <typename MortonCode>
+  inline int commonPrefix(const MortonCode* codes, const int n, const int i, const int j)
+  {
+    if (j < 0 || j >= n)
+      return -1;
+
+    const MortonCode diff = codes[i] ^ codes[j];
+
+    if (diff == 0)
+      return sizeof(MortonCode) * 8 + countLeadingZeros(static_cast<unsigned int>(i ^ j));
+
+    return countLeadingZeros(diff);
+  }
+}
+
+template <typename MortonCode>
+std::vector<MortonCode> BVHBuilder::sortTrisOnMorton()
+{
+  const int n = triIds.size();
+
+  std::vector<glm::fvec3> centroids(n);
+
+#pragma omp parallel for
+  for (int i = 0; i < n; ++i)
+    centroids[i] = triCenters[triIds[i]];
+
+  AABB centroidBox;
+  centroidBox.min = glm::fvec3(std::numeric_limits<float>::max());
+  centroidBox.max = glm::fvec3(-std::numeric_limits<float>::max());
+
+  for (const auto& c : centroids)
+    centroidBox.add(c);
+
+  std::vector<MortonCode> codes;
+  const std::vector<unsigned int> order = sortOnMorton<MortonCode>(centroids, centroidBox, codes);
+
+  std::vector<unsigned int> sortedIds(n);
+
+#pragma omp parallel for
+  for (int i = 0; i < n; ++i)
+    sortedIds[i] = triIds[order[i]];
+
+  triIds.swap(sortedIds);
+
+  return codes;
+}
+
+template <typename MortonCode>
+std::vector<Node> BVHBuilder::buildLBVH()
+{
+  const std::vector<MortonCode> codes = sortTrisOnMorton<MortonCode>();
+
+  return buildRadixTree(codes, 0, codes.size(), true);
 }
 
-void BVHBuilder::reorderTrianglesAndMaterialIds()
+// Karras, "Maximizing Parallelism in the Construction of BVHs, Octrees, and k-d Trees", 2012.
+// Every internal node of the radix tree is found independently from the sorted Morton codes.
+// The tree covers the sorted triangles [offset, offset + n).
+template <typename MortonCode>
+std::vector<Node> BVHBuilder::buildRadixTree(const std::vector<MortonCode>& sortedCodes, const int offset, const int n, const bool parallel)
 {
-  std::vector<unsigned int> triIdxMap;
-  triIdxMap.resize(trisWithIds.size());
+  // Only the OpenMP pragmas read it
+  (void) parallel;
+
+  // Without internal nodes the root would index past the ranges
+  if (n <= 0)
+    return std::vector<Node>();
 
-  for (std::size_t i = 0; i < trisWithIds.size(); ++i)
+  if (n == 1)
   {
-    triIdxMap[trisWithIds[i].second] = i;
+    Node leaf;
+    leaf.startTri = offset;
+    leaf.nTri = 1;
+    leaf.rightIndex = -1;
+    leaf.bbox = computeBB(leaf);
+
+    return std::vector<Node>(1, leaf);
   }
 
-  std::vector<unsigned int> orderedTriangleMaterialIds(triangleMaterialIds.size());
+  const MortonCode* codes = sortedCodes.data() + offset;
+
+  // Children index internal nodes in [0, n - 1) and leaves after that
+  const int nInternal = n - 1;
+  std::vector<int> leftChild(nInternal), rightChild(nInternal);
+  std::vector<int> rangeFirst(nInternal), rangeLast(nInternal);
 
-  for (std::size_t ti = 0; ti < trisWithIds.size(); ++ti)
+#pragma omp parallel for if(parallel)
+  for (int i = 0; i < nInternal; ++i)
   {
-    orderedTriangleMaterialIds[ti] = triangleMaterialIds[trisWithIds[ti].second];
+    const int d = commonPrefix(codes, n, i, i + 1) - commonPrefix(codes, n, i, i - 1) > 0 ? 1 : -1;
+    const int minPrefix = commonPrefix(codes, n, i, i - d);
+
+    long long lMax = 2;
+
+    while (commonPrefix(codes, n, i, i + lMax * d) > minPrefix)
+      lMax *= 2;
+
+    int l = 0;
+
+    for (long long t = lMax / 2; t >= 1; t /= 2)
+    {
+      if (commonPrefix(codes, n, i, i + (l + t) * d) > minPrefix)
+        l += t;
+    }
+
+    const int j = i + l * d;
+    const int nodePrefix = commonPrefix(codes, n, i, j);
+
+    int s = 0;
+    int div = 2;
+    int t = (l + div - 1) / div;
+
+    while (true)
+    {
+      if (commonPrefix(codes, n, i, i + (s + t) * d) > nodePrefix)
+        s += t;
+
+      if (t == 1)
+        break;
+
+      div *= 2;
+      t = (l + div - 1) / div;
+    }
+
+    const int split = i + s * d + std::min(d, 0);
+    const int first = std::min(i, j);
+    const int last = std::max(i, j);
+
+    leftChild[i] = first == split ? nInternal + split : split;
+    rightChild[i] = last == split + 1 ? nInternal + split + 1 : split + 1;
+    rangeFirst[i] = first;
+    rangeLast[i] = last;
   }
 
-  
-  triangleMaterialIds = orderedTriangleMaterialIds;
+  // Emit the radix tree in depth first order and collapse small ranges into leaves
+  std::vector<Node> nodes;
+  nodes.reserve(2 * n / buildParameters.minLeafSize + 1);
 
-  std::vector<unsigned int> vertIdxMap(triIdxMap.size() * 3);
+  std::stack<std::pair<int, int>> stack; // Radix tree node, index of the parent if it is a right child
+  stack.push(std::make_pair(0, -1));
 
-  for (std::size_t ti = 0; ti < triIdxMap.size(); ++ti)
+  while (!stack.empty())
   {
-    for (std::size_t vi = 0; vi < 3; ++vi)
+    const int id = stack.top().first;
+    const int parent = stack.top().second;
+    stack.pop();
+
+    const bool isInternal = id < nInternal;
+
+    Node node;
+    node.startTri = offset + (isInternal ? rangeFirst[id] : id - nInternal);
+    node.nTri = isInternal ? rangeLast[id] - rangeFirst[id] + 1 : 1;
+    node.rightIndex = -1;
+
+    const int idx = nodes.size();
+
+    if (parent != -1)
+      nodes[parent].rightIndex = idx;
+
+    if (isInternal && node.nTri > buildParameters.minLeafSize)
     {
-      vertIdxMap[vi + ti * 3] = triIdxMap[ti] * 3 + vi;
+      node.rightIndex = 0; // Set once the right child is emitted
+      stack.push(std::make_pair(rightChild[id], idx));
+      stack.push(std::make_pair(leftChild[id], -1));
     }
+
+    nodes.push_back(node);
+  }
+
+  // Children are always stored after their parent, so a reverse sweep visits them first
+#pragma omp parallel for if(parallel)
+  for (int i = 0; i < static_cast<int>(nodes.size()); ++i)
+  {
+    if (nodes[i].rightIndex == -1)
+      nodes[i].bbox = computeBB(nodes[i]);
   }
 
-  for (auto& m : meshDescriptors)
+  for (int i = nodes.size() - 1; i >= 0; --i)
   {
-    for (auto& vi : m.vertexIds)
+    Node& node = nodes[i];
+
+    if (node.rightIndex != -1)
     {
-      vi = vertIdxMap[vi];
+      node.bbox = nodes[i + 1].bbox;
+      node.bbox.add(nodes[node.rightIndex].bbox);
     }
   }
-  
-  return;
+
+  return nodes;
+}
+
+namespace
+{
+  struct MortonCluster
+  {
+    int startTri;
+    int nTri;
+    std::vector<Node> nodes;
+  };
+
+  // Top down SAH over whole clusters. Leaves of the top tree are replaced by the cluster subtrees,
+  // so the clusters in [begin, end) end up in the order their triangles are stored in.
+  void emitClusterTree(std::vector<MortonCluster>& clusters, const int begin, const int end, int& triOffset, std::vector<Node>& nodes)
+  {
+    if (end - begin == 1)
+    {
+      const MortonCluster& cluster = clusters[begin];
+      const int nodeOffset = nodes.size();
+
+      for (Node n : cluster.nodes)
+      {
+        n.startTri += triOffset - cluster.startTri;
+
+        if (n.rightIndex != -1)
+          n.rightIndex += nodeOffset;
+
+        nodes.push_back(n);
+      }
+
+      triOffset += cluster.nTri;
+
+      return;
+    }
+
+    const auto first = clusters.begin() + begin;
+    const auto last = clusters.begin() + end;
+    const int n = end - begin;
+
+    float minCost = std::numeric_limits<float>::max();
+    int minAxis = 0;
+    int minStep = 1;
+
+    std::vector<AABB> rBoxes(n);
+    std::vector<int> rCounts(n);
+
+    for (unsigned int a = 0; a < 3; ++a)
+    {
+      std::sort(first, last, [a](const MortonCluster& l, const MortonCluster& r)
+          {
+            return l.nodes[0].bbox.min[a] + l.nodes[0].bbox.max[a] < r.nodes[0].bbox.min[a] + r.nodes[0].bbox.max[a];
+          });
+
+      AABB box = clusters[end - 1].nodes[0].bbox;
+      int count = 0;
+
+      for (int i = n - 1; i > 0; --i)
+      {
+        box.add(clusters[begin + i].nodes[0].bbox);
+        count += clusters[begin + i].nTri;
+        rBoxes[i] = box;
+        rCounts[i] = count;
+      }
+
+      box = clusters[begin].nodes[0].bbox;
+      count = 0;
+
+      for (int s = 1; s < n; ++s)
+      {
+        box.add(clusters[begin + s - 1].nodes[0].bbox);
+        count += clusters[begin + s - 1].nTri;
+
+        const float currentCost = box.area() * count + rBoxes[s].area() * rCounts[s];
+
+        if (currentCost < minCost)
+        {
+          minCost = currentCost;
+          minAxis = a;
+          minStep = s;
+        }
+      }
+    }
+
+    std::sort(first, last, [minAxis](const MortonCluster& l, const MortonCluster& r)
+        {
+          return l.nodes[0].bbox.min[minAxis] + l.nodes[0].bbox.max[minAxis] < r.nodes[0].bbox.min[minAxis] + r.nodes[0].bbox.max[minAxis];
+        });
+
+    Node node;
+    node.startTri = triOffset;
+    node.nTri = 0;
+    node.bbox = clusters[begin].nodes[0].bbox;
+
+    for (auto c = first; c != last; ++c)
+    {
+      node.nTri += c->nTri;
+      node.bbox.add(c->nodes[0].bbox);
+    }
+
+    const int idx = nodes.size();
+    nodes.push_back(node);
+
+    emitClusterTree(clusters, begin, begin + minStep, triOffset, nodes);
+    nodes[idx].rightIndex = nodes.size();
+    emitClusterTree(clusters, begin + minStep, end, triOffset, nodes);
+  }
+}
+
+// Lauterbach et al. 2009 / Pantaleoni and Luebke 2010. Triangles sharing the high bits of their
+// Morton codes form a cluster whose subtree is built as a LBVH. The levels above the clusters are
+// built with a full SAH sweep, which is cheap since there are at most 2^HLBVH_MAX_CLUSTER_BITS clusters.
+template <typename MortonCode>
+std::vector<Node> BVHBuilder::buildHLBVH(WorkStealingPool& pool)
+{
+  const std::vector<MortonCode> codes = sortTrisOnMorton<MortonCode>();
+  const int n = codes.size();
+
+  // Whole octree levels only, with roughly HLBVH_MIN_CLUSTER_TRIS triangles per cluster on average
+  int clusterBits = 0;
+
+  while (clusterBits + 3 <= HLBVH_MAX_CLUSTER_BITS && static_cast<long long>(n) >> (clusterBits + 3) >= HLBVH_MIN_CLUSTER_TRIS)
+    clusterBits += 3;
+
+  const int shift = (sizeof(MortonCode) == 4 ? 30 : 63) - clusterBits;
+
+  std::vector<MortonCluster> clusters;
+
+  for (int i = 0; i < n;)
+  {
+    const MortonCode key = codes[i] >> shift;
+
+    MortonCluster cluster;
+    cluster.startTri = i;
+
+    while (i < n && codes[i] >> shift == key)
+      ++i;
+
+    cluster.nTri = i - cluster.startTri;
+    clusters.push_back(std::move(cluster));
+  }
+
+  {
+    TaskGroup group(pool);
+
+    for (auto& cluster : clusters)
+      group.run([this, &codes, &cluster] { cluster.nodes = buildRadixTree(codes, cluster.startTri, cluster.nTri, false); });
+
+    group.wait();
+  }
+
+  std::vector<Node> nodes;
+
+  if (clusters.empty())
+    return nodes;
+
+  nodes.reserve(2 * n / buildParameters.minLeafSize + 2 * clusters.size());
+
+  int triOffset = 0;
+  emitClusterTree(clusters, 0, clusters.size(), triOffset, nodes);
+
+  // Store the triangles in the order the top level visits the clusters
+  std::vector<unsigned int> orderedIds;
+  orderedIds.reserve(n);
+
+  for (const auto& cluster : clusters)
+    orderedIds.insert(orderedIds.end(), triIds.begin() + cluster.startTri, triIds.begin() + cluster.startTri + cluster.nTri);
+
+  triIds.swap(orderedIds);
+
+  return nodes;
+}
+
+namespace
+{
+  inline float unionArea(const AABB& a, const AABB& b)
+  {
+    return AABB(glm::min(a.min, b.min), glm::max(a.max, b.max)).area();
+  }
+
+  // Distance in the high bits and the neighbour in the low bits. The bit pattern of a non negative
+  // float grows with its value, so the smallest key is the nearest neighbour and ties go to the lower index.
+  inline unsigned long long neighbourKey(const float area, const int idx)
+  {
+    unsigned int bits;
+    std::memcpy(&bits, &area, sizeof(bits));
+
+    return static_cast<unsigned long long>(bits) << 32 | static_cast<unsigned int>(idx);
+  }
+
+  inline void atomicMin(std::atomic<unsigned long long>& target, const unsigned long long value)
+  {
+    unsigned long long current = target.load(std::memory_order_relaxed);
+
+    while (value < current && !target.compare_exchange_weak(current, value, std::memory_order_relaxed));
+  }
 }
 
-bool BVHBuilder::isBalanced(const Node *node, const Node* root, int* height)
+// Meister and Bittner, "Parallel Locally-Ordered Clustering for Bounding Volume Hierarchy Construction", 2018.
+// Clusters start as the Morton sorted triangles. Every sweep finds the nearest neighbour of each cluster
+// among the PLOC_SEARCH_RADIUS clusters on either side, and mutual nearest neighbours are merged.
+template <typename MortonCode>
+std::vector<Node> BVHBuilder::buildPLOC()
 {
-  int lh = 0, rh = 0;
+  sortTrisOnMorton<MortonCode>();
+
+  const int n = triIds.size();
+  std::vector<Node> nodes;
+
+  if (n == 0)
+    return nodes;
+
+  // Clusters [0, n) are the sorted triangles, merged clusters are appended
+  std::vector<AABB> boxes(2 * n - 1);
+  std::vector<int> leftChild(2 * n - 1, -1), rightChild(2 * n - 1, -1), nTris(2 * n - 1, 1);
+
+#pragma omp parallel for
+  for (int i = 0; i < n; ++i)
+    boxes[i] = triBoxes[triIds[i]];
+
+  std::vector<int> clusters(n);
+  std::iota(clusters.begin(), clusters.end(), 0);
+
+  std::vector<AABB> clusterBoxes(n);
+  std::vector<std::atomic<unsigned long long>> nearestKeys(n);
+  std::vector<int> nearest(n), offsets(n + 1), merged(n);
+  int nNodes = n;
+  int nSweeps = 0;
+
+  while (clusters.size() > 1)
+  {
+    const int nClusters = clusters.size();
+
+    // The search reads the boxes of neighbouring clusters many times, keep them contiguous
+#pragma omp parallel for
+    for (int i = 0; i < nClusters; ++i)
+      clusterBoxes[i] = boxes[clusters[i]];
+
+#pragma omp parallel for
+    for (int i = 0; i < nClusters; ++i)
+      nearestKeys[i].store(std::numeric_limits<unsigned long long>::max(), std::memory_order_relaxed);
+
+    // Every pair is evaluated once, by its lower cluster, and offered to both. Ordering pairs by
+    // distance and then index makes the globally closest pair mutual, so every sweep merges.
+#pragma omp parallel for schedule(dynamic, 1024)
+    for (int i = 0; i < nClusters; ++i)
+    {
+      const AABB& box = clusterBoxes[i];
+      unsigned long long minKey = std::numeric_limits<unsigned long long>::max();
+
+      for (int j = i + 1; j <= std::min(i + PLOC_SEARCH_RADIUS, nClusters - 1); ++j)
+      {
+        const float area = unionArea(box, clusterBoxes[j]);
+
+        minKey = std::min(minKey, neighbourKey(area, j));
+        atomicMin(nearestKeys[j], neighbourKey(area, i));
+      }
+
+      atomicMin(nearestKeys[i], minKey);
+    }
+
+#pragma omp parallel for
+    for (int i = 0; i < nClusters; ++i)
+      nearest[i] = nearestKeys[i].load(std::memory_order_relaxed) & 0xFFFFFFFFu;
+
+    // The lower cluster of a mutual pair creates the parent, the upper one disappears
+    offsets[0] = 0;
+
+    for (int i = 0; i < nClusters; ++i)
+    {
+      const int j = nearest[i];
+      merged[i] = nearest[j] == i ? (i < j ? 1 : -1) : 0;
+      offsets[i + 1] = offsets[i] + (merged[i] == 1);
+    }
+
+    std::vector<int> next(nClusters);
+    std::vector<int> kept(nClusters + 1);
+    kept[0] = 0;
+
+    for (int i = 0; i < nClusters; ++i)
+      kept[i + 1] = kept[i] + (merged[i] != -1);
+
+#pragma omp parallel for
+    for (int i = 0; i < nClusters; ++i)
+    {
+      if (merged[i] == -1)
+        continue;
+
+      int cluster = clusters[i];
+
+      if (merged[i] == 1)
+      {
+        const int other = clusters[nearest[i]];
+        const int parent = nNodes + offsets[i];
+
+        boxes[parent] = boxes[cluster];
+        boxes[parent].add(boxes[other]);
+        leftChild[parent] = cluster;
+        rightChild[parent] = other;
+        nTris[parent] = nTris[cluster] + nTris[other];
+        cluster = parent;
+      }
+
+      next[kept[i]] = cluster;
+    }
 
-  int l = 0, r = 0;  void reorderIndices(const std::vector<unsigned int>& triRIdxMap);
+    next.resize(kept[nClusters]);
+    nNodes += offsets[nClusters];
+    clusters.swap(next);
+    ++nSweeps;
+  }
+
+  // Emit depth first, collapse small subtrees into leaves and store the triangles in leaf order
+  std::vector<unsigned int> orderedIds;
+  orderedIds.reserve(n);
+  nodes.reserve(2 * n / buildParameters.minLeafSize + 1);
 
-  if(node->rightIndex == -1)
+  std::stack<std::pair<int, int>> stack; // Cluster, index of the parent if it is a right child
+  stack.push(std::make_pair(clusters[0], -1));
+
+  while (!stack.empty())
   {
-    *height = 1;
-     return 1;
+    const int id = stack.top().first;
+    const int parent = stack.top().second;
+    stack.pop();
+
+    Node node;
+    node.bbox = boxes[id];
+    node.startTri = orderedIds.size();
+    node.nTri = nTris[id];
+    node.rightIndex = -1;
+
+    const int idx = nodes.size();
+
+    if (parent != -1)
+      nodes[parent].rightIndex = idx;
+
+    if (nTris[id] > buildParameters.minLeafSize)
+    {
+      node.rightIndex = 0; // Set once the right child is emitted
+      stack.push(std::make_pair(rightChild[id], idx));
+      stack.push(std::make_pair(leftChild[id], -1));
+    }
+    else
+    {
+      std::stack<int> leafStack;
+      leafStack.push(id);
+
+      while (!leafStack.empty())
+      {
+        const int c = leafStack.top();
+        leafStack.pop();
+
+        if (c < n)
+        {
+          orderedIds.push_back(triIds[c]);
+        }
+        else
+        {
+          leafStack.push(rightChild[c]);
+          leafStack.push(leftChild[c]);
+        }
+      }
+    }
+
+    nodes.push_back(node);
   }
 
-  l = isBalanced(node + 1, root, &lh);
-  r = isBalanced(root + node->rightIndex, root, &rh);
+  triIds.swap(orderedIds);
+
+  if (buildParameters.printStatistics)
+    std::cout << "PLOC sweeps: " << nSweeps << std::endl;
+
+  return nodes;
+}
+
+// Applies the final permutation. The mesh descriptors index the shared vertices, which keep their order.
+// The material ids are gathered into a new array: spatial splits can repeat a source triangle, so the
+// permutation can't be applied in place, and the getters move the results out after every build.
+void BVHBuilder::reorderTrianglesAndMaterialIds(const std::vector<glm::uvec3>& sourceIndices)
+{
+  const int n = triIds.size();
+
+  triangleIndices.resize(n);
+  std::vector<unsigned int> orderedTriangleMaterialIds(n);
 
-  *height = (lh > rh ? lh : rh) + 1;
+#pragma omp parallel for
+  for (int ti = 0; ti < n; ++ti)
+  {
+    const unsigned int source = triIds[ti];
 
-  if((lh - rh >= 2) || (rh - lh >= 2))
-    return 0;
+    triangleIndices[ti] = sourceIndices[source];
+    orderedTriangleMaterialIds[ti] = triangleMaterialIds[source];
+  }
 
-  else return l && r;
+  triangleMaterialIds.swap(orderedTriangleMaterialIds);
 }
 
 void BVHBuilder::sortTrisOnAxis(const Node& node, const unsigned int axis)
 {
-  const auto start = trisWithIds.begin() + node.startTri;
+  const auto start = triIds.begin() + node.startTri;
   const auto end = start + node.nTri;
 
-  __gnu_parallel::sort(start, end, [axis](const std::pair<Triangle, unsigned int>& l, const std::pair<Triangle, unsigned int>& r)
+  const glm::fvec3* centers = triCenters.data();
+  const auto comp = [centers, axis](const unsigned int l, const unsigned int r)
       {
-        return l.first.center()[axis] < r.first.center()[axis];
-      });
+        return centers[l][axis] < centers[r][axis];
+      };
+
+  // Only the root is split while the pool is idle. Below it the subtrees already keep all cores busy.
+  if (node.nTri == static_cast<int>(triIds.size()))
+    __gnu_parallel::sort(start, end, comp);
+  else
+    std::sort(start, end, comp);
 }
 
 bool BVHBuilder::splitNode(const Node& node, Node& leftChild, Node& rightChild, const SplitMode splitMode)
 {
   if (splitMode == SplitMode::OBJECT_MEDIAN)
 	{
-    if (node.nTri > static_cast<int>(MAX_TRIS_PER_LEAF))
+    if (node.nTri > buildParameters.minLeafSize)
     {
       leftChild.startTri = node.startTri;
       leftChild.nTri = node.nTri / 2;
@@ -261,12 +871,9 @@ bool BVHBuilder::splitNode(const Node& node, Node& leftChild, Node& rightChild,
 	}
 	else if (splitMode == SplitMode::SAH)
 	{
-    if (node.nTri <= static_cast<int>(MAX_TRIS_PER_LEAF))
+    if (node.nTri <= buildParameters.minLeafSize)
       return false;
 
-		const float sa = node.bbox.area();
-		const float parentCost = node.nTri * sa;
-
 		float minCost = std::numeric_limits<float>::max();
 		int minStep = -1;
     const unsigned int a = node.bbox.maxAxis();
@@ -276,30 +883,30 @@ bool BVHBuilder::splitNode(const Node& node, Node& leftChild, Node& rightChild,
     const int fStart = node.startTri;
     const int fEnd = node.startTri + node.nTri - 1;
 
-    AABB fBox = trisWithIds[fStart].first.bbox();
+    AABB fBox = triBoxes[triIds[fStart]];
     std::vector<AABB> fBoxes(node.nTri - 1);
 
     for (int i = fStart; i < fEnd; ++i)
     {
-      fBox.add(trisWithIds[i].first);
+      fBox.add(triBoxes[triIds[i]]);
       fBoxes[i - node.startTri] = fBox;
     }
 
-    AABB rBox = trisWithIds[fEnd].first.bbox();
-    std::vector<AABB> rBoxes(node.nTri - 1);
+    // rBoxes[s] bounds the triangles from s to the end
+    AABB rBox = triBoxes[triIds[fEnd]];
+    std::vector<AABB> rBoxes(node.nTri);
 
-    for (int i = fEnd - 1; i > fStart - 1; --i)
+    for (int i = fEnd; i > fStart; --i)
     {
-      rBox.add(trisWithIds[i].first);
+      rBox.add(triBoxes[triIds[i]]);
       rBoxes[i - node.startTri] = rBox;
     }
 
-#pragma omp parallel for
-    for (int s = 1; s < node.nTri - 1; ++s)
+    // Subtrees are built in parallel, the sweep itself is cheap compared to the sort
+    for (int s = 1; s < node.nTri; ++s)
     {
-      const float currentCost = fBoxes[s - 1].area() * s + rBoxes[s - 1].area() * (node.nTri - s);
+      const float currentCost = fBoxes[s - 1].area() * s + rBoxes[s].area() * (node.nTri - s);
 
-#pragma omp critical
       if (currentCost < minCost)
       {
         minCost = currentCost;
@@ -307,7 +914,7 @@ bool BVHBuilder::splitNode(const Node& node, Node& leftChild, Node& rightChild,
       }
     }
 
-		if (minCost < parentCost)
+		if (!isCheaperAsLeaf(node, minCost))
 		{
 			leftChild.startTri = node.startTri;
 			leftChild.nTri = minStep;
@@ -315,7 +922,7 @@ bool BVHBuilder::splitNode(const Node& node, Node& leftChild, Node& rightChild,
 
 			rightChild.startTri = node.startTri + minStep;
 			rightChild.nTri = node.nTri - minStep;
-			rightChild.bbox = rBoxes[minStep - 1];
+			rightChild.bbox = rBoxes[minStep];
 
 			return true;
 		}else
@@ -323,29 +930,583 @@ bool BVHBuilder::splitNode(const Node& node, Node& leftChild, Node& rightChild,
 		  return false;
 		}
 
+	}
+	else if (splitMode == SplitMode::BINNED_SAH)
+	{
+	  return splitNodeBinned(node, leftChild, rightChild);
 	}else
 	  throw std::runtime_error("Unknown BVH split type");
 }
 
-void BVHBuilder::build(const enum SplitMode splitMode, const std::vector<Triangle>& triangles, const std::vector<unsigned int>& triangleMaterialIds, const std::vector<MeshDescriptor>& meshDescriptors)
+bool BVHBuilder::splitNodeBinned(const Node& node, Node& leftChild, Node& rightChild)
 {
-  this->triangleMaterialIds = triangleMaterialIds;
-  this->meshDescriptors = meshDescriptors;
-  
-  unsigned int idx = 0;
+  if (node.nTri <= buildParameters.minLeafSize)
+    return false;
 
-  for (auto t : triangles)
+  struct Bin
   {
-    trisWithIds.push_back(std::make_pair(t, idx++));
-  }
-  
-  Node root;
-  root.startTri = 0;
-  root.nTri = triangles.size();
-  root.bbox = computeBB(root);
-  root.rightIndex = -1;
-  
-  
+    AABB bbox;
+    int count;
+  };
+
+  const glm::fvec3 emptyMin = glm::fvec3(std::numeric_limits<float>::max());
+  const glm::fvec3 emptyMax = glm::fvec3(-std::numeric_limits<float>::max());
+
+  AABB centroidBox;
+  centroidBox.min = emptyMin;
+  centroidBox.max = emptyMax;
+
+  for (int ti = node.startTri; ti < node.startTri + node.nTri; ++ti)
+    centroidBox.add(triCenters[triIds[ti]]);
+
+  float minCost = std::numeric_limits<float>::max();
+  int minAxis = -1;
+  int minBin = -1;
+  AABB minLeftBox, minRightBox;
+
+  // Evaluate SAH_BINS - 1 candidate planes on every axis. The bins live on the stack
+  // so no allocations are done per node.
+  for (unsigned int a = 0; a < 3; ++a)
+  {
+    const float extent = centroidBox.max[a] - centroidBox.min[a];
+
+    if (extent <= 0.f)
+      continue;
+
+    const float k = SAH_BINS / extent;
+
+    std::array<Bin, SAH_BINS> bins;
+
+    for (auto& b : bins)
+    {
+      b.bbox.min = emptyMin;
+      b.bbox.max = emptyMax;
+      b.count = 0;
+    }
+
+    for (int ti = node.startTri; ti < node.startTri + node.nTri; ++ti)
+    {
+      const unsigned int id = triIds[ti];
+      const int b = std::min(static_cast<int>((triCenters[id][a] - centroidBox.min[a]) * k), SAH_BINS - 1);
+
+      ++bins[b].count;
+      bins[b].bbox.add(triBoxes[id]);
+    }
+
+    std::array<AABB, SAH_BINS - 1> leftBoxes;
+    std::array<int, SAH_BINS - 1> leftCounts;
+
+    AABB box = bins[0].bbox;
+    int count = 0;
+
+    for (int b = 0; b < SAH_BINS - 1; ++b)
+    {
+      if (bins[b].count > 0)
+        box.add(bins[b].bbox);
+
+      count += bins[b].count;
+
+      leftBoxes[b] = box;
+      leftCounts[b] = count;
+    }
+
+    box = bins[SAH_BINS - 1].bbox;
+    count = 0;
+
+    for (int b = SAH_BINS - 1; b > 0; --b)
+    {
+      if (bins[b].count > 0)
+        box.add(bins[b].bbox);
+
+      count += bins[b].count;
+
+      if (count == 0 || leftCounts[b - 1] == 0)
+        continue;
+
+      const float currentCost = leftBoxes[b - 1].area() * leftCounts[b - 1] + box.area() * count;
+
+      if (currentCost < minCost)
+      {
+        minCost = currentCost;
+        minAxis = a;
+        minBin = b;
+        minLeftBox = leftBoxes[b - 1];
+        minRightBox = box;
+      }
+    }
+  }
+
+  if (minAxis == -1)
+  {
+    // All centroids coincide, no plane separates them.
+    return splitNode(node, leftChild, rightChild, SplitMode::OBJECT_MEDIAN);
+  }
+
+  if (isCheaperAsLeaf(node, minCost))
+    return false;
+
+  const float k = SAH_BINS / (centroidBox.max[minAxis] - centroidBox.min[minAxis]);
+  const float cmin = centroidBox.min[minAxis];
+  const int a = minAxis;
+  const int splitBin = minBin;
+
+  const glm::fvec3* centers = triCenters.data();
+  const auto start = triIds.begin() + node.startTri;
+  const auto end = start + node.nTri;
+  const auto mid = std::partition(start, end, [centers, a, k, cmin, splitBin](const unsigned int id)
+      {
+        return std::min(static_cast<int>((centers[id][a] - cmin) * k), SAH_BINS - 1) < splitBin;
+      });
+
+  const int nLeft = static_cast<int>(mid - start);
+
+  leftChild.startTri = node.startTri;
+  leftChild.nTri = nLeft;
+  leftChild.bbox = minLeftBox;
+
+  rightChild.startTri = node.startTri + nLeft;
+  rightChild.nTri = node.nTri - nLeft;
+  rightChild.bbox = minRightBox;
+
+  return true;
+}
+
+// splitCost is the sum of area times triangle count over the children
+bool BVHBuilder::isCheaperAsLeaf(const Node& node, const float splitCost) const
+{
+  if (node.nTri > buildParameters.maxLeafSize)
+    return false;
+
+  const float area = node.bbox.area();
+
+  return buildParameters.traversalCost * area + buildParameters.intersectionCost * splitCost >= buildParameters.intersectionCost * node.nTri * area;
+}
+
+// The bottom up builders split down to the minimum leaf size. Walking up from the leaves, every
+// subtree that is cheaper as a single leaf is replaced by one. Inner nodes cover a contiguous range
+// of triangles, so only the nodes change.
+void BVHBuilder::collapseLeaves()
+{
+  const int n = bvh.size();
+
+  if (n < 3)
+    return;
+
+  std::vector<float> costs(n);
+  std::vector<int> subtreeEnds(n);
+  std::vector<char> collapsed(n, 0);
+
+  // Children are always stored after their parent and the subtree of a node is contiguous
+  for (int i = n - 1; i >= 0; --i)
+  {
+    const Node& node = bvh[i];
+    const float leafCost = buildParameters.intersectionCost * node.nTri * node.bbox.area();
+
+    if (node.rightIndex == -1)
+    {
+      costs[i] = leafCost;
+      subtreeEnds[i] = i + 1;
+      continue;
+    }
+
+    const float splitCost = buildParameters.traversalCost * node.bbox.area() + costs[i + 1] + costs[node.rightIndex];
+
+    collapsed[i] = node.nTri <= buildParameters.maxLeafSize && leafCost <= splitCost;
+    costs[i] = collapsed[i] ? leafCost : splitCost;
+    subtreeEnds[i] = subtreeEnds[node.rightIndex];
+  }
+
+  std::vector<int> newIndices(n, -1);
+  int nKept = 0;
+
+  for (int i = 0; i < n; i = collapsed[i] ? subtreeEnds[i] : i + 1)
+    newIndices[i] = nKept++;
+
+  if (nKept == n)
+    return;
+
+  std::vector<Node> nodes;
+  nodes.reserve(nKept);
+
+  for (int i = 0; i < n; i = collapsed[i] ? subtreeEnds[i] : i + 1)
+  {
+    Node node = bvh[i];
+
+    if (collapsed[i])
+      node.rightIndex = -1;
+    else if (node.rightIndex != -1)
+      node.rightIndex = newIndices[node.rightIndex];
+
+    nodes.push_back(node);
+  }
+
+  if (buildParameters.printStatistics)
+    std::cout << "Collapsed " << n - nKept << " of " << n << " nodes into leaves" << std::endl;
+
+  bvh.swap(nodes);
+}
+
+float BVHBuilder::computeSAHCost(const std::vector<Node>& bvh)
+{
+  if (bvh.empty())
+    return 0.f;
+
+  const float rootArea = bvh[0].bbox.area();
+
+  if (rootArea <= 0.f)
+    return 0.f;
+
+  float cost = 0.f;
+
+  for (const auto& node : bvh)
+  {
+    if (node.rightIndex == -1)
+      cost += SAH_INTERSECTION_COST * node.nTri * node.bbox.area();
+    else
+      cost += SAH_TRAVERSAL_COST * node.bbox.area();
+  }
+
+  return cost / rootArea;
+}
+
+// Recomputes the bounds of a tree whose triangles have moved. The topology and triangle order are kept.
+// Nodes are bucketed by depth so every level can be refit in parallel, starting from the deepest one.
+void BVHBuilder::refit(std::vector<Node>& bvh, const IndexedTriangles& triangles)
+{
+  const int n = bvh.size();
+
+  if (n == 0)
+    return;
+
+  // Parents are always stored before their children
+  std::vector<int> depth(n, 0);
+  int maxDepth = 0;
+
+  for (int i = 0; i < n; ++i)
+  {
+    if (bvh[i].rightIndex != -1)
+    {
+      depth[i + 1] = depth[i] + 1;
+      depth[bvh[i].rightIndex] = depth[i] + 1;
+      maxDepth = std::max(maxDepth, depth[i] + 1);
+    }
+  }
+
+  std::vector<int> levelStart(maxDepth + 2, 0);
+
+  for (int i = 0; i < n; ++i)
+    ++levelStart[depth[i] + 1];
+
+  std::partial_sum(levelStart.begin(), levelStart.end(), levelStart.begin());
+
+  std::vector<int> levelNodes(n);
+  std::vector<int> fill(levelStart.begin(), levelStart.end() - 1);
+
+  for (int i = 0; i < n; ++i)
+    levelNodes[fill[depth[i]]++] = i;
+
+  for (int d = maxDepth; d >= 0; --d)
+  {
+#pragma omp parallel for
+    for (int li = levelStart[d]; li < levelStart[d + 1]; ++li)
+    {
+      Node& node = bvh[levelNodes[li]];
+
+      if (node.rightIndex == -1)
+      {
+        if (node.nTri == 0)
+          continue;
+
+        node.bbox = AABB(triangles.position(node.startTri, 0), triangles.position(node.startTri, 1));
+
+        for (int ti = node.startTri; ti < node.startTri + node.nTri; ++ti)
+        {
+          for (unsigned int v = 0; v < 3; ++v)
+            node.bbox.add(triangles.position(ti, v));
+        }
+      }
+      else
+      {
+        node.bbox = bvh[levelNodes[li] + 1].bbox;
+        node.bbox.add(bvh[node.rightIndex].bbox);
+      }
+    }
+  }
+}
+
+namespace
+{
+  // Explicit tree used while treelets are restructured. Leaves have left == -1.
+  struct TreeletNode
+  {
+    AABB bbox;
+    int left;
+    int right;
+    int parent;
+    int startTri;
+    int nTri;
+    float cost;
+  };
+
+  // Karras and Aila 2013. The treelet below root is grown to TREELET_LEAVES leaves by repeatedly
+  // opening the leaf with the largest area. The cheapest binary topology over those leaves is found
+  // by dynamic programming over all leaf subsets and replaces the treelet if it lowers the SAH cost.
+  void restructureTreelet(std::vector<TreeletNode>& nodes, const int root, const float traversalCost)
+  {
+    TreeletNode& r = nodes[root];
+
+    int leaves[TREELET_LEAVES] = {r.left, r.right};
+    int internals[TREELET_LEAVES - 2];
+    int nLeaves = 2;
+    int nInternals = 0;
+
+    while (nLeaves < TREELET_LEAVES)
+    {
+      int largest = -1;
+      float largestArea = -1.f;
+
+      for (int i = 0; i < nLeaves; ++i)
+      {
+        const TreeletNode& n = nodes[leaves[i]];
+
+        if (n.left != -1 && n.bbox.area() > largestArea)
+        {
+          largest = i;
+          largestArea = n.bbox.area();
+        }
+      }
+
+      if (largest == -1)
+        break;
+
+      const int opened = leaves[largest];
+      internals[nInternals++] = opened;
+      leaves[largest] = nodes[opened].left;
+      leaves[nLeaves++] = nodes[opened].right;
+    }
+
+    const float currentCost = traversalCost * r.bbox.area() + nodes[r.left].cost + nodes[r.right].cost;
+
+    if (nLeaves < 3)
+    {
+      r.cost = currentCost;
+      return;
+    }
+
+    const int nSubsets = 1 << nLeaves;
+    AABB boxes[1 << TREELET_LEAVES];
+    float costs[1 << TREELET_LEAVES];
+    int partitions[1 << TREELET_LEAVES];
+
+    // A proper subset always compares smaller than its superset, so subsets are ready in numeric order
+    for (int s = 1; s < nSubsets; ++s)
+    {
+      const int lowest = s & -s;
+      const int leaf = __builtin_ctz(s);
+
+      if (s == lowest)
+      {
+        boxes[s] = nodes[leaves[leaf]].bbox;
+        costs[s] = nodes[leaves[leaf]].cost;
+        continue;
+      }
+
+      boxes[s] = boxes[s ^ lowest];
+      boxes[s].add(boxes[lowest]);
+
+      // Only partitions holding the lowest leaf on the left are visited, the mirrored ones cost the same
+      float minCost = std::numeric_limits<float>::max();
+      int minPartition = lowest;
+
+      for (int p = (s - 1) & s; p > 0; p = (p - 1) & s)
+      {
+        if (!(p & lowest))
+          continue;
+
+        const float c = costs[p] + costs[s ^ p];
+
+        if (c < minCost)
+        {
+          minCost = c;
+          minPartition = p;
+        }
+      }
+
+      costs[s] = traversalCost * boxes[s].area() + minCost;
+      partitions[s] = minPartition;
+    }
+
+    const int all = nSubsets - 1;
+
+    if (costs[all] >= currentCost * (1.f - 1e-5f))
+    {
+      r.cost = currentCost;
+      return;
+    }
+
+    // The treelet root keeps its index and the opened nodes are reused for the new inner nodes
+    int nextInternal = 0;
+
+    std::function<void(int, int)> emit = [&](const int s, const int idx)
+    {
+      TreeletNode& node = nodes[idx];
+      node.bbox = boxes[s];
+      node.cost = costs[s];
+
+      const int sides[2] = {partitions[s], s ^ partitions[s]};
+      int children[2];
+
+      for (int c = 0; c < 2; ++c)
+      {
+        if (__builtin_popcount(sides[c]) == 1)
+          children[c] = leaves[__builtin_ctz(sides[c])];
+        else
+          children[c] = internals[nextInternal++];
+
+        nodes[children[c]].parent = idx;
+      }
+
+      node.left = children[0];
+      node.right = children[1];
+
+      for (int c = 0; c < 2; ++c)
+        if (__builtin_popcount(sides[c]) > 1)
+          emit(sides[c], children[c]);
+    };
+
+    emit(all, root);
+  }
+}
+
+// Optimizes the topology of the finished tree in place. Every pass walks up from the leaves and
+// restructures a node's treelet once both of its subtrees are done, so independent subtrees are
+// processed in parallel. The leaves are kept and the triangles are reordered to match the new tree.
+void BVHBuilder::optimizeTreelets(const int nPasses)
+{
+  const int n = bvh.size();
+
+  if (n < 3 || nPasses <= 0)
+    return;
+
+  const auto start = std::chrono::high_resolution_clock::now();
+  const float costBefore = computeSAHCost(bvh);
+
+  std::vector<TreeletNode> nodes(n);
+  std::vector<int> leafIndices;
+
+  nodes[0].parent = -1;
+
+  for (int i = 0; i < n; ++i)
+  {
+    const Node& node = bvh[i];
+    TreeletNode& t = nodes[i];
+
+    t.bbox = node.bbox;
+    t.startTri = node.startTri;
+    t.nTri = node.nTri;
+
+    if (node.rightIndex == -1)
+    {
+      t.left = -1;
+      t.right = -1;
+      t.cost = buildParameters.intersectionCost * node.nTri * node.bbox.area();
+      leafIndices.push_back(i);
+    }
+    else
+    {
+      t.left = i + 1;
+      t.right = node.rightIndex;
+      nodes[i + 1].parent = i;
+      nodes[node.rightIndex].parent = i;
+    }
+  }
+
+  const int nLeaves = leafIndices.size();
+  std::vector<std::atomic<int>> visits(n);
+
+  for (int pass = 0; pass < nPasses; ++pass)
+  {
+    for (auto& v : visits)
+      v.store(0, std::memory_order_relaxed);
+
+    // The second thread to reach a node owns it, by then both subtrees are final
+#pragma omp parallel for schedule(dynamic, 256)
+    for (int li = 0; li < nLeaves; ++li)
+    {
+      int idx = nodes[leafIndices[li]].parent;
+
+      while (idx != -1 && visits[idx].fetch_add(1) == 1)
+      {
+        restructureTreelet(nodes, idx, buildParameters.traversalCost);
+        idx = nodes[idx].parent;
+      }
+    }
+  }
+
+  // Emit the tree depth first again and move the leaf triangle ranges along
+  std::vector<Node> optimized;
+  std::vector<unsigned int> reordered;
+  optimized.reserve(n);
+  reordered.reserve(triIds.size());
+
+  std::stack<std::pair<int, int>> stack;
+  stack.push(std::make_pair(0, -1));
+
+  while (!stack.empty())
+  {
+    const int idx = stack.top().first;
+    const int parent = stack.top().second;
+    stack.pop();
+
+    if (parent != -1)
+      optimized[parent].rightIndex = optimized.size();
+
+    const TreeletNode& t = nodes[idx];
+
+    Node node;
+    node.bbox = t.bbox;
+    node.rightIndex = -1;
+    node.startTri = reordered.size();
+    node.nTri = 0;
+
+    if (t.left == -1)
+    {
+      node.nTri = t.nTri;
+      reordered.insert(reordered.end(), triIds.begin() + t.startTri, triIds.begin() + t.startTri + t.nTri);
+    }
+    else
+    {
+      stack.push(std::make_pair(t.right, static_cast<int>(optimized.size())));
+      stack.push(std::make_pair(t.left, -1));
+    }
+
+    optimized.push_back(node);
+  }
+
+  // Inner nodes cover the triangles of their subtree, children are stored after their parents
+  for (int i = n - 1; i >= 0; --i)
+  {
+    Node& node = optimized[i];
+
+    if (node.rightIndex != -1)
+    {
+      node.startTri = optimized[i + 1].startTri;
+      node.nTri = optimized[i + 1].nTri + optimized[node.rightIndex].nTri;
+    }
+  }
+
+  bvh = std::move(optimized);
+  triIds = std::move(reordered);
+
+  const auto end = std::chrono::high_resolution_clock::now();
+  const float millis = std::chrono::duration<float, std::milli>(end - start).count();
+
+  if (buildParameters.printStatistics)
+    std::cout << "Treelet optimization: " << nPasses << " passes in " << millis << " ms, SAH cost " << costBefore << " -> " << computeSAHCost(bvh) << std::endl;
+}
+
+std::vector<Node> BVHBuilder::buildSubtree(const Node& root, const SplitMode splitMode)
+{
   // This is a simple top down approach that places the nodes in an array.
   // This makes the transfer to GPU simple.
   std::stack<Node> stack;
@@ -354,11 +1515,10 @@ void BVHBuilder::build(const enum SplitMode splitMode, const std::vector<Triangl
   std::vector<Node> finishedNodes;
   std::vector<int> touchCount;
 
-  const unsigned int nodecountAppr = 0;
+  const unsigned int nodecountAppr = 2 * root.nTri / buildParameters.minLeafSize;
   finishedNodes.reserve(nodecountAppr);
   touchCount.reserve(nodecountAppr);
 
-  int leafCount = 0;
   int nodeCount = 0;
 
   stack.push(root);
@@ -384,7 +1544,6 @@ void BVHBuilder::build(const enum SplitMode splitMode, const std::vector<Triangl
     }
     else
     {
-      ++leafCount;
       node.rightIndex = -1;
     }
 
@@ -406,33 +1565,782 @@ void BVHBuilder::build(const enum SplitMode splitMode, const std::vector<Triangl
 
   }
 
-  this->bvh = finishedNodes;
-  
-  reorderTrianglesAndMaterialIds();
+  return finishedNodes;
 }
 
-std::vector<Node> BVHBuilder::getBVH()
+std::vector<Node> BVHBuilder::buildParallel(Node node, const SplitMode splitMode, WorkStealingPool& pool)
 {
-  return this->bvh;
-}
+  if (node.nTri < BVH_TASK_MIN_TRIS)
+    return buildSubtree(node, splitMode);
 
-std::vector<Triangle> BVHBuilder::getTriangles()
-{
-  std::vector<Triangle> triangles(trisWithIds.size());
-  
-  for (unsigned int i = 0; i < trisWithIds.size(); ++i)
-    triangles[i] = trisWithIds[i].first;
-    
-  return triangles;
-}
+  Node left, right;
 
-std::vector<unsigned int> BVHBuilder::getTriangleMaterialIds()
-{
-  return triangleMaterialIds;
+  if (!splitNode(node, left, right, splitMode))
+  {
+    node.rightIndex = -1;
+    return std::vector<Node>(1, node);
+  }
+
+  // The children cover disjoint ranges of triIds so they can be split concurrently
+  std::vector<Node> leftNodes, rightNodes;
+
+  TaskGroup group(pool);
+  group.run([&] { leftNodes = buildParallel(left, splitMode, pool); });
+  rightNodes = buildParallel(right, splitMode, pool);
+  group.wait();
+
+  // Merge into depth first order: the node, its left subtree and then its right subtree
+  std::vector<Node> nodes;
+  nodes.reserve(1 + leftNodes.size() + rightNodes.size());
+
+  node.rightIndex = 1 + leftNodes.size();
+  nodes.push_back(node);
+
+  for (const auto* subtree : { &leftNodes, &rightNodes })
+  {
+    const int offset = nodes.size();
+
+    for (Node n : *subtree)
+    {
+      if (n.rightIndex != -1)
+        n.rightIndex += offset;
+
+      nodes.push_back(n);
+    }
+  }
+
+  return nodes;
 }
 
-std::vector<MeshDescriptor> BVHBuilder::getMeshDescriptors()
+namespace
 {
-  return meshDescriptors;
-}
+  struct SBVHSplit
+  {
+    float cost;
+    unsigned int axis;
+    int bin;
+    AABB leftBox;
+    AABB rightBox;
+    int nLeft;
+    int nRight;
+
+    SBVHSplit() : cost(std::numeric_limits<float>::max()), axis(0), bin(0), leftBox(), rightBox(), nLeft(0), nRight(0) {};
+  };
+
+  inline AABB emptyBox()
+  {
+    AABB box;
+    box.min = glm::fvec3(std::numeric_limits<float>::max());
+    box.max = glm::fvec3(-std::numeric_limits<float>::max());
+
+    return box;
+  }
+
+  inline float overlapArea(const AABB& a, const AABB& b)
+  {
+    const glm::fvec3 lo = glm::max(a.min, b.min);
+    const glm::fvec3 hi = glm::min(a.max, b.max);
+
+    if (lo.x > hi.x || lo.y > hi.y || lo.z > hi.z)
+      return 0.f;
 
+    return AABB(lo, hi).area();
+  }
+
+  // Splits the part of the triangle inside ref.bbox with an axis aligned plane
+  void splitReference(const IndexedTriangles& tris, const TriangleReference& ref, const unsigned int axis, const float position, TriangleReference& left, TriangleReference& right)
+  {
+    left.triIdx = ref.triIdx;
+    right.triIdx = ref.triIdx;
+    left.bbox = emptyBox();
+    right.bbox = emptyBox();
+
+    for (unsigned int i = 0; i < 3; ++i)
+    {
+      const glm::fvec3& v0 = tris.position(ref.triIdx, i);
+      const glm::fvec3& v1 = tris.position(ref.triIdx, (i + 1) % 3);
+
+      if (v0[axis] <= position)
+        left.bbox.add(v0);
+
+      if (v0[axis] >= position)
+        right.bbox.add(v0);
+
+      if ((v0[axis] < position && v1[axis] > position) || (v0[axis] > position && v1[axis] < position))
+      {
+        glm::fvec3 p = v0 + (v1 - v0) * ((position - v0[axis]) / (v1[axis] - v0[axis]));
+        p[axis] = position;
+
+        left.bbox.add(p);
+        right.bbox.add(p);
+      }
+    }
+
+    left.bbox.max[axis] = position;
+    right.bbox.min[axis] = position;
+
+    // Clip to the reference. The max is clamped so a sliver that misses the reference stays a valid box.
+    for (auto* r : { &left, &right })
+    {
+      r->bbox.min = glm::max(r->bbox.min, ref.bbox.min);
+      r->bbox.max = glm::max(glm::min(r->bbox.max, ref.bbox.max), r->bbox.min);
+    }
+  }
+
+  bool findObjectSplit(const std::vector<TriangleReference>& refs, SBVHSplit& split)
+  {
+    struct Bin
+    {
+      AABB bbox;
+      int count;
+    };
+
+    AABB centroidBox = emptyBox();
+
+    for (const auto& r : refs)
+      centroidBox.add((r.bbox.min + r.bbox.max) * 0.5f);
+
+    split.cost = std::numeric_limits<float>::max();
+
+    for (unsigned int a = 0; a < 3; ++a)
+    {
+      const float extent = centroidBox.max[a] - centroidBox.min[a];
+
+      if (extent <= 0.f)
+        continue;
+
+      const float k = SAH_BINS / extent;
+
+      std::array<Bin, SAH_BINS> bins;
+
+      for (auto& b : bins)
+      {
+        b.bbox = emptyBox();
+        b.count = 0;
+      }
+
+      for (const auto& r : refs)
+      {
+        const int b = std::min(static_cast<int>(((r.bbox.min[a] + r.bbox.max[a]) * 0.5f - centroidBox.min[a]) * k), SAH_BINS - 1);
+
+        ++bins[b].count;
+        bins[b].bbox.add(r.bbox);
+      }
+
+      std::array<AABB, SAH_BINS - 1> leftBoxes;
+      std::array<int, SAH_BINS - 1> leftCounts;
+
+      AABB box = emptyBox();
+      int count = 0;
+
+      for (int b = 0; b < SAH_BINS - 1; ++b)
+      {
+        box.add(bins[b].bbox);
+        count += bins[b].count;
+
+        leftBoxes[b] = box;
+        leftCounts[b] = count;
+      }
+
+      box = emptyBox();
+      count = 0;
+
+      for (int b = SAH_BINS - 1; b > 0; --b)
+      {
+        box.add(bins[b].bbox);
+        count += bins[b].count;
+
+        if (count == 0 || leftCounts[b - 1] == 0)
+          continue;
+
+        const float currentCost = leftBoxes[b - 1].area() * leftCounts[b - 1] + box.area() * count;
+
+        if (currentCost < split.cost)
+        {
+          split.cost = currentCost;
+          split.axis = a;
+          split.bin = b;
+          split.leftBox = leftBoxes[b - 1];
+          split.rightBox = box;
+          split.nLeft = leftCounts[b - 1];
+          split.nRight = count;
+        }
+      }
+    }
+
+    return split.cost < std::numeric_limits<float>::max();
+  }
+
+  // Stich et al., "Spatial Splits in Bounding Volume Hierarchies", 2009. References are chopped into
+  // SAH_BINS equally sized slabs of the node. Every reference enters one bin and exits another.
+  bool findSpatialSplit(const IndexedTriangles& tris, const std::vector<TriangleReference>& refs, const AABB& nodeBox, SBVHSplit& split)
+  {
+    struct Bin
+    {
+      AABB bbox;
+      int entries;
+      int exits;
+    };
+
+    split.cost = std::numeric_limits<float>::max();
+
+    for (unsigned int a = 0; a < 3; ++a)
+    {
+      const float extent = nodeBox.max[a] - nodeBox.min[a];
+
+      if (extent <= 0.f)
+        continue;
+
+      const float k = SAH_BINS / extent;
+      const auto binIndex = [&nodeBox, a, k](const float x) { return glm::clamp(static_cast<int>((x - nodeBox.min[a]) * k), 0, SAH_BINS - 1); };
+
+      std::array<Bin, SAH_BINS> bins;
+
+      for (auto& b : bins)
+      {
+        b.bbox = emptyBox();
+        b.entries = 0;
+        b.exits = 0;
+      }
+
+      for (const auto& r : refs)
+      {
+        const int first = binIndex(r.bbox.min[a]);
+        const int last = binIndex(r.bbox.max[a]);
+
+        TriangleReference current = r;
+
+        for (int b = first; b < last; ++b)
+        {
+          TriangleReference left, right;
+          splitReference(tris, current, a, nodeBox.min[a] + extent * (b + 1) / SAH_BINS, left, right);
+
+          bins[b].bbox.add(left.bbox);
+          current = right;
+        }
+
+        bins[last].bbox.add(current.bbox);
+        ++bins[first].entries;
+        ++bins[last].exits;
+      }
+
+      std::array<AABB, SAH_BINS - 1> leftBoxes;
+      std::array<int, SAH_BINS - 1> leftCounts;
+
+      AABB box = emptyBox();
+      int count = 0;
+
+      for (int b = 0; b < SAH_BINS - 1; ++b)
+      {
+        box.add(bins[b].bbox);
+        count += bins[b].entries;
+
+        leftBoxes[b] = box;
+        leftCounts[b] = count;
+      }
+
+      box = emptyBox();
+      count = 0;
+
+      for (int b = SAH_BINS - 1; b > 0; --b)
+      {
+        box.add(bins[b].bbox);
+        count += bins[b].exits;
+
+        if (count == 0 || leftCounts[b - 1] == 0)
+          continue;
+
+        const float currentCost = leftBoxes[b - 1].area() * leftCounts[b - 1] + box.area() * count;
+
+        if (currentCost < split.cost)
+        {
+          split.cost = currentCost;
+          split.axis = a;
+          split.bin = b;
+          split.leftBox = leftBoxes[b - 1];
+          split.rightBox = box;
+          split.nLeft = leftCounts[b - 1];
+          split.nRight = count;
+        }
+      }
+    }
+
+    return split.cost < std::numeric_limits<float>::max();
+  }
+}
+
+std::vector<Node> BVHBuilder::buildSpatial(const IndexedTriangles& sourceTriangles, std::vector<TriangleReference>& refs, const float rootArea, std::atomic<int>& budget, std::vector<TriangleReference>& leafRefs, WorkStealingPool& pool)
+{
+  const int n = refs.size();
+
+  Node node;
+  node.bbox = emptyBox();
+  node.startTri = leafRefs.size();
+  node.nTri = n;
+  node.rightIndex = -1;
+
+  for (const auto& r : refs)
+    node.bbox.add(r.bbox);
+
+  SBVHSplit objectSplit, spatialSplit;
+  const bool hasObjectSplit = n > buildParameters.minLeafSize && findObjectSplit(refs, objectSplit);
+
+  // Spatial splits only pay off where the object split children overlap noticeably
+  bool useSpatialSplit = false;
+
+  if (n > buildParameters.minLeafSize && budget > 0 && (!hasObjectSplit || overlapArea(objectSplit.leftBox, objectSplit.rightBox) > SBVH_OVERLAP_THRESHOLD * rootArea))
+  {
+    // Both children must shrink, references with coincident centroids could be split forever otherwise
+    if (findSpatialSplit(sourceTriangles, refs, node.bbox, spatialSplit) && spatialSplit.nLeft < n && spatialSplit.nRight < n
+        && (!hasObjectSplit || spatialSplit.cost < objectSplit.cost))
+    {
+      const int duplicates = spatialSplit.nLeft + spatialSplit.nRight - n;
+
+      if (budget.fetch_sub(duplicates) >= duplicates)
+        useSpatialSplit = true;
+      else
+        budget += duplicates;
+    }
+  }
+
+  const float minCost = useSpatialSplit ? spatialSplit.cost : hasObjectSplit ? objectSplit.cost : std::numeric_limits<float>::max();
+
+  // All reference centroids coincide and there is no spatial split: fall back to a median split
+  const bool medianSplit = n > buildParameters.minLeafSize && !hasObjectSplit && !useSpatialSplit;
+
+  if (n <= buildParameters.minLeafSize || (!medianSplit && isCheaperAsLeaf(node, minCost)))
+  {
+    leafRefs.insert(leafRefs.end(), refs.begin(), refs.end());
+    return std::vector<Node>(1, node);
+  }
+
+  std::vector<TriangleReference> leftRefs, rightRefs;
+
+  if (useSpatialSplit)
+  {
+    const unsigned int a = spatialSplit.axis;
+    const float position = node.bbox.min[a] + (node.bbox.max[a] - node.bbox.min[a]) * spatialSplit.bin / SAH_BINS;
+
+    AABB leftBox = spatialSplit.leftBox;
+    AABB rightBox = spatialSplit.rightBox;
+    int nLeft = spatialSplit.nLeft;
+    int nRight = spatialSplit.nRight;
+
+    for (const auto& r : refs)
+    {
+      if (r.bbox.max[a] <= position)
+      {
+        leftRefs.push_back(r);
+      }
+      else if (r.bbox.min[a] >= position)
+      {
+        rightRefs.push_back(r);
+      }
+      else
+      {
+        // Keep the reference whole on one side if that is cheaper than duplicating it
+        AABB leftUnsplit = leftBox;
+        leftUnsplit.add(r.bbox);
+        AABB rightUnsplit = rightBox;
+        rightUnsplit.add(r.bbox);
+
+        const float splitCost = leftBox.area() * nLeft + rightBox.area() * nRight;
+        const float leftCost = leftUnsplit.area() * nLeft + rightBox.area() * (nRight - 1);
+        const float rightCost = leftBox.area() * (nLeft - 1) + rightUnsplit.area() * nRight;
+
+        if (leftCost < splitCost && leftCost <= rightCost)
+        {
+          leftRefs.push_back(r);
+          leftBox = leftUnsplit;
+          --nRight;
+        }
+        else if (rightCost < splitCost)
+        {
+          rightRefs.push_back(r);
+          rightBox = rightUnsplit;
+          --nLeft;
+        }
+        else
+        {
+          TriangleReference left, right;
+          splitReference(sourceTriangles, r, a, position, left, right);
+
+          leftRefs.push_back(left);
+          rightRefs.push_back(right);
+        }
+      }
+    }
+
+    budget += spatialSplit.nLeft + spatialSplit.nRight - static_cast<int>(leftRefs.size() + rightRefs.size());
+  }
+  else if (hasObjectSplit)
+  {
+    const unsigned int a = objectSplit.axis;
+
+    AABB centroidBox = emptyBox();
+
+    for (const auto& r : refs)
+      centroidBox.add((r.bbox.min + r.bbox.max) * 0.5f);
+
+    const float k = SAH_BINS / (centroidBox.max[a] - centroidBox.min[a]);
+
+    for (const auto& r : refs)
+    {
+      if (std::min(static_cast<int>(((r.bbox.min[a] + r.bbox.max[a]) * 0.5f - centroidBox.min[a]) * k), SAH_BINS - 1) < objectSplit.bin)
+        leftRefs.push_back(r);
+      else
+        rightRefs.push_back(r);
+    }
+  }
+  else
+  {
+    leftRefs.assign(refs.begin(), refs.begin() + n / 2);
+    rightRefs.assign(refs.begin() + n / 2, refs.end());
+  }
+
+  std::vector<TriangleReference>().swap(refs);
+
+  std::vector<Node> leftNodes, rightNodes;
+
+  if (n >= BVH_TASK_MIN_TRIS)
+  {
+    // Both halves collect their leaf references separately and are appended once done
+    std::vector<TriangleReference> leftLeafRefs, rightLeafRefs;
+
+    TaskGroup group(pool);
+    group.run([&] { leftNodes = buildSpatial(sourceTriangles, leftRefs, rootArea, budget, leftLeafRefs, pool); });
+    rightNodes = buildSpatial(sourceTriangles, rightRefs, rootArea, budget, rightLeafRefs, pool);
+    group.wait();
+
+    for (auto& child : leftNodes)
+      child.startTri += leafRefs.size();
+
+    for (auto& child : rightNodes)
+      child.startTri += leafRefs.size() + leftLeafRefs.size();
+
+    leafRefs.insert(leafRefs.end(), leftLeafRefs.begin(), leftLeafRefs.end());
+    leafRefs.insert(leafRefs.end(), rightLeafRefs.begin(), rightLeafRefs.end());
+  }
+  else
+  {
+    leftNodes = buildSpatial(sourceTriangles, leftRefs, rootArea, budget, leafRefs, pool);
+    rightNodes = buildSpatial(sourceTriangles, rightRefs, rootArea, budget, leafRefs, pool);
+  }
+
+  node.nTri = leafRefs.size() - node.startTri;
+
+  std::vector<Node> nodes;
+  nodes.reserve(1 + leftNodes.size() + rightNodes.size());
+
+  node.rightIndex = 1 + leftNodes.size();
+  nodes.push_back(node);
+
+  for (const auto* subtree : { &leftNodes, &rightNodes })
+  {
+    const int offset = nodes.size();
+
+    for (Node child : *subtree)
+    {
+      if (child.rightIndex != -1)
+        child.rightIndex += offset;
+
+      nodes.push_back(child);
+    }
+  }
+
+  return nodes;
+}
+
+// Ernst and Greiner, "Early Split Clipping for Bounding Volume Hierarchies", 2007. Large triangles are
+// split into several references before the build, each bounding the part of the triangle in one half
+// of its parent reference. The split search only sees the tighter boxes, the leaves still store the
+// whole triangle.
+void BVHBuilder::earlySplit(const IndexedTriangles& sourceTriangles, const float threshold)
+{
+  const int n = triIds.size();
+
+  double totalArea = 0.0;
+
+#pragma omp parallel for reduction(+:totalArea)
+  for (int i = 0; i < n; ++i)
+    totalArea += triBoxes[i].area();
+
+  const float maxArea = threshold * static_cast<float>(totalArea / std::max(n, 1));
+
+  std::vector<std::vector<TriangleReference>> splitRefs(n);
+  std::vector<unsigned int> offsets(n + 1, 0);
+
+#pragma omp parallel for schedule(dynamic, 1024)
+  for (int i = 0; i < n; ++i)
+  {
+    if (triBoxes[i].area() <= maxArea)
+    {
+      offsets[i + 1] = 1;
+      continue;
+    }
+
+    std::vector<TriangleReference>& out = splitRefs[i];
+    std::vector<TriangleReference> pending(1);
+    pending[0].bbox = triBoxes[i];
+    pending[0].triIdx = i;
+
+    // Halve the longest axis until the pieces are small enough or the triangle used up its references
+    while (!pending.empty())
+    {
+      const TriangleReference ref = pending.back();
+      pending.pop_back();
+
+      if (ref.bbox.area() <= maxArea || out.size() + pending.size() + 2 > EARLY_SPLIT_MAX_REFERENCES)
+      {
+        out.push_back(ref);
+        continue;
+      }
+
+      const glm::fvec3 extent = ref.bbox.max - ref.bbox.min;
+      const unsigned int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+
+      TriangleReference left, right;
+      splitReference(sourceTriangles, ref, axis, ref.bbox.min[axis] + 0.5f * extent[axis], left, right);
+
+      pending.push_back(left);
+      pending.push_back(right);
+    }
+
+    offsets[i + 1] = out.size();
+  }
+
+  for (int i = 0; i < n; ++i)
+    offsets[i + 1] += offsets[i];
+
+  const int nRefs = offsets[n];
+
+  if (nRefs == n)
+    return;
+
+  std::vector<AABB> refBoxes(nRefs);
+  std::vector<glm::fvec3> refCenters(nRefs);
+  refSourceIds.resize(nRefs);
+  triIds.resize(nRefs);
+
+#pragma omp parallel for
+  for (int i = 0; i < n; ++i)
+  {
+    if (splitRefs[i].empty())
+    {
+      refBoxes[offsets[i]] = triBoxes[i];
+      refCenters[offsets[i]] = triCenters[i];
+      refSourceIds[offsets[i]] = i;
+      continue;
+    }
+
+    for (std::size_t r = 0; r < splitRefs[i].size(); ++r)
+    {
+      const AABB& box = splitRefs[i][r].bbox;
+
+      refBoxes[offsets[i] + r] = box;
+      refCenters[offsets[i] + r] = (box.min + box.max) * 0.5f;
+      refSourceIds[offsets[i] + r] = i;
+    }
+  }
+
+  std::iota(triIds.begin(), triIds.end(), 0);
+  triBoxes.swap(refBoxes);
+  triCenters.swap(refCenters);
+
+  if (buildParameters.printStatistics)
+    std::cout << "Early split references: " << nRefs << " (" << nRefs - n << " added)" << std::endl;
+}
+
+std::vector<Node> BVHBuilder::buildSBVH(const IndexedTriangles& sourceTriangles, const float spatialSplitBudget, WorkStealingPool& pool)
+{
+  const int n = triIds.size();
+
+  std::vector<TriangleReference> refs(n);
+
+  for (int i = 0; i < n; ++i)
+  {
+    refs[i].bbox = triBoxes[triIds[i]];
+    refs[i].triIdx = refSourceIds.empty() ? triIds[i] : refSourceIds[triIds[i]];
+  }
+
+  // The references carry their source triangle from here on
+  std::vector<unsigned int>().swap(refSourceIds);
+
+  AABB rootBox = emptyBox();
+
+  for (const auto& r : refs)
+    rootBox.add(r.bbox);
+
+  std::atomic<int> budget(static_cast<int>(n * std::max(spatialSplitBudget, 0.f)));
+
+  std::vector<TriangleReference> leafRefs;
+  leafRefs.reserve(n);
+
+  const std::vector<Node> nodes = buildSpatial(sourceTriangles, refs, rootBox.area(), budget, leafRefs, pool);
+
+  // Duplicated references point to the same source triangle
+  triIds.resize(leafRefs.size());
+
+  for (std::size_t i = 0; i < leafRefs.size(); ++i)
+    triIds[i] = leafRefs[i].triIdx;
+
+  if (buildParameters.printStatistics)
+    std::cout << "SBVH references: " << triIds.size() << " (" << triIds.size() - n << " duplicated)" << std::endl;
+
+  return nodes;
+}
+
+void BVHBuilder::buildNodes(const BVHBuildParameters& parameters, const IndexedTriangles& sourceTriangles)
+{
+  buildParameters = parameters;
+  buildParameters.minLeafSize = std::max(parameters.minLeafSize, 1);
+  buildParameters.maxLeafSize = std::max(parameters.maxLeafSize, buildParameters.minLeafSize);
+
+  const SplitMode splitMode = parameters.splitMode;
+
+  if (splitMode == SplitMode::SBVH)
+  {
+    this->bvh = buildSBVH(sourceTriangles, parameters.spatialSplitBudget, WorkStealingPool::getInstance());
+  }
+  else if (splitMode == SplitMode::LBVH)
+  {
+    if (triIds.size() >= LBVH_63BIT_MIN_TRIS)
+      this->bvh = buildLBVH<unsigned long long>();
+    else
+      this->bvh = buildLBVH<unsigned int>();
+  }
+  else if (splitMode == SplitMode::HLBVH)
+  {
+    if (triIds.size() >= LBVH_63BIT_MIN_TRIS)
+      this->bvh = buildHLBVH<unsigned long long>(WorkStealingPool::getInstance());
+    else
+      this->bvh = buildHLBVH<unsigned int>(WorkStealingPool::getInstance());
+  }
+  else if (splitMode == SplitMode::PLOC)
+  {
+    if (triIds.size() >= LBVH_63BIT_MIN_TRIS)
+      this->bvh = buildPLOC<unsigned long long>();
+    else
+      this->bvh = buildPLOC<unsigned int>();
+  }
+  else
+  {
+    Node root;
+    root.startTri = 0;
+    root.nTri = triIds.size();
+    root.bbox = computeBB(root);
+    root.rightIndex = -1;
+
+    this->bvh = buildParallel(root, splitMode, WorkStealingPool::getInstance());
+  }
+
+  if (splitMode == SplitMode::LBVH || splitMode == SplitMode::HLBVH || splitMode == SplitMode::PLOC)
+    collapseLeaves();
+
+  optimizeTreelets(parameters.treeletPasses);
+
+  if (!refSourceIds.empty())
+  {
+#pragma omp parallel for
+    for (int i = 0; i < static_cast<int>(triIds.size()); ++i)
+      triIds[i] = refSourceIds[triIds[i]];
+
+    std::vector<unsigned int>().swap(refSourceIds);
+  }
+
+  std::vector<AABB>().swap(triBoxes);
+  std::vector<glm::fvec3>().swap(triCenters);
+}
+
+void BVHBuilder::build(const BVHBuildParameters& parameters, const std::vector<Vertex>& vertices, const std::vector<glm::uvec3>& indices, std::vector<unsigned int> triangleMaterialIds)
+{
+  const auto buildStart = std::chrono::high_resolution_clock::now();
+
+  this->triangleMaterialIds = std::move(triangleMaterialIds);
+
+  const IndexedTriangles triangles(vertices.data(), indices.data());
+  const int n = indices.size();
+
+  triIds.resize(n);
+  triBoxes.resize(n);
+  triCenters.resize(n);
+
+#pragma omp parallel for
+  for (int i = 0; i < n; ++i)
+  {
+    const glm::fvec3& p0 = triangles.position(i, 0);
+    const glm::fvec3& p1 = triangles.position(i, 1);
+    const glm::fvec3& p2 = triangles.position(i, 2);
+
+    triIds[i] = i;
+    triBoxes[i] = AABB(glm::max(glm::max(p0, p1), p2), glm::min(glm::min(p0, p1), p2));
+    triCenters[i] = (p0 + p1 + p2) / 3.f;
+  }
+
+  // The early splits run before buildNodes, which sets the rest of the build up
+  buildParameters = parameters;
+
+  if (parameters.earlySplitThreshold > 0.f)
+    earlySplit(triangles, parameters.earlySplitThreshold);
+
+  buildNodes(parameters, triangles);
+
+  const auto buildEnd = std::chrono::high_resolution_clock::now();
+
+  reorderTrianglesAndMaterialIds(indices);
+
+  const auto reorderEnd = std::chrono::high_resolution_clock::now();
+  const float millis = std::chrono::duration<float, std::milli>(buildEnd - buildStart).count();
+  const float reorderMillis = std::chrono::duration<float, std::milli>(reorderEnd - buildEnd).count();
+
+  if (!parameters.printStatistics)
+    return;
+
+  std::cout << "BVH build time [ms]: " << millis << " (" << WorkStealingPool::getInstance().getNThreads() << " threads)" << std::endl;
+  std::cout << "Triangle reorder time [ms]: " << reorderMillis << std::endl;
+  std::cout << computeBVHStatistics(this->bvh, vertices, this->triangleIndices, false);
+}
+
+// Spatial splits need the triangles, so SBVH falls back to binned SAH here
+void BVHBuilder::build(const BVHBuildParameters& parameters, const std::vector<AABB>& bounds)
+{
+  const int n = bounds.size();
+
+  triIds.resize(n);
+  triBoxes = bounds;
+  triCenters.resize(n);
+
+#pragma omp parallel for
+  for (int i = 0; i < n; ++i)
+  {
+    triIds[i] = i;
+    triCenters[i] = (bounds[i].min + bounds[i].max) * 0.5f;
+  }
+
+  BVHBuildParameters boundsParameters = parameters;
+
+  if (boundsParameters.splitMode == SplitMode::SBVH)
+    boundsParameters.splitMode = SplitMode::BINNED_SAH;
+
+  buildNodes(boundsParameters, IndexedTriangles());
+}
+
+std::vector<Node> BVHBuilder::getBVH()
+{
+  return std::move(bvh);
+}
+
+std::vector<glm::uvec3> BVHBuilder::getTriangleIndices()
+{
+  return std::move(triangleIndices);
+}
+
+std::vector<unsigned int> BVHBuilder::getTriangleMaterialIds()
+{
+  return std::move(triangleMaterialIds);
+}
+
+std::vector<unsigned int> BVHBuilder::getTriangleSourceIds()
+{
+  return std::move(triIds);
+}
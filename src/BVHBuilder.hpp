@@ -3,16 +3,68 @@
 
 #include <vector>
 #include <string>
+#include <atomic>
 
 #include "Utils.hpp"
 #include "Triangle.hpp"
+#include "BinaryBVH.hpp"
 
-#define MAX_TRIS_PER_LEAF 8
+class WorkStealingPool;
+
+#define DEFAULT_MIN_LEAF_SIZE 8
+#define DEFAULT_MAX_LEAF_SIZE 8 // Same as the minimum, so the cost model only decides once it is raised
+#define BVH_TASK_MIN_TRIS 4096
+#define SAH_BINS 32
+// Default weights of the cost model, also used when reporting the SAH cost of finished trees
+#define SAH_TRAVERSAL_COST 1.f
+#define SAH_INTERSECTION_COST 1.f
+#define LBVH_63BIT_MIN_TRIS 1000000
+#define HLBVH_MAX_CLUSTER_BITS 12
+#define HLBVH_MIN_CLUSTER_TRIS 16
+#define PLOC_SEARCH_RADIUS 16
+#define SBVH_DEFAULT_BUDGET 0.3f
+#define SBVH_OVERLAP_THRESHOLD 1e-5f
+#define TREELET_LEAVES 7
+#define EARLY_SPLIT_MAX_REFERENCES 32
 
 enum SplitMode
 {
   OBJECT_MEDIAN,
-  SAH
+  SAH,
+  BINNED_SAH,
+  SBVH,
+  LBVH,
+  HLBVH,
+  PLOC
+};
+
+struct BVHBuildParameters
+{
+  SplitMode splitMode;
+  float spatialSplitBudget; // Duplicated references allowed by SBVH, relative to the triangle count
+  float refitRebuildRatio;  // Rebuild instead of refitting once the SAH cost grows past this ratio, 0 disables
+  int treeletPasses;        // Treelet restructuring passes run on the finished tree, 0 disables
+  float earlySplitThreshold; // Triangles with a box area above this multiple of the average are pre-split, 0 disables
+  bool instancing;          // Build a two level BVH over the scene graph for CPU tracing instead of the flat one
+  bool printStatistics;     // Report the build time, the tree statistics and the counts of the build passes
+  NodeLayout nodeLayout;    // Node order of the binary BVH the CPU packet traversal uses
+
+  // A node becomes a leaf once traversalCost * area + the cost of its children is no cheaper than
+  // intersectionCost * nTri * area, subject to the leaf size bounds
+  float traversalCost;
+  float intersectionCost;
+  int minLeafSize;          // Nodes with at most this many triangles are never split
+  int maxLeafSize;          // Nodes with more triangles are split even if a leaf would be cheaper
+
+  BVHBuildParameters() : splitMode(SplitMode::SAH), spatialSplitBudget(SBVH_DEFAULT_BUDGET), refitRebuildRatio(0.f), treeletPasses(0), earlySplitThreshold(0.f), instancing(false), printStatistics(true), nodeLayout(NodeLayout::DEPTH_FIRST),
+                         traversalCost(SAH_TRAVERSAL_COST), intersectionCost(SAH_INTERSECTION_COST), minLeafSize(DEFAULT_MIN_LEAF_SIZE), maxLeafSize(DEFAULT_MAX_LEAF_SIZE) {};
+};
+
+// A triangle, or the part of it that falls inside bbox after spatial splits
+struct TriangleReference
+{
+  AABB bbox;
+  unsigned int triIdx;
 };
 
 class BVHBuilder
@@ -21,30 +73,68 @@ public:
   BVHBuilder();
   ~BVHBuilder();
   
+  // The results are moved out, so every getter is called once after build()
   std::vector<Node> getBVH();
-  std::vector<Triangle> getTriangles();
+  std::vector<glm::uvec3> getTriangleIndices(); // In BVH order
   std::vector<unsigned int> getTriangleMaterialIds();
-  std::vector<MeshDescriptor> getMeshDescriptors();
+  std::vector<unsigned int> getTriangleSourceIds();
   
-  void build(const enum SplitMode splitMode, const std::vector<Triangle>& triangles, const std::vector<unsigned int>& triangleMaterialIds, const std::vector<MeshDescriptor>& meshDescriptors);
+  void build(const BVHBuildParameters& parameters, const std::vector<Vertex>& vertices, const std::vector<glm::uvec3>& indices, std::vector<unsigned int> triangleMaterialIds);
+  // Builds over arbitrary primitives given by their bounds. getTriangleSourceIds() returns the primitive order.
+  void build(const BVHBuildParameters& parameters, const std::vector<AABB>& bounds);
   
-  void reorderTrianglesAndMaterialIds();
+  void reorderTrianglesAndMaterialIds(const std::vector<glm::uvec3>& sourceIndices);
   unsigned int expandBits(unsigned int v);
+  unsigned long long expandBits64(unsigned long long v);
   AABB computeBB(const Node node);
-  std::vector<unsigned int> getMortonCodes(const std::vector<Triangle>& triangles, const AABB& boundingBox);
+  template <typename MortonCode>
+  MortonCode encodeMorton(const glm::fvec3& p);
+  template <typename MortonCode>
+  std::vector<MortonCode> getMortonCodes(const std::vector<glm::fvec3>& centroids, const AABB& centroidBox);
   void createBVHColors();
-  std::vector<std::pair<Triangle, unsigned int>> sortOnMorton(std::vector<Triangle> triangles, const AABB& boundingBox);
-  void reorderMeshIndices(const std::vector<std::pair<Triangle, unsigned int>>& trisWithIds);
-  bool isBalanced(const Node *node, const Node* root, int* height);
+  template <typename Key>
+  void radixSort(std::vector<Key>& keys, std::vector<unsigned int>& values);
+  template <typename MortonCode>
+  std::vector<unsigned int> sortOnMorton(const std::vector<glm::fvec3>& centroids, const AABB& centroidBox, std::vector<MortonCode>& sortedCodes);
+  template <typename MortonCode>
+  std::vector<MortonCode> sortTrisOnMorton();
+  template <typename MortonCode>
+  std::vector<Node> buildRadixTree(const std::vector<MortonCode>& sortedCodes, const int offset, const int n, const bool parallel);
+  template <typename MortonCode>
+  std::vector<Node> buildLBVH();
+  template <typename MortonCode>
+  std::vector<Node> buildHLBVH(WorkStealingPool& pool);
+  template <typename MortonCode>
+  std::vector<Node> buildPLOC();
   void sortTrisOnAxis(const Node& node, const unsigned int axis);
   bool splitNode(const Node& node, Node& leftChild, Node& rightChild, const SplitMode splitMode);
-  std::vector<std::pair<Triangle, unsigned int>> createBVH(const enum SplitMode splitMode);
+  bool splitNodeBinned(const Node& node, Node& leftChild, Node& rightChild);
+  static float computeSAHCost(const std::vector<Node>& bvh);
+  static void refit(std::vector<Node>& bvh, const IndexedTriangles& triangles);
+  void optimizeTreelets(const int nPasses);
+  void collapseLeaves();
+  void earlySplit(const IndexedTriangles& sourceTriangles, const float threshold);
+  void buildNodes(const BVHBuildParameters& parameters, const IndexedTriangles& sourceTriangles);
+  std::vector<Node> buildSubtree(const Node& root, const SplitMode splitMode);
+  std::vector<Node> buildParallel(Node node, const SplitMode splitMode, WorkStealingPool& pool);
+  std::vector<Node> buildSBVH(const IndexedTriangles& sourceTriangles, const float spatialSplitBudget, WorkStealingPool& pool);
+  std::vector<Node> buildSpatial(const IndexedTriangles& sourceTriangles, std::vector<TriangleReference>& refs, const float rootArea, std::atomic<int>& budget, std::vector<TriangleReference>& leafRefs, WorkStealingPool& pool);
   
 private:
+  bool isCheaperAsLeaf(const Node& node, const float splitCost) const;
+
+  BVHBuildParameters buildParameters; // Of the running build
   std::vector<Node> bvh;
-  std::vector<std::pair<Triangle, unsigned int>> trisWithIds;
-  
-  std::vector<MeshDescriptor> meshDescriptors;
+
+  // The build only permutes triIds, which holds the source triangle of every slot.
+  // Spatial splits may repeat an id. Bounds and centroids are indexed by source triangle.
+  std::vector<unsigned int> triIds;
+  std::vector<AABB> triBoxes;
+  std::vector<glm::fvec3> triCenters;
+  // After early splits the ids above index references instead, this maps them to source triangles
+  std::vector<unsigned int> refSourceIds;
+  std::vector<glm::uvec3> triangleIndices;
+
   std::vector<unsigned int> triangleMaterialIds;
   std::vector<MeshDescriptor> bvhBoxDescriptors;
   std::vector<Material> bvhBoxMaterials;
@@ -0,0 +1,214 @@
+#include "BVHStatistics.hpp"
+
+#include <iomanip>
+
+#include "BVHBuilder.hpp"
+
+namespace
+{
+  // Sutherland-Hodgman against the six slabs of the box. A triangle clipped by six planes
+  // has at most nine corners.
+  float clippedArea(const Triangle& tri, const AABB& box)
+  {
+    glm::fvec3 polygon[12];
+    glm::fvec3 clipped[12];
+    int n = 3;
+
+    for (int i = 0; i < 3; ++i)
+      polygon[i] = tri.vertices[i].p;
+
+    for (int a = 0; a < 3 && n > 0; ++a)
+    {
+      for (int side = 0; side < 2 && n > 0; ++side)
+      {
+        const float plane = side == 0 ? box.min[a] : box.max[a];
+        const float sign = side == 0 ? 1.f : -1.f;
+
+        int m = 0;
+
+        for (int i = 0; i < n; ++i)
+        {
+          const glm::fvec3& p0 = polygon[i];
+          const glm::fvec3& p1 = polygon[(i + 1) % n];
+          const float d0 = sign * (p0[a] - plane);
+          const float d1 = sign * (p1[a] - plane);
+
+          if (d0 >= 0.f)
+            clipped[m++] = p0;
+
+          if ((d0 < 0.f && d1 > 0.f) || (d0 > 0.f && d1 < 0.f))
+            clipped[m++] = p0 + (p1 - p0) * (d0 / (d0 - d1));
+        }
+
+        n = m;
+
+        for (int i = 0; i < n; ++i)
+          polygon[i] = clipped[i];
+      }
+    }
+
+    glm::fvec3 cross(0.f);
+
+    for (int i = 1; i + 1 < n; ++i)
+      cross += glm::cross(polygon[i] - polygon[0], polygon[i + 1] - polygon[0]);
+
+    return 0.5f * glm::length(cross);
+  }
+
+  inline bool overlaps(const AABB& a, const AABB& b)
+  {
+    return a.min.x <= b.max.x && a.max.x >= b.min.x
+        && a.min.y <= b.max.y && a.max.y >= b.min.y
+        && a.min.z <= b.max.z && a.max.z >= b.min.z;
+  }
+
+  // Aila et al., "On Quality Metrics of Bounding Volume Hierarchies", 2013. Every node is charged for
+  // the triangle area that lies inside its box but belongs to another subtree, relative to the total area.
+  float computeEPO(const std::vector<Node>& bvh, const IndexedTriangles& triangles, const int nTriangles)
+  {
+    double overlap = 0.0;
+    double total = 0.0;
+
+#pragma omp parallel for schedule(dynamic, 256) reduction(+:overlap, total)
+    for (int t = 0; t < nTriangles; ++t)
+    {
+      const Triangle tri = triangles[t];
+      const AABB triBox = tri.bbox();
+
+      total += 0.5f * glm::length(glm::cross(tri.vertices[1].p - tri.vertices[0].p, tri.vertices[2].p - tri.vertices[0].p));
+
+      int stack[BVH_STATISTICS_STACK_SIZE];
+      int stackSize = 0;
+      stack[stackSize++] = 0;
+
+      while (stackSize > 0)
+      {
+        const int idx = stack[--stackSize];
+        const Node& node = bvh[idx];
+
+        if (t < node.startTri || t >= node.startTri + node.nTri)
+        {
+          if (!overlaps(triBox, node.bbox))
+            continue;
+
+          const float area = clippedArea(tri, node.bbox);
+
+          // The children lie inside this box, so they can't overlap the triangle either
+          if (area <= 0.f)
+            continue;
+
+          overlap += (node.rightIndex == -1 ? SAH_INTERSECTION_COST : SAH_TRAVERSAL_COST) * area;
+        }
+
+        if (node.rightIndex != -1)
+        {
+          stack[stackSize++] = node.rightIndex;
+          stack[stackSize++] = idx + 1;
+        }
+      }
+    }
+
+    return total > 0.0 ? static_cast<float>(overlap / total) : 0.f;
+  }
+}
+
+BVHStatistics computeBVHStatistics(const std::vector<Node>& bvh, const std::vector<Vertex>& vertices, const std::vector<glm::uvec3>& triangleIndices, const bool withEPO)
+{
+  BVHStatistics statistics;
+  statistics.nNodes = bvh.size();
+  statistics.nLeaves = 0;
+  statistics.nTriangles = triangleIndices.size();
+  statistics.maxDepth = 0;
+  statistics.sahCost = BVHBuilder::computeSAHCost(bvh);
+  statistics.epo = -1.f;
+  statistics.averageLeafSize = 0.f;
+  statistics.averageLeafDepth = 0.f;
+  statistics.nodeBytes = bvh.size() * sizeof(Node);
+  statistics.triangleBytes = vertices.size() * sizeof(Vertex) + triangleIndices.size() * sizeof(glm::uvec3);
+
+  if (bvh.empty())
+    return statistics;
+
+  // Parents are always stored before their children
+  std::vector<int> depth(bvh.size(), 0);
+  long long leafTriangles = 0;
+  long long leafDepths = 0;
+
+  for (std::size_t i = 0; i < bvh.size(); ++i)
+  {
+    const Node& node = bvh[i];
+
+    if (node.rightIndex != -1)
+    {
+      depth[i + 1] = depth[i] + 1;
+      depth[node.rightIndex] = depth[i] + 1;
+      continue;
+    }
+
+    if (static_cast<int>(statistics.leafSizeHistogram.size()) <= node.nTri)
+      statistics.leafSizeHistogram.resize(node.nTri + 1, 0);
+
+    if (static_cast<int>(statistics.depthHistogram.size()) <= depth[i])
+      statistics.depthHistogram.resize(depth[i] + 1, 0);
+
+    ++statistics.leafSizeHistogram[node.nTri];
+    ++statistics.depthHistogram[depth[i]];
+    ++statistics.nLeaves;
+
+    leafTriangles += node.nTri;
+    leafDepths += depth[i];
+    statistics.maxDepth = std::max(statistics.maxDepth, depth[i]);
+  }
+
+  statistics.averageLeafSize = static_cast<float>(leafTriangles) / statistics.nLeaves;
+  statistics.averageLeafDepth = static_cast<float>(leafDepths) / statistics.nLeaves;
+
+  // The traversal stack holds at most one pending right child per level
+  if (withEPO && statistics.maxDepth + 2 <= BVH_STATISTICS_STACK_SIZE)
+    statistics.epo = computeEPO(bvh, IndexedTriangles(vertices.data(), triangleIndices.data()), triangleIndices.size());
+
+  return statistics;
+}
+
+std::ostream& operator<<(std::ostream& os, const BVHStatistics& statistics)
+{
+  const std::ios::fmtflags flags = os.flags();
+  const std::streamsize precision = os.precision();
+
+  os << std::fixed << std::setprecision(2);
+
+  os << "BVH nodes: " << statistics.nNodes << ", leaves: " << statistics.nLeaves << ", triangles: " << statistics.nTriangles
+     << ", memory [MiB]: " << statistics.nodeBytes / (1024.f * 1024.f) << " nodes, " << statistics.triangleBytes / (1024.f * 1024.f) << " triangles" << std::endl;
+
+  os << "BVH SAH cost: " << statistics.sahCost;
+
+  if (statistics.epo >= 0.f)
+    os << ", EPO: " << std::setprecision(4) << statistics.epo << std::setprecision(2);
+
+  os << std::endl;
+
+  os << "BVH leaf sizes (avg " << statistics.averageLeafSize << "):";
+
+  for (std::size_t i = 0; i < statistics.leafSizeHistogram.size(); ++i)
+  {
+    if (statistics.leafSizeHistogram[i] > 0)
+      os << " " << i << ":" << statistics.leafSizeHistogram[i];
+  }
+
+  os << std::endl;
+
+  os << "BVH leaf depths (avg " << statistics.averageLeafDepth << ", max " << statistics.maxDepth << "):";
+
+  for (std::size_t i = 0; i < statistics.depthHistogram.size(); ++i)
+  {
+    if (statistics.depthHistogram[i] > 0)
+      os << " " << i << ":" << statistics.depthHistogram[i];
+  }
+
+  os << std::endl;
+
+  os.flags(flags);
+  os.precision(precision);
+
+  return os;
+}
@@ -0,0 +1,32 @@
+#ifndef BVHSTATISTICS_HPP
+#define BVHSTATISTICS_HPP
+
+#include <vector>
+#include <ostream>
+
+#include "Utils.hpp"
+#include "Triangle.hpp"
+
+#define BVH_STATISTICS_STACK_SIZE 256
+
+struct BVHStatistics
+{
+  int nNodes;
+  int nLeaves;
+  int nTriangles;
+  int maxDepth;
+  float sahCost;
+  float epo; // End-point overlap, the part of the geometry a ray may test without hitting it. -1 if skipped
+  float averageLeafSize;
+  float averageLeafDepth;
+  std::size_t nodeBytes;
+  std::size_t triangleBytes; // Shared vertices and indices
+  std::vector<int> leafSizeHistogram; // Leaves by triangle count
+  std::vector<int> depthHistogram;    // Leaves by depth, the root is at depth 0
+};
+
+// EPO clips every triangle against the boxes it overlaps, which costs about as much as a build
+BVHStatistics computeBVHStatistics(const std::vector<Node>& bvh, const std::vector<Vertex>& vertices, const std::vector<glm::uvec3>& triangleIndices, const bool withEPO = true);
+std::ostream& operator<<(std::ostream& os, const BVHStatistics& statistics);
+
+#endif // BVHSTATISTICS_HPP
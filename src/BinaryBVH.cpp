@@ -0,0 +1,223 @@
+#include "BinaryBVH.hpp"
+#include "RayIntersection.hpp"
+
+#include <stack>
+#include <limits>
+#include <numeric>
+
+namespace
+{
+  void placePair(const std::vector<Node>& bvh, const int parent, std::vector<int>& newIndices, int& next)
+  {
+    newIndices[parent + 1] = next++;
+    newIndices[bvh[parent].rightIndex] = next++;
+  }
+
+  // Inner nodes whose children are levels pairs below the children of parent
+  void gatherPairs(const std::vector<Node>& bvh, const int parent, const int levels, std::vector<int>& pairs)
+  {
+    if (levels == 0)
+    {
+      pairs.push_back(parent);
+      return;
+    }
+
+    for (const int child : { parent + 1, bvh[parent].rightIndex })
+    {
+      if (bvh[child].rightIndex != -1)
+        gatherPairs(bvh, child, levels - 1, pairs);
+    }
+  }
+
+  // The pairs within levels of parent are split at half height. The top treelet is placed first and
+  // the subtrees below it follow one after the other, so every treelet is contiguous at every scale.
+  void placeVanEmdeBoas(const std::vector<Node>& bvh, const std::vector<int>& heights, const int parent, const int levels, std::vector<int>& newIndices, int& next)
+  {
+    if (levels == 1)
+    {
+      placePair(bvh, parent, newIndices, next);
+      return;
+    }
+
+    const int top = levels / 2;
+
+    placeVanEmdeBoas(bvh, heights, parent, top, newIndices, next);
+
+    std::vector<int> pairs;
+    gatherPairs(bvh, parent, top, pairs);
+
+    for (const int p : pairs)
+      placeVanEmdeBoas(bvh, heights, p, std::min(levels - top, heights[p]), newIndices, next);
+  }
+}
+
+BinaryBVH::BinaryBVH() : layout(NodeLayout::DEPTH_FIRST)
+{
+
+}
+
+BinaryBVH::BinaryBVH(const std::vector<Node>& bvh, const NodeLayout layout)
+{
+  build(bvh, layout);
+}
+
+BinaryBVH::~BinaryBVH()
+{
+
+}
+
+void BinaryBVH::build(const std::vector<Node>& bvh, const NodeLayout layout)
+{
+  this->layout = layout;
+  nodes.clear();
+
+  if (bvh.empty())
+    return;
+
+  const int n = bvh.size();
+  // Depth first keeps the builder order, the root stays first in every layout
+  std::vector<int> newIndices(n);
+  std::iota(newIndices.begin(), newIndices.end(), 0);
+
+  int next = 1;
+
+  if (layout == NodeLayout::SIBLING_ADJACENT)
+  {
+    std::stack<int> stack;
+
+    if (bvh[0].rightIndex != -1)
+      stack.push(0);
+
+    while (!stack.empty())
+    {
+      const int parent = stack.top();
+      stack.pop();
+
+      placePair(bvh, parent, newIndices, next);
+
+      if (bvh[bvh[parent].rightIndex].rightIndex != -1)
+        stack.push(bvh[parent].rightIndex);
+
+      if (bvh[parent + 1].rightIndex != -1)
+        stack.push(parent + 1);
+    }
+  }
+  else if (layout == NodeLayout::VAN_EMDE_BOAS && bvh[0].rightIndex != -1)
+  {
+    // Height in sibling pairs, children are stored after their parent
+    std::vector<int> heights(n, 0);
+
+    for (int i = n - 1; i >= 0; --i)
+    {
+      if (bvh[i].rightIndex != -1)
+        heights[i] = 1 + std::max(heights[i + 1], heights[bvh[i].rightIndex]);
+    }
+
+    placeVanEmdeBoas(bvh, heights, 0, heights[0], newIndices, next);
+  }
+
+  nodes.resize(n);
+
+  for (int i = 0; i < n; ++i)
+  {
+    LayoutNode& node = nodes[newIndices[i]];
+    node.bbox = bvh[i].bbox;
+    node.startTri = bvh[i].startTri;
+    node.nTri = bvh[i].nTri;
+    node.leftIndex = bvh[i].rightIndex == -1 ? -1 : newIndices[i + 1];
+    node.rightIndex = bvh[i].rightIndex == -1 ? -1 : newIndices[bvh[i].rightIndex];
+  }
+}
+
+RaycastResult BinaryBVH::intersect(const Ray& ray, const IndexedTriangles& triangles, const float maxT, const bool anyHit) const
+{
+  RaycastResult result;
+
+  if (nodes.empty())
+    return result;
+
+  const glm::fvec3 inverseDirection = safeInverse(ray.direction);
+
+  float tMin = maxT;
+  int minTriIdx = -1;
+  glm::fvec2 minUV;
+
+  float tRoot;
+
+  if (!intersectBox(nodes[0].bbox, ray.origin, inverseDirection, tMin, tRoot))
+    return result;
+
+  TraversalStack<TraversalEntry, BINARY_BVH_STACK_SIZE> stack;
+  stack.push(TraversalEntry{0, tRoot});
+
+  while (!stack.empty())
+  {
+    const TraversalEntry entry = stack.pop();
+
+    // A closer hit was found after this node was pushed
+    if (entry.t > tMin)
+      continue;
+
+    const LayoutNode& node = nodes[entry.nodeIdx];
+
+    if (node.leftIndex == -1)
+    {
+      for (int ti = node.startTri; ti < node.startTri + node.nTri; ++ti)
+      {
+        float t;
+        glm::fvec2 uv;
+
+        if (rayTriangleIntersection(ray, triangles, ti, t, uv) && t < tMin)
+        {
+          tMin = t;
+          minTriIdx = ti;
+          minUV = uv;
+
+          if (anyHit)
+            break;
+        }
+      }
+
+      if (anyHit && minTriIdx != -1)
+        break;
+
+      continue;
+    }
+
+    const int children[2] = { node.leftIndex, node.rightIndex };
+    float tNear[2];
+    bool hit[2];
+
+    for (int c = 0; c < 2; ++c)
+      hit[c] = intersectBox(nodes[children[c]].bbox, ray.origin, inverseDirection, tMin, tNear[c]);
+
+    // The closer child is pushed last so it is visited first
+    const int first = hit[0] && hit[1] && tNear[1] < tNear[0] ? 1 : 0;
+
+    for (const int c : { 1 - first, first })
+    {
+      if (hit[c])
+        stack.push(TraversalEntry{children[c], tNear[c]});
+    }
+  }
+
+  if (minTriIdx == -1)
+    return result;
+
+  result.point = ray.origin + ray.direction * tMin;
+  result.t = tMin;
+  result.triangleIdx = minTriIdx;
+  result.uv = minUV;
+
+  return result;
+}
+
+const std::vector<LayoutNode>& BinaryBVH::getNodes() const
+{
+  return nodes;
+}
+
+NodeLayout BinaryBVH::getLayout() const
+{
+  return layout;
+}
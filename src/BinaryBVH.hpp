@@ -0,0 +1,48 @@
+#ifndef BINARYBVH_HPP
+#define BINARYBVH_HPP
+
+#include <vector>
+
+#include "Utils.hpp"
+#include "Triangle.hpp"
+
+#define BINARY_BVH_STACK_SIZE 256
+
+enum NodeLayout
+{
+  DEPTH_FIRST,      // Builder order, the left child follows its parent
+  SIBLING_ADJACENT, // Both children of a node next to each other, the pairs in depth first order
+  VAN_EMDE_BOAS     // Sibling pairs clustered recursively into treelets of half the remaining height
+};
+
+// Children are explicit so that every layout has the same node size and traversal
+struct LayoutNode
+{
+  AABB bbox;
+  int startTri;
+  int nTri;
+  int leftIndex;  // -1 for leaves
+  int rightIndex;
+};
+
+// Copy of a builder BVH with its nodes reordered for CPU traversal. The builder order stays the one
+// the renderers and the cache use.
+class BinaryBVH
+{
+public:
+  BinaryBVH();
+  BinaryBVH(const std::vector<Node>& bvh, const NodeLayout layout);
+  ~BinaryBVH();
+
+  void build(const std::vector<Node>& bvh, const NodeLayout layout);
+  RaycastResult intersect(const Ray& ray, const IndexedTriangles& triangles, const float maxT, const bool anyHit) const;
+
+  const std::vector<LayoutNode>& getNodes() const;
+  NodeLayout getLayout() const;
+
+private:
+  std::vector<LayoutNode> nodes;
+  NodeLayout layout;
+};
+
+#endif // BINARYBVH_HPP
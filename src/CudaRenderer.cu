@@ -12,26 +12,15 @@
 
 #include "Utils.hpp"
 #include "Triangle.hpp"
+#include "RenderConstants.hpp"
 
 
 #define BLOCKWIDTH 8
 #define INTERSECT_EPSILON 0.0000001f
-#define OFFSET_EPSILON 0.00001f
-#define BIGT 99999.f
-
-#define RT_SHADOWSAMPLING 8
-#define RT_SECONDARY_RAYS 3
-#define AIR_INDEX 1.f
-
-#define REFLECTIVE_BIT 0x80000000
-#define REFRACTIVE_BIT 0x40000000
-#define INSIDE_BIT 0x20000000
 
 #define LEFT_HIT_BIT 0x80000000
 #define RIGHT_HIT_BIT 0x40000000
 
-#define PT_BOUNCES 6
-
 inline __device__ float fresnelReflectioncoefficient(const float sin2t, const float cosi, const float idx1, const float idx2)
 {
   const float cost = sqrt(1 - sin2t);
@@ -970,7 +959,7 @@ void CudaRenderer::pathTraceToCanvas(GLTexture& canvas, const Camera& camera, GL
   auto* curandStateDevYRaw = thrust::raw_pointer_cast(&curandStateDevVecY[0]);
 
   auto surfaceObj = canvas.getCudaMappedSurfaceObject();
-  const Triangle* devTriangles = model.getMappedCudaTrianglePtr();
+  const Triangle* devTriangles = model.getCudaTrianglePtr();
 
   const dim3 block(BLOCKWIDTH, BLOCKWIDTH);
   const dim3 grid( (canvasSize.x+ block.x - 1) / block.x, (canvasSize.y + block.y - 1) / block.y);
@@ -991,7 +980,6 @@ void CudaRenderer::pathTraceToCanvas(GLTexture& canvas, const Camera& camera, GL
   ++currentPath;
 
   CUDA_CHECK(cudaDeviceSynchronize());
-  model.unmapCudaTrianglePtr();
   canvas.cudaUnmap();
 }
 
@@ -1006,7 +994,7 @@ void CudaRenderer::rayTraceToCanvas(GLTexture& canvas, const Camera& camera, GLM
   auto* curandStateDevYRaw = thrust::raw_pointer_cast(&curandStateDevVecY[0]);
 
   auto surfaceObj = canvas.getCudaMappedSurfaceObject();
-  const Triangle* devTriangles = model.getMappedCudaTrianglePtr();
+  const Triangle* devTriangles = model.getCudaTrianglePtr();
 
   const dim3 block(BLOCKWIDTH, BLOCKWIDTH);
   const dim3 grid( (canvasSize.x+ block.x - 1) / block.x, (canvasSize.y + block.y - 1) / block.y);
@@ -1028,7 +1016,6 @@ void CudaRenderer::rayTraceToCanvas(GLTexture& canvas, const Camera& camera, GLM
   //cudaTestRnd<<<grid, block>>>(surfaceObj, canvasSize, curandStateDevXRaw, curandStateDevYRaw);
 
   CUDA_CHECK(cudaDeviceSynchronize());
-  model.unmapCudaTrianglePtr();
   canvas.cudaUnmap();
 }
 
@@ -1040,7 +1027,7 @@ std::vector<glm::fvec3> CudaRenderer::debugRayTrace(const glm::ivec2 pixelPos, c
   auto* curandStateDevXRaw = thrust::raw_pointer_cast(&curandStateDevVecX[0]);
   auto* curandStateDevYRaw = thrust::raw_pointer_cast(&curandStateDevVecY[0]);
 
-  Triangle* devTriangles = model.getMappedCudaTrianglePtr();
+  Triangle* devTriangles = model.getCudaTrianglePtr();
 
   dim3 block(1, 1);
   dim3 grid(1, 1);
@@ -1066,7 +1053,6 @@ std::vector<glm::fvec3> CudaRenderer::debugRayTrace(const glm::ivec2 pixelPos, c
       model.getDeviceBVH());
 
   CUDA_CHECK(cudaDeviceSynchronize());
-  model.unmapCudaTrianglePtr();
 
   std::vector<glm::fvec3> hitPos(nVertices);
   CUDA_CHECK(cudaMemcpy(hitPos.data(), devPosPtr, nVertices * sizeof(glm::fvec3), cudaMemcpyDeviceToHost));
@@ -1083,7 +1069,7 @@ std::vector<glm::fvec3> CudaRenderer::debugPathTrace(const glm::ivec2 pixelPos,
   auto* curandStateDevXRaw = thrust::raw_pointer_cast(&curandStateDevVecX[0]);
   auto* curandStateDevYRaw = thrust::raw_pointer_cast(&curandStateDevVecY[0]);
 
-  Triangle* devTriangles = model.getMappedCudaTrianglePtr();
+  Triangle* devTriangles = model.getCudaTrianglePtr();
 
   dim3 block(1, 1);
   dim3 grid(1, 1);
@@ -1108,7 +1094,6 @@ std::vector<glm::fvec3> CudaRenderer::debugPathTrace(const glm::ivec2 pixelPos,
       model.getDeviceBVH());
 
   CUDA_CHECK(cudaDeviceSynchronize());
-  model.unmapCudaTrianglePtr();
 
   std::vector<glm::fvec3> hitPos(nVertices);
   CUDA_CHECK(cudaMemcpy(hitPos.data(), devPosPtr, nVertices * sizeof(glm::fvec3), cudaMemcpyDeviceToHost));
@@ -151,9 +151,9 @@ float GLContext::getTime() const
   return (float) glfwGetTime();
 }
 
-void GLContext::drawUI(const enum ActiveRenderer activeRenderer, const enum DebugMode debugMode)
+void GLContext::drawUI(const enum ActiveRenderer activeRenderer, const enum DebugMode debugMode, LoadProgress* loadProgress, const float samplesPerSecond)
 {
-  ui.draw(activeRenderer, debugMode);
+  ui.draw(activeRenderer, debugMode, loadProgress, samplesPerSecond);
 }
 
 bool GLContext::UiWantsMouseInput()
@@ -290,19 +290,14 @@ void GLContext::drawNodeTriangles(const GLModel& model, const GLLight& light, co
   GL_CHECK(glBindTexture(GL_TEXTURE_2D, light.getShadowMap().getDepthTextureID()));
   GL_CHECK(glBindVertexArray(vaoID));
 
-
-  std::vector<GLuint> vIndices(node.nTri * 3);
-
-  unsigned int cntr = node.startTri * 3;
-  for (auto& v : vIndices)
-  {
-    v = cntr++;
-  }
+  // The triangles of a node are contiguous in the element buffer
+  GL_CHECK(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, model.getEboID()));
 
   modelShader.updateUniform3fv("material.colorAmbient", glm::fvec3(1.f, 1.f, 0.f));
   modelShader.updateUniform3fv("material.colorDiffuse", glm::fvec3(1.f, 1.f, 0.f));
-  GL_CHECK(glDrawElements(GL_TRIANGLES, vIndices.size(), GL_UNSIGNED_INT, vIndices.data()));
+  GL_CHECK(glDrawElements(GL_TRIANGLES, node.nTri * 3, GL_UNSIGNED_INT, (GLvoid*)(node.startTri * sizeof(glm::uvec3))));
 
+  GL_CHECK(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0));
 
   GL_CHECK(glBindVertexArray(0));
   modelShader.unbind();
@@ -10,27 +10,27 @@
 
 GLDrawable::GLDrawable() :
 #ifdef ENABLE_CUDA
-  cudaGraphicsTriangleResource(),
+  cudaTrianglePtr(),
   cudaMaterialPtr(),
   cudaTriangleMaterialIdsPtr(),
 #endif
   vaoID(0),
   vboID(0),
+  eboID(0),
   nTriangles(0),
   textureInternalFormat(GL_RGB8)
 {
 
 }
 
-void GLDrawable::finalizeLoad(const std::vector<Triangle>& triangles, const std::vector<MeshDescriptor>& meshDescriptors, const std::vector<Material>& materials,  const std::vector<unsigned int>& triangleMaterialIds)
+void GLDrawable::finalizeLoad(const std::vector<Vertex>& vertices, const std::vector<glm::uvec3>& triangleIndices, const std::vector<MeshDescriptor>& meshDescriptors, const std::vector<Material>& materials,  const std::vector<unsigned int>& triangleMaterialIds)
 {
-  if (triangles.size() == 0 || meshDescriptors.size() == 0)
+  if (triangleIndices.size() == 0 || meshDescriptors.size() == 0)
   {
     std::cerr << "Model is empty!" << std::endl;
     return;
   }
 
-  nTriangles = GLuint(triangles.size());
   this->meshDescriptors = meshDescriptors;
   this->materials = materials;
 
@@ -47,7 +47,7 @@ void GLDrawable::finalizeLoad(const std::vector<Triangle>& triangles, const std:
 
   GL_CHECK(glGenBuffers(1, &vboID));
   GL_CHECK(glBindBuffer(GL_ARRAY_BUFFER, vboID));
-  GL_CHECK(glBufferData(GL_ARRAY_BUFFER, triangles.size() * 3 * sizeof(Vertex), triangles.data(), GL_STATIC_DRAW));
+  GL_CHECK(glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(Vertex), vertices.data(), GL_STATIC_DRAW));
 
   GL_CHECK(glEnableVertexAttribArray(0));
   GL_CHECK(glVertexAttribPointer(
@@ -71,65 +71,97 @@ void GLDrawable::finalizeLoad(const std::vector<Triangle>& triangles, const std:
 
   GL_CHECK(glBindVertexArray(0));
 
+  setTriangleIndices(vertices, triangleIndices);
+}
+
+// The element buffer and the expanded CUDA triangles are only written here, so they never disagree
+void GLDrawable::setTriangleIndices(const std::vector<Vertex>& vertices, const std::vector<glm::uvec3>& triangleIndices)
+{
+  // The mesh draws index the vertices from client memory, so the vertex array keeps no element buffer.
+  // Binding it while the vertex array is bound and unbinding it again records that.
+  if (eboID == 0)
+    GL_CHECK(glGenBuffers(1, &eboID));
+
+  GL_CHECK(glBindVertexArray(vaoID));
+  GL_CHECK(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, eboID));
+  GL_CHECK(glBufferData(GL_ELEMENT_ARRAY_BUFFER, triangleIndices.size() * sizeof(glm::uvec3), triangleIndices.data(), GL_STATIC_DRAW));
+  GL_CHECK(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0));
+  GL_CHECK(glBindVertexArray(0));
+
 #ifdef ENABLE_CUDA
-  registerCuda();
+  std::vector<Triangle> triangles(triangleIndices.size());
+  const IndexedTriangles indexed(vertices.data(), triangleIndices.data());
+
+#pragma omp parallel for
+  for (int i = 0; i < static_cast<int>(triangles.size()); ++i)
+    triangles[i] = indexed[i];
+
+  if (cudaTrianglePtr == nullptr || triangles.size() != nTriangles)
+  {
+    CUDA_CHECK(cudaFree(cudaTrianglePtr));
+    CUDA_CHECK(cudaMalloc((void**) &cudaTrianglePtr, triangles.size() * sizeof(Triangle)));
+  }
+
+  CUDA_CHECK(cudaMemcpy(cudaTrianglePtr, triangles.data(), triangles.size() * sizeof(Triangle), cudaMemcpyHostToDevice));
+#else
+  (void) vertices;
 #endif
+
+  nTriangles = GLuint(triangleIndices.size());
 }
 
-#ifdef ENABLE_CUDA
-void GLDrawable::registerCuda()
+void GLDrawable::updateGeometry(const std::vector<Vertex>& vertices, const std::vector<glm::uvec3>& triangleIndices, const std::vector<unsigned int>& triangleMaterialIds)
 {
-  CUDA_CHECK(cudaGraphicsGLRegisterBuffer(&cudaGraphicsTriangleResource, vboID, cudaGraphicsRegisterFlagsReadOnly));
-  CUDA_CHECK(cudaGraphicsMapResources(1, &cudaGraphicsTriangleResource));
-
-  size_t numBytes(0);
-  Triangle* cudaTrianglePtr;
-  CUDA_CHECK(cudaGraphicsResourceGetMappedPointer((void**)&cudaTrianglePtr, &numBytes, cudaGraphicsTriangleResource));
+  GL_CHECK(glBindBuffer(GL_ARRAY_BUFFER, vboID));
+  GL_CHECK(glBufferSubData(GL_ARRAY_BUFFER, 0, vertices.size() * sizeof(Vertex), vertices.data()));
+  GL_CHECK(glBindBuffer(GL_ARRAY_BUFFER, 0));
 
-  if (numBytes / sizeof(Triangle) != nTriangles)
-    std::cerr << "Triangle data registration failed: memory mapping failure" << std::endl;
+  if (triangleMaterialIds.size() != nTriangles)
+  {
+    CUDA_CHECK(cudaFree(cudaTriangleMaterialIdsPtr));
+    CUDA_CHECK(cudaMalloc((void**) &cudaTriangleMaterialIdsPtr, triangleMaterialIds.size() * sizeof(unsigned int)));
+  }
 
-  CUDA_CHECK(cudaGraphicsUnmapResources(1, &cudaGraphicsTriangleResource));
+  CUDA_CHECK(cudaMemcpy(cudaTriangleMaterialIdsPtr, triangleMaterialIds.data(), triangleMaterialIds.size() * sizeof(unsigned int), cudaMemcpyHostToDevice));
 
+  setTriangleIndices(vertices, triangleIndices);
 }
-#endif
 
 GLDrawable::~GLDrawable()
 {
 	clear();
 }
 
-Triangle* GLDrawable::getMappedCudaTrianglePtr()
+Triangle* GLDrawable::getCudaTrianglePtr()
 {
-  Triangle* cudaTrianglePtr(nullptr);
-  size_t numBytes(0);
-  (void) numBytes; // To silence compiler
-  CUDA_CHECK(cudaGraphicsMapResources(1, &cudaGraphicsTriangleResource));
-  CUDA_CHECK(cudaGraphicsResourceGetMappedPointer((void**)&cudaTrianglePtr, &numBytes, cudaGraphicsTriangleResource));
-
+#ifdef ENABLE_CUDA
   return cudaTrianglePtr;
-}
-
-void GLDrawable::unmapCudaTrianglePtr()
-{
-  CUDA_CHECK(cudaGraphicsUnmapResources(1, &cudaGraphicsTriangleResource));
+#else
+  return nullptr;
+#endif
 }
 
 void GLDrawable::clear()
 {
   if (nTriangles > 0)
   {
-    CUDA_CHECK(cudaGraphicsUnregisterResource(cudaGraphicsTriangleResource));
+    CUDA_CHECK(cudaFree(cudaTrianglePtr));
     CUDA_CHECK(cudaFree(cudaMaterialPtr));
     CUDA_CHECK(cudaFree(cudaTriangleMaterialIdsPtr));
   }
 
+#ifdef ENABLE_CUDA
+  cudaTrianglePtr = nullptr;
+#endif
+
   GL_CHECK(glBindVertexArray(0));
   GL_CHECK(glDeleteBuffers(1, &vboID));
+  GL_CHECK(glDeleteBuffers(1, &eboID));
   GL_CHECK(glDeleteVertexArrays(1, &vaoID));
 
   vaoID = 0;
   vboID = 0;
+  eboID = 0;
   nTriangles = 0;
 }
 
@@ -143,6 +175,11 @@ GLuint GLDrawable::getVboID() const
   return vboID;
 }
 
+GLuint GLDrawable::getEboID() const
+{
+  return eboID;
+}
+
 GLuint GLDrawable::getNTriangles() const
 {
   return nTriangles;
@@ -22,6 +22,7 @@ public:
 
   GLuint getVaoID() const;
   GLuint getVboID() const;
+  GLuint getEboID() const; // Triangle indices in BVH order, not bound to the vertex array
   GLuint getNTriangles() const;
   GLuint getNMeshes() const;
 
@@ -30,27 +31,29 @@ public:
   const std::vector<MeshDescriptor>& getMeshDescriptors() const; // Used when drawing OpenGL
   const std::vector<Material>& getMaterials() const;
 
-  Triangle* getMappedCudaTrianglePtr();
-  void unmapCudaTrianglePtr();
+  Triangle* getCudaTrianglePtr(); // Expanded from the vertices and indices, rebuilt with the index buffer
   Material* getCudaMaterialsPtr();
   unsigned int* getCudaTriangleMaterialIdsPtr();
 
 protected:
   GLDrawable();
   void clear();
-  void finalizeLoad(const std::vector<Triangle>& triangles, const std::vector<MeshDescriptor>& meshDescriptors, const std::vector<Material>& materials, const std::vector<unsigned int>& triangleMaterialIds);
+  void finalizeLoad(const std::vector<Vertex>& vertices, const std::vector<glm::uvec3>& triangleIndices, const std::vector<MeshDescriptor>& meshDescriptors, const std::vector<Material>& materials, const std::vector<unsigned int>& triangleMaterialIds);
+  void setTriangleIndices(const std::vector<Vertex>& vertices, const std::vector<glm::uvec3>& triangleIndices);
+  // The vertices keep their count and order, the triangles may be reordered or change their count
+  void updateGeometry(const std::vector<Vertex>& vertices, const std::vector<glm::uvec3>& triangleIndices, const std::vector<unsigned int>& triangleMaterialIds);
 
 private:
 
 #ifdef ENABLE_CUDA
-  void registerCuda();
-  cudaGraphicsResource_t cudaGraphicsTriangleResource;
+  Triangle* cudaTrianglePtr; // The kernels read whole triangles, so the device keeps them expanded
   Material* cudaMaterialPtr;
   unsigned int* cudaTriangleMaterialIdsPtr;
 #endif
 
   GLuint vaoID;
   GLuint vboID;
+  GLuint eboID;
   GLuint nTriangles;
   
   GLenum textureInternalFormat;
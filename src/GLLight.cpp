@@ -62,17 +62,12 @@ void GLLight::load(const Light& light)
     vertices.push_back(v);
   }
 
-  unsigned int nTriangles = GLuint(vertices.size() / 3);
+  const std::vector<glm::uvec3> triangleIndices { glm::uvec3(0, 1, 2), glm::uvec3(3, 4, 5) };
 
-  std::vector<Triangle> triangles;
-
-  for (unsigned int i = 0; i < nTriangles; ++i)
-    triangles.push_back(Triangle(vertices[i*3], vertices[i*3+1], vertices[i*3+2]));
-    
   glm::fmat4 depthProjectionMatrix = glm::perspective(glm::half_pi<float>(), (float) light.getSize().x / (float) light.getSize().y, 0.001f, 10.f);
   depthMVP = depthProjectionMatrix * glm::inverse(light.getModelMat());
 
-  finalizeLoad(triangles, meshDescriptors, materials, triangleMaterialIds);
+  finalizeLoad(vertices, triangleIndices, meshDescriptors, materials, triangleMaterialIds);
 }
 
 const Light& GLLight::getLight() const
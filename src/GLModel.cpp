@@ -40,11 +40,23 @@ void GLModel::load(const Model& model)
   CUDA_CHECK(cudaMemcpy(deviceBVH, model.getBVH().data(), model.getBVH().size() * sizeof(Node), cudaMemcpyHostToDevice));
 #endif
 
-  const std::vector<Triangle>& triangles = model.getTriangles();
-  
-  std::cout << "Triangles: " << triangles.size() << std::endl;
-  
-  finalizeLoad(triangles, meshDescriptors, materials, triangleMaterialIds);
+  const std::vector<glm::uvec3>& triangleIndices = model.getTriangleIndices();
+
+  std::cout << "Triangles: " << triangleIndices.size() << ", vertices: " << model.getVertices().size() << std::endl;
+
+  finalizeLoad(model.getVertices(), triangleIndices, meshDescriptors, materials, triangleMaterialIds);
+}
+
+void GLModel::updateGeometry(const Model& model)
+{
+#ifdef ENABLE_CUDA
+  // A rebuild can change the node count
+  CUDA_CHECK(cudaFree(deviceBVH));
+  CUDA_CHECK(cudaMalloc((void**) &deviceBVH, model.getBVH().size() * sizeof(Node)));
+  CUDA_CHECK(cudaMemcpy(deviceBVH, model.getBVH().data(), model.getBVH().size() * sizeof(Node), cudaMemcpyHostToDevice));
+#endif
+
+  GLDrawable::updateGeometry(model.getVertices(), model.getTriangleIndices(), model.getTriangleMaterialIds());
 }
 
 const std::vector<MeshDescriptor>& GLModel::getBVHBoxDescriptors() const
@@ -20,6 +20,7 @@ public:
   const std::vector<Material>& getBVHBoxMaterials() const;
   const std::vector<MeshDescriptor>& getBVHBoxDescriptors() const;
   void load(const Model& model);
+  void updateGeometry(const Model& model); // After Model::refit, uploads the moved vertices and the new BVH
   const std::string& getFileName() const;
 
 private:
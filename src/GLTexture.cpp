@@ -89,6 +89,13 @@ void GLTexture::resize(const glm::ivec2 newSize)
   CUDA_CHECK(cudaGraphicsGLRegisterImage(&cudaCanvasResource, textureID, GL_TEXTURE_2D, cudaGraphicsMapFlagsNone));
 }
 
+void GLTexture::upload(const std::vector<glm::fvec4>& pixels)
+{
+  GL_CHECK(glBindTexture(GL_TEXTURE_2D, textureID));
+  GL_CHECK(glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, size.x, size.y, GL_RGBA, GL_FLOAT, pixels.data()));
+  GL_CHECK(glBindTexture(GL_TEXTURE_2D, 0));
+}
+
 GLuint GLTexture::getTextureID() const
 {
   return textureID;
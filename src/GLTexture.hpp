@@ -27,6 +27,7 @@ public:
 
   void load(const unsigned char* pixels, const glm::ivec2 size);
   void resize(const glm::ivec2 newSize);
+  void upload(const std::vector<glm::fvec4>& pixels); // Whole texture, rows from the bottom
 
   //template <typename T>
   //std::vector<T> getHostData();
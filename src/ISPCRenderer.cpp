@@ -1,6 +1,646 @@
 #include "ISPCRenderer.hpp"
+#include "RayPacket.hpp"
+#include "RenderConstants.hpp"
 
-ISPCRenderer::ISPCRenderer()
+#include <cmath>
+#include <cstring>
+#include <chrono>
+#include <algorithm>
+#include <array>
+
+#include <glm/gtc/constants.hpp>
+
+#ifdef _OPENMP
+  #include <omp.h>
+#endif
+
+// Pixels of one primary ray packet, CPU_MIN_TILE_SIZE is a multiple of both
+#define PACKET_WIDTH 4
+#define PACKET_HEIGHT (RAY_PACKET_SIZE / PACKET_WIDTH)
+
+namespace
+{
+  // Xorshift with a hashed seed per pixel and frame
+  class Random
+  {
+  public:
+    Random(const unsigned int pixel, const unsigned int frame) : state(hash(pixel ^ hash(frame + 1u)) | 1u) {};
+
+    // Continues a sequence whose state was stored between wavefront stages
+    explicit Random(const unsigned int state) : state(state) {};
+
+    unsigned int getState() const
+    {
+      return state;
+    }
+
+    float uniform()
+    {
+      state ^= state << 13;
+      state ^= state >> 17;
+      state ^= state << 5;
+
+      return (state >> 8) * (1.f / 16777216.f);
+    }
+
+  private:
+    static unsigned int hash(unsigned int x)
+    {
+      x = (x ^ 61u) ^ (x >> 16);
+      x *= 9u;
+      x ^= x >> 4;
+      x *= 0x27d4eb2du;
+      x ^= x >> 15;
+
+      return x;
+    }
+
+    unsigned int state;
+  };
+
+  struct Scene
+  {
+    const NativeWideBVH& bvh;
+    const BinaryBVH& packetBVH; // Traversed by coherent ray packets
+    const IndexedTriangles triangles;
+    const Material* materials;
+    const unsigned int* triangleMaterialIds;
+    const TwoLevelBVH& instances; // Traced instead of the BVHs above unless empty
+    const Light& light;
+  };
+
+  struct RaycastTask
+  {
+    Ray outRay;
+    unsigned short levelsLeft;
+    glm::fvec3 filter;
+  };
+
+  inline float fresnelReflectioncoefficient(const float sin2t, const float cosi, const float idx1, const float idx2)
+  {
+    const float cost = std::sqrt(1 - sin2t);
+
+    float Rs = (idx1 * cosi - idx2 * cost) / (idx1 * cosi + idx2 * cost);
+    Rs = Rs * Rs;
+
+    float Rp = (idx2 * cosi - idx1 * cost) / (idx2 * cosi + idx1 * cost);
+    Rp = Rp * Rp;
+
+    return (Rs + Rp) * 0.5f;
+  }
+
+  inline glm::fvec3 reflectionDirection(const glm::vec3 normal, const glm::vec3 incoming)
+  {
+    const float cosT = glm::dot(incoming, normal);
+
+    return incoming - 2 * cosT * normal;
+  }
+
+  inline glm::fvec3 refractionDirection(const float cosInAng, const float sin2t, const glm::vec3 normal, const glm::vec3 incoming, const float index1, const float index2)
+  {
+    return index1 / index2 * incoming + (index1 / index2 * cosInAng - std::sqrt(1 - sin2t)) * normal;
+  }
+
+  inline float saturate(const float x)
+  {
+    return glm::clamp(x, 0.f, 1.f);
+  }
+
+  glm::fmat3 getBasis(const glm::fvec3 n)
+  {
+    glm::fmat3 R;
+
+    glm::fvec3 Q = n;
+    const glm::fvec3 absq = glm::abs(Q);
+    const float absqmin = std::min(absq.x, std::min(absq.y, absq.z));
+
+    for (int i = 0; i < 3; ++i)
+    {
+      if (absq[i] == absqmin)
+      {
+        Q[i] = 1;
+        break;
+      }
+    }
+
+    const glm::fvec3 T = glm::normalize(glm::cross(Q, n));
+    const glm::fvec3 B = glm::normalize(glm::cross(n, T));
+
+    R[0] = T;
+    R[1] = B;
+    R[2] = n;
+
+    return R;
+  }
+
+  // Closest or any hit of one ray. With instancing the triangle index refers to the mesh of instanceIdx,
+  // otherwise instanceIdx is -1.
+  inline RaycastResult intersect(const Ray& ray, const float maxT, const bool anyHit, const Scene& scene, int& instanceIdx)
+  {
+    if (!scene.instances.empty())
+      return scene.instances.intersect(ray, maxT, anyHit, instanceIdx);
+
+    instanceIdx = -1;
+
+    return scene.bvh.intersect(ray, scene.triangles, maxT, anyHit);
+  }
+
+  // All lanes of the packet. There is no single BVH to take an instanced packet through, so its lanes
+  // are traced one by one.
+  void intersect(const RayPacket& packet, const bool anyHit, const Scene& scene, RaycastResult* results, int* instanceIds)
+  {
+    if (scene.instances.empty())
+    {
+      intersectPacket(scene.packetBVH, scene.triangles, packet, anyHit, results);
+      std::fill(instanceIds, instanceIds + RAY_PACKET_SIZE, -1);
+
+      return;
+    }
+
+    for (int l = 0; l < RAY_PACKET_SIZE; ++l)
+    {
+      results[l] = RaycastResult();
+      instanceIds[l] = -1;
+
+      if (packet.active & (1u << l))
+      {
+        const Ray ray(glm::fvec3(packet.origin[0][l], packet.origin[1][l], packet.origin[2][l]), glm::fvec3(packet.direction[0][l], packet.direction[1][l], packet.direction[2][l]));
+        results[l] = scene.instances.intersect(ray, packet.tMax[l], anyHit, instanceIds[l]);
+      }
+    }
+  }
+
+  // Material and world space shading normal of a hit
+  const Material& surface(const RaycastResult& result, const int instanceIdx, const Scene& scene, glm::fvec3& interpolatedNormal)
+  {
+    if (instanceIdx == -1)
+    {
+      interpolatedNormal = scene.triangles[result.triangleIdx].normal(result.uv);
+
+      return scene.materials[scene.triangleMaterialIds[result.triangleIdx]];
+    }
+
+    const MeshInstance& instance = scene.instances.getInstances()[instanceIdx];
+    const MeshBVH& mesh = scene.instances.getMeshes()[instance.meshIdx];
+    const Triangle triangle = IndexedTriangles(mesh.vertices.data(), mesh.triangleIndices.data())[result.triangleIdx];
+
+    interpolatedNormal = glm::normalize(glm::transpose(glm::fmat3(instance.inverseTransform)) * triangle.normal(result.uv));
+
+    return scene.materials[mesh.materialIdx];
+  }
+
+  // Shadow ray toward a random point on the light, returns the light arriving along it if nothing is in between
+  glm::fvec3 sampleLight(const glm::fvec3 interpolatedNormal, const glm::fvec3 shadowRayOrigin, const Scene& scene, Random& random, Ray& shadowRay, float& maxT)
+  {
+    glm::fvec3 lightSamplePoint;
+    float pdf;
+
+    const float x = random.uniform();
+    scene.light.sample(pdf, lightSamplePoint, x, random.uniform());
+
+    const glm::fvec3 shadowRayDir = lightSamplePoint - shadowRayOrigin;
+
+    maxT = glm::length(shadowRayDir); // Distance to the light
+    shadowRay = Ray(shadowRayOrigin, shadowRayDir / maxT);
+
+    const float cosOmega = saturate(glm::dot(shadowRay.direction, interpolatedNormal));
+    const float cosL = saturate(glm::dot(-shadowRay.direction, scene.light.getNormal()));
+
+    return 1.f / (maxT * maxT * pdf) * scene.light.getEmission() * cosL * cosOmega;
+  }
+
+  template <unsigned int samples>
+  glm::fvec3 areaLightShading(const glm::fvec3 interpolatedNormal, const Scene& scene, const RaycastResult& result, Random& random)
+  {
+    glm::fvec3 brightness(0.f);
+
+    const glm::fvec3 shadowRayOrigin = result.point + interpolatedNormal * OFFSET_EPSILON;
+
+    // All shadow rays start at the same point and end on the light, so they are traced as packets
+    for (unsigned int i = 0; i < samples; i += RAY_PACKET_SIZE)
+    {
+      const int nRays = std::min(samples - i, (unsigned int) RAY_PACKET_SIZE);
+
+      RayPacket packet;
+      Ray shadowRays[RAY_PACKET_SIZE];
+      float distances[RAY_PACKET_SIZE];
+      glm::fvec3 light[RAY_PACKET_SIZE];
+
+      for (int l = 0; l < nRays; ++l)
+      {
+        light[l] = sampleLight(interpolatedNormal, shadowRayOrigin, scene, random, shadowRays[l], distances[l]);
+        packet.set(l, shadowRays[l], distances[l]);
+      }
+
+      // Only occluders closer than the light are reported. A single ray is faster in the wide BVH.
+      RaycastResult occluders[RAY_PACKET_SIZE];
+      int instanceIds[RAY_PACKET_SIZE];
+
+      if (nRays > 1)
+        intersect(packet, true, scene, occluders, instanceIds);
+      else
+        occluders[0] = intersect(shadowRays[0], distances[0], true, scene, instanceIds[0]);
+
+      for (int l = 0; l < nRays; ++l)
+      {
+        if (!occluders[l])
+          brightness += light[l];
+      }
+    }
+
+    brightness /= (float) samples;
+
+    return brightness;
+  }
+
+  // Same shading as rayTrace in CudaRenderer.cu, the primary ray's hit comes from its packet
+  glm::fvec3 rayTrace(const Ray& ray, const RaycastResult& primaryHit, const int primaryInstanceIdx, const Scene& scene, Random& random)
+  {
+    RaycastTask stack[1 << RT_SECONDARY_RAYS];
+    glm::fvec3 color(0.f);
+    int stackPtr = 0;
+
+    // Primary ray
+    stack[stackPtr].outRay = ray;
+    stack[stackPtr].levelsLeft = RT_SECONDARY_RAYS;
+    stack[stackPtr].filter = glm::fvec3(1.f);
+    ++stackPtr;
+
+    while (stackPtr > 0)
+    {
+      --stackPtr;
+
+      const RaycastTask currentTask = stack[stackPtr];
+
+      int instanceIdx = primaryInstanceIdx;
+      const RaycastResult result = currentTask.levelsLeft == RT_SECONDARY_RAYS ? primaryHit : intersect(currentTask.outRay, BIGT, false, scene, instanceIdx);
+
+      if (!result)
+        continue;
+
+      glm::fvec3 interpolatedNormal;
+      const Material& material = surface(result, instanceIdx, scene, interpolatedNormal);
+
+      unsigned int mask = INSIDE_BIT;
+
+      if (glm::dot(interpolatedNormal, currentTask.outRay.direction) > 0.f)
+        interpolatedNormal = -interpolatedNormal;  // We are inside an object. Flip the normal.
+      else
+        mask = 0x00000000; // We are outside. Unset bit.
+
+      color += currentTask.filter * material.colorAmbient * 0.25f;
+
+      const glm::fvec3 brightness = areaLightShading<RT_SHADOWSAMPLING>(interpolatedNormal, scene, result, random);
+      color += currentTask.filter * material.colorDiffuse / glm::pi<float>() * brightness;
+
+      if (material.shadingMode == material.GORAUD)
+        continue;
+
+      // Phong's specular highlight
+      if ((mask & INSIDE_BIT) == 0x00 && material.shadingMode == material.PHONG)
+      {
+        const glm::fvec3 rm = reflectionDirection(interpolatedNormal, glm::normalize(scene.light.getPosition() - result.point));
+        color += material.colorSpecular * std::pow(saturate(glm::dot(rm, currentTask.outRay.direction)), material.shininess);
+      }
+
+      if (material.shadingMode != material.FRESNEL || currentTask.levelsLeft == 0)
+        continue;
+
+      RaycastTask newTask; // Used twice for pushing
+
+      mask = (material.colorSpecular.x != 0.f ||
+          material.colorSpecular.y != 0.f ||
+          material.colorSpecular.z != 0.f) ? REFLECTIVE_BIT | mask : mask;
+
+      mask = (material.colorTransparent.x != 0.f ||
+          material.colorTransparent.y != 0.f ||
+          material.colorTransparent.z != 0.f) ? REFRACTIVE_BIT | mask : mask;
+
+      float R = 1.f;
+
+      if ((mask & REFRACTIVE_BIT) != 0x00) // Refractive
+      {
+        const float idx1 = AIR_INDEX;
+        const float idx2 = material.refrIdx;
+
+        const float rat = (mask & INSIDE_BIT) != 0x00 ? idx1 / idx2 : idx2 / idx1;
+
+        // Transmittance and reflection according to fresnel
+        const float cosi = std::fabs(glm::dot(currentTask.outRay.direction, interpolatedNormal));
+
+        if (std::sin(std::acos(cosi)) <= rat) // Check for total internal reflection
+        {
+          const float sin2t = std::fabs((idx1 / idx2) * (idx1 / idx2) * (1 - cosi * cosi));
+
+          R = fresnelReflectioncoefficient(sin2t, cosi, idx1, idx2);
+
+          const glm::fvec3 transOrig = result.point - interpolatedNormal * OFFSET_EPSILON;
+          const glm::fvec3 transDir = refractionDirection(cosi, sin2t, interpolatedNormal, currentTask.outRay.direction, idx1, idx2);
+
+          newTask.outRay = Ray(transOrig, transDir);
+          newTask.levelsLeft = currentTask.levelsLeft - 1;
+          newTask.filter = currentTask.filter * material.colorTransparent * (1 - R);
+          stack[stackPtr] = newTask;
+          ++stackPtr;
+        }
+      }
+
+      if ((mask & REFLECTIVE_BIT) != 0x00) // Reflective
+      {
+        const glm::fvec3 reflOrig = result.point + interpolatedNormal * OFFSET_EPSILON;
+        const glm::fvec3 reflDir = reflectionDirection(interpolatedNormal, currentTask.outRay.direction);
+
+        newTask.outRay = Ray(reflOrig, reflDir);
+        newTask.levelsLeft = currentTask.levelsLeft - 1;
+        newTask.filter = currentTask.filter * material.colorSpecular * R;
+        stack[stackPtr] = newTask;
+        ++stackPtr;
+      }
+    }
+
+    return color;
+  }
+
+  // One bounce of pathTrace in CudaRenderer.cu. Returns the ambient and specular light, the direct
+  // light reaches the path only if nothing blocks shadowRay. currentRay becomes the next ray of the path.
+  glm::fvec3 shadePath(Ray& currentRay, const RaycastResult& result, const int instanceIdx, const Scene& scene, Random& random, glm::fvec3& throughput, float& p, Ray& shadowRay, float& shadowMaxT, glm::fvec3& shadowLight)
+  {
+    glm::fvec3 color(0.f);
+
+    glm::fvec3 interpolatedNormal;
+    const Material& material = surface(result, instanceIdx, scene, interpolatedNormal);
+
+    unsigned int mask = INSIDE_BIT;
+
+    if (glm::dot(interpolatedNormal, currentRay.direction) > 0.f)
+      interpolatedNormal = -interpolatedNormal;  // We are inside an object. Flip the normal.
+    else
+      mask = 0x00; // We are outside. Unset bit.
+
+    color += throughput * material.colorAmbient * 0.25f;
+
+    const glm::fvec3 brightness = sampleLight(interpolatedNormal, result.point + interpolatedNormal * OFFSET_EPSILON, scene, random, shadowRay, shadowMaxT);
+    shadowLight = throughput * material.colorDiffuse / (glm::pi<float>() * p) * brightness;
+
+    // Phong's specular highlight
+    if ((mask & INSIDE_BIT) == 0x00 && material.shadingMode == material.PHONG)
+    {
+      const glm::fvec3 rm = reflectionDirection(interpolatedNormal, glm::normalize(scene.light.getPosition() - result.point));
+      color += material.colorSpecular * std::pow(saturate(glm::dot(rm, currentRay.direction)), material.shininess);
+    }
+
+    glm::fvec3 newDir, newOrig;
+
+    if (material.shadingMode == material.FRESNEL)
+    {
+      mask = (material.colorSpecular.x != 0.f ||
+          material.colorSpecular.y != 0.f ||
+          material.colorSpecular.z != 0.f) ? REFLECTIVE_BIT | mask : mask;
+
+      mask = (material.colorTransparent.x != 0.f ||
+          material.colorTransparent.y != 0.f ||
+          material.colorTransparent.z != 0.f) ? REFRACTIVE_BIT | mask : mask;
+
+      float rP = 1.f; // Probability for reflection to occur. Depends on the strength of the specular and transparent colors.
+
+      float R = 1.f; // Fresnel reflection coefficient
+      float cosi = 0.f, sin2t = 0.f, idx1 = AIR_INDEX, idx2 = AIR_INDEX;
+
+      if ((mask & REFRACTIVE_BIT) != 0x00)
+      {
+        const float rLen = glm::length(material.colorSpecular);
+        const float tLen = glm::length(material.colorTransparent);
+
+        rP = rLen / (rLen + tLen);
+
+        idx2 = material.refrIdx;
+
+        const float rat = (mask & INSIDE_BIT) != 0x00 ? idx1 / idx2 : idx2 / idx1;
+
+        cosi = std::fabs(glm::dot(currentRay.direction, interpolatedNormal));
+
+        if (std::sin(std::acos(cosi)) <= rat) // Check for total internal reflection
+        {
+          sin2t = std::fabs((idx1 / idx2) * (idx1 / idx2) * (1 - cosi * cosi));
+          R = fresnelReflectioncoefficient(sin2t, cosi, idx1, idx2);
+        }
+      }
+
+      rP *= R;
+
+      rP = rP / (rP + (1.f - rP) * (1.f - R));
+
+      if (random.uniform() < rP)
+      {
+        newDir = reflectionDirection(interpolatedNormal, currentRay.direction);
+        newOrig = result.point + interpolatedNormal * OFFSET_EPSILON;
+        throughput *= material.colorSpecular / rP;
+      }
+      else
+      {
+        newDir = refractionDirection(cosi, sin2t, interpolatedNormal, currentRay.direction, idx1, idx2);
+        newOrig = result.point - interpolatedNormal * OFFSET_EPSILON;
+        throughput *= material.colorTransparent;
+      }
+    }
+    else // Diffuse
+    {
+      const glm::fmat3 B = getBasis(interpolatedNormal);
+
+      do {
+        newDir = glm::fvec3(random.uniform() * 2.0f - 1.0f, random.uniform() * 2.0f - 1.0f, 0.f);
+      } while ((newDir.x * newDir.x + newDir.y * newDir.y) >= 1);
+
+      newDir.z = std::sqrt(1 - newDir.x * newDir.x - newDir.y * newDir.y);
+      newDir = glm::normalize(B * newDir);
+
+      newOrig = result.point + OFFSET_EPSILON * interpolatedNormal;
+
+      p *= glm::dot(newDir, interpolatedNormal) * (1.f / glm::pi<float>());
+      throughput *= material.colorDiffuse / glm::pi<float>() * glm::dot(newDir, interpolatedNormal);
+    }
+
+    currentRay = Ray(newOrig, newDir);
+
+    return color;
+  }
+
+  // Same sampling as pathTrace in CudaRenderer.cu, the primary ray's hit comes from its packet
+  glm::fvec3 pathTrace(const Ray& ray, const RaycastResult& primaryHit, const int primaryInstanceIdx, const Scene& scene, Random& random)
+  {
+    Ray currentRay = ray;
+    glm::fvec3 color(0.f, 0.f, 0.f);
+    glm::fvec3 throughput(1.f, 1.f, 1.f);
+
+    float p = 1.0f;
+
+    for (unsigned int bounce = 0; bounce <= PT_BOUNCES; ++bounce)
+    {
+      int instanceIdx = primaryInstanceIdx;
+      const RaycastResult result = bounce == 0 ? primaryHit : intersect(currentRay, BIGT, false, scene, instanceIdx);
+
+      if (!result)
+        return color;
+
+      Ray shadowRay;
+      float shadowMaxT;
+      glm::fvec3 shadowLight;
+
+      color += shadePath(currentRay, result, instanceIdx, scene, random, throughput, p, shadowRay, shadowMaxT, shadowLight);
+
+      // Only occluders closer than the light are reported
+      int occluderInstanceIdx;
+
+      if (shadowLight != glm::fvec3(0.f) && !intersect(shadowRay, shadowMaxT, true, scene, occluderInstanceIdx))
+        color += shadowLight;
+    }
+
+    return color;
+  }
+
+  // Camera rays of the block of pixels starting at (x, y), lane l is pixel (x + l % PACKET_WIDTH, y + l / PACKET_WIDTH).
+  // Returns the lanes inside the canvas.
+  unsigned int tracePrimaryRays(const int x, const int y, const glm::ivec2& size, const Camera& camera, const Scene& scene, Ray* rays, RaycastResult* results, int* instanceIds)
+  {
+    const float aspectRatio = (float) size.x / size.y;
+
+    RayPacket packet;
+
+    for (int l = 0; l < RAY_PACKET_SIZE; ++l)
+    {
+      const int px = x + l % PACKET_WIDTH;
+      const int py = y + l / PACKET_WIDTH;
+
+      if (px >= size.x || py >= size.y)
+        continue;
+
+      rays[l] = camera.generateRay(camera.normalizedImageCoordinateFromPixelCoordinate(px, py, size), aspectRatio);
+      packet.set(l, rays[l], BIGT);
+    }
+
+    intersect(packet, false, scene, results, instanceIds);
+
+    return packet.active;
+  }
+
+  // Traces queue entries [0, n) in packets of consecutive rays, entries without a pixel are skipped.
+  // results and instanceIds need room for n rounded up to whole packets.
+  void traceQueue(const RayQueue& queue, const std::size_t n, const bool anyHit, const Scene& scene, RaycastResult* results, int* instanceIds)
+  {
+    const int nPackets = (n + RAY_PACKET_SIZE - 1) / RAY_PACKET_SIZE;
+
+#pragma omp parallel for schedule(dynamic, 64)
+    for (int b = 0; b < nPackets; ++b)
+    {
+      RayPacket packet;
+
+      for (int l = 0; l < RAY_PACKET_SIZE; ++l)
+      {
+        const std::size_t i = b * RAY_PACKET_SIZE + l;
+
+        if (i < n && queue.pixel[i] != WAVEFRONT_NO_PIXEL)
+          packet.set(l, queue.get(i), queue.tMax[i]);
+      }
+
+      intersect(packet, anyHit, scene, results + b * RAY_PACKET_SIZE, instanceIds + b * RAY_PACKET_SIZE);
+    }
+  }
+
+  // Direction octant and the grid cell of the origin, rays with the same key start close to each
+  // other and head the same way
+  inline unsigned int binKey(const Ray& ray, const AABB& bbox)
+  {
+    const glm::fvec3 cell = (ray.origin - bbox.min) / (bbox.max - bbox.min) * (float) WAVEFRONT_GRID;
+    const glm::ivec3 c = glm::clamp(glm::ivec3(cell), glm::ivec3(0), glm::ivec3(WAVEFRONT_GRID - 1));
+
+    const unsigned int octant = (ray.direction.x < 0.f) | (ray.direction.y < 0.f) << 1 | (ray.direction.z < 0.f) << 2;
+
+    return (octant * WAVEFRONT_GRID + c.z) * WAVEFRONT_GRID * WAVEFRONT_GRID + c.y * WAVEFRONT_GRID + c.x;
+  }
+
+  // Stable counting sort of the live entries of in by bin, returns the number of rays in out. Every
+  // thread histograms a contiguous chunk and then scatters it to offsets computed from all histograms.
+  std::size_t binRays(const RayQueue& in, const std::size_t n, const AABB& bbox, std::vector<unsigned int>& keys, RayQueue& out)
+  {
+    const unsigned int nBins = 8 * WAVEFRONT_GRID * WAVEFRONT_GRID * WAVEFRONT_GRID;
+
+#ifdef _OPENMP
+    const int nThreads = omp_get_max_threads();
+#else
+    const int nThreads = 1;
+#endif
+
+    // The dead rays go to the extra last bin, which is not scattered
+    std::vector<std::array<std::size_t, nBins + 1>> offsets(nThreads);
+    std::size_t nLive = 0;
+
+    keys.resize(n);
+
+#pragma omp parallel num_threads(nThreads)
+    {
+#ifdef _OPENMP
+      const int t = omp_get_thread_num();
+#else
+      const int t = 0;
+#endif
+      const std::size_t begin = n * t / nThreads;
+      const std::size_t end = n * (t + 1) / nThreads;
+
+      std::array<std::size_t, nBins + 1>& histogram = offsets[t];
+      histogram.fill(0);
+
+      for (std::size_t i = begin; i < end; ++i)
+      {
+        keys[i] = in.pixel[i] == WAVEFRONT_NO_PIXEL ? nBins : binKey(in.get(i), bbox);
+        ++histogram[keys[i]];
+      }
+
+#pragma omp barrier
+#pragma omp single
+      {
+        std::size_t sum = 0;
+
+        for (unsigned int b = 0; b < nBins; ++b)
+        {
+          for (int ti = 0; ti < nThreads; ++ti)
+          {
+            const std::size_t count = offsets[ti][b];
+            offsets[ti][b] = sum;
+            sum += count;
+          }
+        }
+
+        nLive = sum;
+        out.resize(nLive);
+      }
+
+      for (std::size_t i = begin; i < end; ++i)
+      {
+        if (keys[i] != nBins)
+          out.set(histogram[keys[i]]++, in.get(i), in.tMax[i], in.pixel[i]);
+      }
+    }
+
+    return nLive;
+  }
+
+  // Calls shade(x, y) for every block of PACKET_WIDTH x PACKET_HEIGHT pixels. Tiles keep the rays of
+  // a thread coherent, the scheduler balances tiles of different cost.
+  template <typename Shade>
+  void renderTiles(TileScheduler& scheduler, const glm::ivec2& size, const Shade& shade)
+  {
+    scheduler.render(size, [&](const Tile& tile)
+        {
+          for (int y = tile.origin.y; y < std::min(tile.origin.y + tile.size, size.y); y += PACKET_HEIGHT)
+          {
+            for (int x = tile.origin.x; x < std::min(tile.origin.x + tile.size, size.x); x += PACKET_WIDTH)
+              shade(x, y);
+          }
+        });
+  }
+}
+
+ISPCRenderer::ISPCRenderer() : pixels(), accumulation(), lastCamera(), lastSize(), currentPath(1), frame(0), samplesPerSecond(0.f), wavefront(), scheduler()
 {
 }
 
@@ -8,8 +648,298 @@ ISPCRenderer::~ISPCRenderer()
 {
 }
 
-void ISPCRenderer::renderToCanvas(GLTexture& /*canvas*/, const Camera& /*camera*/, Model& /*model*/, Light& /*light*/)
+void RayQueue::resize(const std::size_t n)
+{
+  for (unsigned int a = 0; a < 3; ++a)
+  {
+    origin[a].resize(n);
+    direction[a].resize(n);
+  }
+
+  tMax.resize(n);
+  pixel.resize(n);
+}
+
+void RayQueue::set(const std::size_t i, const Ray& ray, const float maxT, const unsigned int p)
 {
-  
+  for (unsigned int a = 0; a < 3; ++a)
+  {
+    origin[a][i] = ray.origin[a];
+    direction[a][i] = ray.direction[a];
+  }
+
+  tMax[i] = maxT;
+  pixel[i] = p;
 }
 
+Ray RayQueue::get(const std::size_t i) const
+{
+  return Ray(glm::fvec3(origin[0][i], origin[1][i], origin[2][i]), glm::fvec3(direction[0][i], direction[1][i], direction[2][i]));
+}
+
+void ISPCRenderer::reset()
+{
+  currentPath = 1;
+  scheduler.reset();
+}
+
+float ISPCRenderer::getSamplesPerSecond() const
+{
+  return samplesPerSecond;
+}
+
+void ISPCRenderer::rayTraceToCanvas(GLTexture& canvas, const Camera& camera, const Model& model, const Light& light)
+{
+  if (model.getTriangleIndices().empty())
+    return;
+
+  const auto start = std::chrono::high_resolution_clock::now();
+
+  const glm::ivec2 size = canvas.getSize();
+
+  const Scene scene = {
+    model.getWideBVH(),
+    model.getBinaryBVH(),
+    IndexedTriangles(model.getVertices().data(), model.getTriangleIndices().data()),
+    model.getMaterials().data(),
+    model.getTriangleMaterialIds().data(),
+    model.getTwoLevelBVH(),
+    light
+  };
+
+  pixels.resize(size.x * size.y);
+  ++frame;
+
+  renderTiles(scheduler, size, [&](const int x0, const int y0)
+      {
+        Ray rays[RAY_PACKET_SIZE];
+        RaycastResult hits[RAY_PACKET_SIZE];
+        int instanceIds[RAY_PACKET_SIZE];
+
+        for (unsigned int lanes = tracePrimaryRays(x0, y0, size, camera, scene, rays, hits, instanceIds); lanes; lanes &= lanes - 1)
+        {
+          const int l = __builtin_ctz(lanes);
+          const int x = x0 + l % PACKET_WIDTH;
+          const int y = y0 + l / PACKET_WIDTH;
+
+          Random random(x + y * size.x, frame);
+
+          // Mirrored like the CUDA canvas writes
+          pixels[(size.x - 1 - x) + y * size.x] = glm::fvec4(rayTrace(rays[l], hits[l], instanceIds[l], scene, random), 1.f);
+        }
+      });
+
+  const auto stop = std::chrono::high_resolution_clock::now();
+  samplesPerSecond = size.x * size.y / std::chrono::duration<float>(stop - start).count();
+
+  canvas.upload(pixels);
+}
+
+void ISPCRenderer::pathTraceToCanvas(GLTexture& canvas, const Camera& camera, const Model& model, const Light& light, const bool upload)
+{
+  if (model.getTriangleIndices().empty())
+    return;
+
+  const auto start = std::chrono::high_resolution_clock::now();
+
+  const glm::ivec2 size = canvas.getSize();
+
+  startPaths(camera, size);
+
+  const Scene scene = {
+    model.getWideBVH(),
+    model.getBinaryBVH(),
+    IndexedTriangles(model.getVertices().data(), model.getTriangleIndices().data()),
+    model.getMaterials().data(),
+    model.getTriangleMaterialIds().data(),
+    model.getTwoLevelBVH(),
+    light
+  };
+
+  const float weight = 1.f / currentPath;
+
+  renderTiles(scheduler, size, [&](const int x0, const int y0)
+      {
+        Ray rays[RAY_PACKET_SIZE];
+        RaycastResult hits[RAY_PACKET_SIZE];
+        int instanceIds[RAY_PACKET_SIZE];
+
+        for (unsigned int lanes = tracePrimaryRays(x0, y0, size, camera, scene, rays, hits, instanceIds); lanes; lanes &= lanes - 1)
+        {
+          const int l = __builtin_ctz(lanes);
+          const int x = x0 + l % PACKET_WIDTH;
+          const int y = y0 + l / PACKET_WIDTH;
+
+          Random random(x + y * size.x, frame);
+
+          const int i = (size.x - 1 - x) + y * size.x;
+          const glm::fvec3 color = pathTrace(rays[l], hits[l], instanceIds[l], scene, random);
+
+          accumulation[i] = currentPath == 1 ? color : accumulation[i] + color;
+          pixels[i] = glm::fvec4(accumulation[i] * weight, 1.f);
+        }
+      });
+
+  ++currentPath;
+
+  const auto stop = std::chrono::high_resolution_clock::now();
+  samplesPerSecond = size.x * size.y / std::chrono::duration<float>(stop - start).count();
+
+  if (upload)
+    uploadToCanvas(canvas);
+}
+
+void ISPCRenderer::wavefrontPathTraceToCanvas(GLTexture& canvas, const Camera& camera, const Model& model, const Light& light, const bool upload)
+{
+  if (model.getTriangleIndices().empty())
+    return;
+
+  const auto start = std::chrono::high_resolution_clock::now();
+
+  const glm::ivec2 size = canvas.getSize();
+  const float aspectRatio = (float) size.x / size.y;
+
+  startPaths(camera, size);
+
+  const Scene scene = {
+    model.getWideBVH(),
+    model.getBinaryBVH(),
+    IndexedTriangles(model.getVertices().data(), model.getTriangleIndices().data()),
+    model.getMaterials().data(),
+    model.getTriangleMaterialIds().data(),
+    model.getTwoLevelBVH(),
+    light
+  };
+
+  const AABB& bounds = scene.instances.empty() ? model.getBVH()[0].bbox : scene.instances.getTopLevelBVH()[0].bbox;
+  const int nPixels = size.x * size.y;
+
+  wavefront.throughput.assign(nPixels, glm::fvec3(1.f));
+  wavefront.pdf.assign(nPixels, 1.f);
+  wavefront.color.assign(nPixels, glm::fvec3(0.f));
+  wavefront.random.resize(nPixels);
+
+  // Generate: camera rays in blocks of PACKET_WIDTH x PACKET_HEIGHT pixels, so that the first
+  // extend traces the same packets as pathTraceToCanvas
+  const int blocksX = (size.x + PACKET_WIDTH - 1) / PACKET_WIDTH;
+  const int nBlocks = blocksX * ((size.y + PACKET_HEIGHT - 1) / PACKET_HEIGHT);
+
+  std::size_t nRays = nBlocks * RAY_PACKET_SIZE;
+
+  wavefront.rays.resize(nRays);
+
+#pragma omp parallel for
+  for (int b = 0; b < nBlocks; ++b)
+  {
+    for (int l = 0; l < RAY_PACKET_SIZE; ++l)
+    {
+      const int x = (b % blocksX) * PACKET_WIDTH + l % PACKET_WIDTH;
+      const int y = (b / blocksX) * PACKET_HEIGHT + l / PACKET_WIDTH;
+      const std::size_t i = b * RAY_PACKET_SIZE + l;
+
+      if (x >= size.x || y >= size.y)
+      {
+        wavefront.rays.pixel[i] = WAVEFRONT_NO_PIXEL;
+        continue;
+      }
+
+      const int pixel = x + y * size.x;
+
+      wavefront.rays.set(i, camera.generateRay(camera.normalizedImageCoordinateFromPixelCoordinate(x, y, size), aspectRatio), BIGT, pixel);
+      wavefront.random[pixel] = Random(pixel, frame).getState();
+    }
+  }
+
+  for (unsigned int bounce = 0; bounce <= PT_BOUNCES && nRays > 0; ++bounce)
+  {
+    const std::size_t nSlots = (nRays + RAY_PACKET_SIZE - 1) / RAY_PACKET_SIZE * RAY_PACKET_SIZE;
+
+    wavefront.hits.resize(nSlots);
+    wavefront.hitInstanceIds.resize(nSlots);
+    wavefront.nextRays.resize(nRays);
+    wavefront.shadowRays.resize(nRays);
+    wavefront.shadowLight.resize(nRays);
+
+    // Extend
+    traceQueue(wavefront.rays, nRays, false, scene, wavefront.hits.data(), wavefront.hitInstanceIds.data());
+
+    // Shade, every pixel has at most one ray in the queue
+#pragma omp parallel for schedule(dynamic, 256)
+    for (int i = 0; i < (int) nRays; ++i)
+    {
+      const unsigned int pixel = wavefront.rays.pixel[i];
+
+      wavefront.nextRays.pixel[i] = WAVEFRONT_NO_PIXEL;
+      wavefront.shadowRays.pixel[i] = WAVEFRONT_NO_PIXEL;
+
+      if (pixel == WAVEFRONT_NO_PIXEL || !wavefront.hits[i])
+        continue;
+
+      Random random(wavefront.random[pixel]);
+      Ray ray = wavefront.rays.get(i);
+      Ray shadowRay;
+      float shadowMaxT;
+
+      wavefront.color[pixel] += shadePath(ray, wavefront.hits[i], wavefront.hitInstanceIds[i], scene, random, wavefront.throughput[pixel], wavefront.pdf[pixel], shadowRay, shadowMaxT, wavefront.shadowLight[i]);
+      wavefront.random[pixel] = random.getState();
+
+      if (wavefront.shadowLight[i] != glm::fvec3(0.f))
+        wavefront.shadowRays.set(i, shadowRay, shadowMaxT, pixel);
+
+      if (bounce < PT_BOUNCES)
+        wavefront.nextRays.set(i, ray, BIGT, pixel);
+    }
+
+    // Shadow, only occluders closer than the light are reported
+    traceQueue(wavefront.shadowRays, nRays, true, scene, wavefront.hits.data(), wavefront.hitInstanceIds.data());
+
+#pragma omp parallel for
+    for (int i = 0; i < (int) nRays; ++i)
+    {
+      if (wavefront.shadowRays.pixel[i] != WAVEFRONT_NO_PIXEL && !wavefront.hits[i])
+        wavefront.color[wavefront.shadowRays.pixel[i]] += wavefront.shadowLight[i];
+    }
+
+    // Drop the finished paths and bin the rest for the next extend
+    nRays = binRays(wavefront.nextRays, nRays, bounds, wavefront.binKeys, wavefront.rays);
+  }
+
+  const float weight = 1.f / currentPath;
+
+#pragma omp parallel for
+  for (int pixel = 0; pixel < nPixels; ++pixel)
+  {
+    // Mirrored like the CUDA canvas writes
+    const int i = (size.x - 1 - pixel % size.x) + pixel / size.x * size.x;
+
+    accumulation[i] = currentPath == 1 ? wavefront.color[pixel] : accumulation[i] + wavefront.color[pixel];
+    pixels[i] = glm::fvec4(accumulation[i] * weight, 1.f);
+  }
+
+  ++currentPath;
+
+  const auto stop = std::chrono::high_resolution_clock::now();
+  samplesPerSecond = nPixels / std::chrono::duration<float>(stop - start).count();
+
+  if (upload)
+    uploadToCanvas(canvas);
+}
+
+void ISPCRenderer::uploadToCanvas(GLTexture& canvas) const
+{
+  canvas.upload(pixels);
+}
+
+void ISPCRenderer::startPaths(const Camera& camera, const glm::ivec2& size)
+{
+  if (std::memcmp(&camera, &lastCamera, sizeof(Camera)) != 0 || size != lastSize)
+  {
+    lastCamera = camera;
+    lastSize = size;
+    currentPath = 1;
+  }
+
+  pixels.resize(size.x * size.y);
+  accumulation.resize(size.x * size.y);
+  ++frame;
+}
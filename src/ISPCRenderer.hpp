@@ -1,20 +1,87 @@
 #ifndef ISPCRENDERER_HPP
 #define ISPCRENDERER_HPP
 
+#include <vector>
+
 #include "Light.hpp"
 #include "Model.hpp"
 #include "GLTexture.hpp"
 #include "Camera.hpp"
+#include "TileScheduler.hpp"
+
+// Rays are binned by direction octant and a cell of a grid of this size over the scene
+#define WAVEFRONT_GRID 4
+#define WAVEFRONT_NO_PIXEL 0xFFFFFFFF
+
+// Rays of one wavefront stage as structure of arrays. Every ray belongs to the path of one pixel,
+// unused entries have the pixel WAVEFRONT_NO_PIXEL.
+struct RayQueue
+{
+  std::vector<float> origin[3];
+  std::vector<float> direction[3];
+  std::vector<float> tMax;
+  std::vector<unsigned int> pixel;
+
+  void resize(const std::size_t n);
+  void set(const std::size_t i, const Ray& ray, const float maxT, const unsigned int pixel);
+  Ray get(const std::size_t i) const;
+};
+
+// State of the path of every pixel and the queues between the stages of the wavefront path tracer
+struct Wavefront
+{
+  std::vector<glm::fvec3> throughput;
+  std::vector<float> pdf;
+  std::vector<glm::fvec3> color;
+  std::vector<unsigned int> random;
 
+  RayQueue rays;       // Input of the extend stage, binned
+  RayQueue nextRays;   // One slot per extended ray, written by the shade stage
+  RayQueue shadowRays; // Same slots
+  std::vector<glm::fvec3> shadowLight;
+  std::vector<RaycastResult> hits;
+  std::vector<int> hitInstanceIds; // -1 without instancing
+  std::vector<unsigned int> binKeys;
+};
+
+// CPU versions of the CUDA ray and path tracers. Image tiles are spread over all cores by the tile
+// scheduler. Primary and shadow rays are traced as packets, the incoherent secondary rays traverse
+// the wide BVH whose child boxes are tested with SIMD. Instanced models go through the two level BVH.
 class ISPCRenderer
 {
 public:
   ISPCRenderer();
   ~ISPCRenderer();
-  
-  void renderToCanvas(GLTexture& canvas, const Camera& camera, Model& model, Light& light);
 
+  void rayTraceToCanvas(GLTexture& canvas, const Camera& camera, const Model& model, const Light& light);
+
+  // Adds one path per pixel, the accumulation restarts when the camera or the canvas size changes.
+  // Without upload the canvas is only read for its size, uploadToCanvas then shows the paths so far.
+  void pathTraceToCanvas(GLTexture& canvas, const Camera& camera, const Model& model, const Light& light, const bool upload = true);
+
+  // Same paths as pathTraceToCanvas, traced bounce by bounce for all pixels together. The extend,
+  // shade and shadow stages work on queues of all live rays, which are compacted and binned between
+  // the bounces so that neighbouring rays traverse the same nodes.
+  void wavefrontPathTraceToCanvas(GLTexture& canvas, const Camera& camera, const Model& model, const Light& light, const bool upload = true);
+  void uploadToCanvas(GLTexture& canvas) const;
+  void reset(); // Also forgets the tile costs
+
+  float getSamplesPerSecond() const; // Camera rays of the last frame
+
+private:
+  void startPaths(const Camera& camera, const glm::ivec2& size);
+
+  std::vector<glm::fvec4> pixels;
+  std::vector<glm::fvec3> accumulation; // Sum of the paths so far
+
+  Camera lastCamera;
+  glm::ivec2 lastSize;
+  unsigned int currentPath;
+  unsigned int frame; // Seeds the random numbers, so the noise changes between frames like on the GPU
+  float samplesPerSecond;
 
+  Wavefront wavefront;
+  TileScheduler scheduler;
 };
 
 #endif // ISPCRENDERER_HPP
@@ -44,6 +44,9 @@ public:
 
   template<typename curandState>
   CUDA_DEVICE void sample(float& pdf, glm::vec3& point, curandState& randomState1, curandState& randomState2) const;
+
+  // Point on the light for two uniform random numbers, shared by the CUDA and the CPU renderers
+  CUDA_HOST_DEVICE void sample(float& pdf, glm::vec3& point, const float x, const float y) const;
 private:
   glm::mat4 modelMat;
   glm::fvec2 size;
@@ -56,9 +59,11 @@ private:
 template<typename curandState>
 CUDA_DEVICE void Light::sample(float& pdf, glm::vec3& point, curandState& randomState1, curandState& randomState2) const
 {
-  const float x = curand_uniform(&randomState1);
-  const float y = curand_uniform(&randomState2);
+  sample(pdf, point, curand_uniform(&randomState1), curand_uniform(&randomState2));
+}
 
+inline CUDA_HOST_DEVICE void Light::sample(float& pdf, glm::vec3& point, const float x, const float y) const
+{
   const glm::fvec2 span = glm::fvec2(x * 2.f, y * 2.f);
   glm::fvec2 rf(span.x - 1.f, span.y - 1.f);
 
@@ -4,6 +4,8 @@
 #include <memory>
 #include <stack>
 #include <cmath>
+#include <chrono>
+#include <limits>
 
 #include <glm/gtx/string_cast.hpp>
 #include <glm/gtx/component_wise.hpp> 
@@ -15,29 +17,88 @@ glm::fvec3 ai2glm3f(aiColor3D v)
   return glm::fvec3(v[0], v[1], v[2]);
 }
 
-Model::Model()
+Model::Model() : nSourceTriangles(0), builtSAHCost(0.f)
 {
   
 }
 
-Model::Model(const aiScene *scene, const std::string& fileName) : fileName(fileName)
+Model::Model(const aiScene *scene, const std::string& fileName, const BVHBuildParameters& bvhParameters) : fileName(fileName), bvhParameters(bvhParameters)
 {
   initialize(scene);
-  
+
+  // The CPU tracers use the two level BVH instead, the loaded triangles are only drawn
+  if (bvhParameters.instancing)
+    return;
+
+  const std::vector<glm::uvec3> sourceIndices = std::move(triangleIndices);
+  buildBVH(sourceIndices, std::move(triangleMaterialIds));
+}
+
+void Model::buildBVH(const std::vector<glm::uvec3>& sourceIndices, std::vector<unsigned int> sourceMaterialIds)
+{
   BVHBuilder bvhbuilder;
-  bvhbuilder.build(SplitMode::SAH, triangles, triangleMaterialIds, meshDescriptors);
-  
+  bvhbuilder.build(bvhParameters, vertices, sourceIndices, std::move(sourceMaterialIds));
+
+  this->nSourceTriangles = sourceIndices.size();
   this->bvh = bvhbuilder.getBVH();
-  this->triangles = bvhbuilder.getTriangles();
+  this->triangleIndices = bvhbuilder.getTriangleIndices();
   this->triangleMaterialIds = bvhbuilder.getTriangleMaterialIds();
-  this->meshDescriptors = bvhbuilder.getMeshDescriptors();
+  this->triangleSourceIds = bvhbuilder.getTriangleSourceIds();
+  this->builtSAHCost = BVHBuilder::computeSAHCost(this->bvh);
+
+  this->wideBVH.build(this->bvh);
+  this->binaryBVH.build(this->bvh, bvhParameters.nodeLayout);
+}
+
+void Model::refit(const std::vector<Vertex>& newVertices)
+{
+  if (newVertices.size() != vertices.size())
+    throw std::runtime_error("Refit needs the same vertices the model was built from");
+
+  if (bvhParameters.instancing)
+    throw std::runtime_error("Refit is not supported with instancing");
+
+  const auto refitStart = std::chrono::high_resolution_clock::now();
+
+  // The BVH only reorders the indices, the vertices stay where they were loaded
+  vertices = newVertices;
+
+  BVHBuilder::refit(bvh, IndexedTriangles(vertices.data(), triangleIndices.data()));
+
+  const float cost = BVHBuilder::computeSAHCost(bvh);
+
+  const auto refitEnd = std::chrono::high_resolution_clock::now();
+  std::cout << "BVH refit time [ms]: " << std::chrono::duration<float, std::milli>(refitEnd - refitStart).count() << ", SAH cost: " << cost << " (" << builtSAHCost << " when built)" << std::endl;
+
+  if (bvhParameters.refitRebuildRatio > 0.f && cost > bvhParameters.refitRebuildRatio * builtSAHCost)
+  {
+    // Undo the reordering of the last build so the builder sees the loaded order again
+    std::vector<glm::uvec3> sourceIndices(nSourceTriangles);
+    std::vector<unsigned int> sourceMaterialIds(nSourceTriangles);
+
+    for (std::size_t i = 0; i < triangleSourceIds.size(); ++i)
+    {
+      sourceIndices[triangleSourceIds[i]] = triangleIndices[i];
+      sourceMaterialIds[triangleSourceIds[i]] = triangleMaterialIds[i];
+    }
+
+    std::cout << "SAH cost grew past " << bvhParameters.refitRebuildRatio << "x, rebuilding" << std::endl;
+    buildBVH(sourceIndices, std::move(sourceMaterialIds));
+
+    return;
+  }
+
+  // The refit line above is the report of every frame
+  wideBVH.build(bvh, false);
+  binaryBVH.build(bvh, bvhParameters.nodeLayout);
 }
 
 void Model::initialize(const aiScene *scene)
 {
   std::cout << "Creating model with " << scene->mNumMeshes << " meshes" << std::endl;
-  
-  unsigned int triangleOffset = 0;
+
+  // Triangles of every mesh, the start is -1 for skipped meshes
+  std::vector<std::pair<int, int>> meshRanges(scene->mNumMeshes, std::make_pair(-1, 0));
   
   glm::fvec3 maxTri(-999.f,-999.f,-999.f);
   glm::fvec3 minTri(999.f,999.f,999.f);
@@ -46,9 +107,6 @@ void Model::initialize(const aiScene *scene)
   {
     aiMesh *mesh = scene->mMeshes[mi];
 
-    std::vector<Vertex> vertices;
-    std::vector<unsigned int> indices;
-
     if (mesh->mMaterialIndex > 0)
     {
       Material material = Material();
@@ -92,16 +150,18 @@ void Model::initialize(const aiScene *scene)
       }
 
 
-      std::vector<unsigned int> vertexIds(mesh->mNumFaces * 3);
-      std::iota(vertexIds.begin(), vertexIds.end(), triangleOffset * 3);
-
-      MeshDescriptor meshDescr = MeshDescriptor(vertexIds, materials.size());
+      MeshDescriptor meshDescr = MeshDescriptor(std::vector<unsigned int>(), materials.size());
       materials.push_back(material);
       meshDescriptors.push_back(meshDescr);
-      triangleOffset += mesh->mNumFaces;
     }else
       continue;
 
+    meshRanges[mi] = std::make_pair(static_cast<int>(triangleIndices.size()), 0);
+
+    // The vertices of all meshes share one buffer, joined by aiProcess_JoinIdenticalVertices
+    const unsigned int vertexOffset = vertices.size();
+    std::vector<unsigned int>& vertexIds = meshDescriptors.back().vertexIds;
+
     for (std::size_t vi = 0; vi < mesh->mNumVertices; vi++)
     {
       Vertex newVertex;
@@ -124,40 +184,122 @@ void Model::initialize(const aiScene *scene)
       vertices.push_back(newVertex);
     }
 
+    // Lines and points left over by aiProcess_Triangulate are skipped
     for (std::size_t i = 0; i < mesh->mNumFaces; ++i)
     {
       aiFace& face = mesh->mFaces[i];
 
-      if (face.mNumIndices == 3)
-      {
-        Triangle triangle = Triangle(vertices[face.mIndices[0]], vertices[face.mIndices[1]], vertices[face.mIndices[2]]);
+      if (face.mNumIndices != 3)
+        continue;
 
-        triangles.push_back(triangle);
+      const glm::uvec3 triangle(vertexOffset + face.mIndices[0], vertexOffset + face.mIndices[1], vertexOffset + face.mIndices[2]);
 
-        maxTri = glm::max(maxTri, triangle.max());
-        minTri = glm::min(minTri, triangle.min());
+      for (unsigned int v = 0; v < 3; ++v)
+      {
+        maxTri = glm::max(maxTri, vertices[triangle[v]].p);
+        minTri = glm::min(minTri, vertices[triangle[v]].p);
+        vertexIds.push_back(triangle[v]);
       }
 
+      triangleIndices.push_back(triangle);
       triangleMaterialIds.push_back(materials.size() - 1);
     }
+
+    meshRanges[mi].second = triangleIndices.size() - meshRanges[mi].first;
   }
 
   const glm::fvec3 bbDiagonal = maxTri - minTri;
   const float diagonalMaxComponent = glm::compMax(bbDiagonal);
 
-  for (auto& t : triangles)
+  for (auto& v : vertices)
   {
-	  for (auto& v : t.vertices)
-	  {
-		  v.p += minTri;
-		  v.p /= diagonalMaxComponent;
-	  }
+    v.p += minTri;
+    v.p /= diagonalMaxComponent;
   }
+
+  if (bvhParameters.instancing)
+  {
+    glm::fmat4 normalization(1.f / diagonalMaxComponent);
+    normalization[3] = glm::fvec4(minTri / diagonalMaxComponent, 1.f);
+
+    buildTwoLevelBVH(scene, meshRanges, normalization);
+  }
+}
+
+// Every mesh referenced by the scene graph gets one bottom level BVH, built from its part of the
+// normalized triangles. Node transforms are moved into the same normalized space.
+void Model::buildTwoLevelBVH(const aiScene *scene, const std::vector<std::pair<int, int>>& meshRanges, const glm::fmat4& normalization)
+{
+  const auto buildStart = std::chrono::high_resolution_clock::now();
+
+  std::vector<int> meshBVHIds(scene->mNumMeshes, -1);
+  const glm::fmat4 inverseNormalization = glm::inverse(normalization);
+
+  std::stack<std::pair<const aiNode*, glm::fmat4>> stack;
+  stack.push(std::make_pair(scene->mRootNode, glm::fmat4(1.f)));
+
+  while (!stack.empty())
+  {
+    const aiNode* node = stack.top().first;
+    const aiMatrix4x4& m = node->mTransformation;
+
+    // Assimp matrices are row major
+    const glm::fmat4 local(m.a1, m.b1, m.c1, m.d1, m.a2, m.b2, m.c2, m.d2, m.a3, m.b3, m.c3, m.d3, m.a4, m.b4, m.c4, m.d4);
+    const glm::fmat4 transform = stack.top().second * local;
+    stack.pop();
+
+    for (unsigned int i = 0; i < node->mNumMeshes; ++i)
+    {
+      const unsigned int mi = node->mMeshes[i];
+
+      if (meshRanges[mi].first == -1 || meshRanges[mi].second == 0)
+        continue;
+
+      if (meshBVHIds[mi] == -1)
+      {
+        // Every mesh has its own contiguous part of the shared vertices
+        const auto first = triangleIndices.begin() + meshRanges[mi].first;
+        std::vector<glm::uvec3> meshIndices(first, first + meshRanges[mi].second);
+
+        unsigned int minVertex = std::numeric_limits<unsigned int>::max();
+        unsigned int maxVertex = 0;
+
+        for (const auto& t : meshIndices)
+        {
+          minVertex = std::min(minVertex, glm::compMin(t));
+          maxVertex = std::max(maxVertex, glm::compMax(t));
+        }
+
+        for (auto& t : meshIndices)
+          t -= glm::uvec3(minVertex);
+
+        std::vector<Vertex> meshVertices(vertices.begin() + minVertex, vertices.begin() + maxVertex + 1);
+
+        meshBVHIds[mi] = twoLevelBVH.addMesh(std::move(meshVertices), meshIndices, triangleMaterialIds[meshRanges[mi].first], bvhParameters);
+      }
+
+      twoLevelBVH.addInstance(meshBVHIds[mi], normalization * transform * inverseNormalization);
+    }
+
+    for (unsigned int c = 0; c < node->mNumChildren; ++c)
+      stack.push(std::make_pair(node->mChildren[c], transform));
+  }
+
+  twoLevelBVH.buildTopLevel();
+
+  const auto buildEnd = std::chrono::high_resolution_clock::now();
+  std::cout << "Two level BVH build time [ms]: " << std::chrono::duration<float, std::milli>(buildEnd - buildStart).count() << std::endl;
+  twoLevelBVH.printStatistics();
+}
+
+const std::vector<Vertex>& Model::getVertices() const
+{
+  return vertices;
 }
 
-const std::vector<Triangle>& Model::getTriangles() const
+const std::vector<glm::uvec3>& Model::getTriangleIndices() const
 {
-  return triangles;
+  return triangleIndices;
 }
 
 const std::vector<MeshDescriptor>& Model::getMeshDescriptors() const
@@ -195,6 +337,21 @@ const std::vector<Node>& Model::getBVH() const
   return bvh;
 }
 
+const NativeWideBVH& Model::getWideBVH() const
+{
+  return wideBVH;
+}
+
+const BinaryBVH& Model::getBinaryBVH() const
+{
+  return binaryBVH;
+}
+
+const TwoLevelBVH& Model::getTwoLevelBVH() const
+{
+  return twoLevelBVH;
+}
+
 const std::vector<Material>& Model::getBVHBoxMaterials() const
 {
   return bvhBoxMaterials;
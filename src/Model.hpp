@@ -9,13 +9,16 @@
 #include "Utils.hpp"
 #include "Triangle.hpp"
 #include "BVHBuilder.hpp"
+#include "WideBVH.hpp"
+#include "TwoLevelBVH.hpp"
 
 class Model
 {
 public:
   Model();
-  Model(const aiScene *scene, const std::string& fileName);
-  const std::vector<Triangle>& getTriangles() const;
+  Model(const aiScene *scene, const std::string& fileName, const BVHBuildParameters& bvhParameters = BVHBuildParameters());
+  const std::vector<Vertex>& getVertices() const;
+  const std::vector<glm::uvec3>& getTriangleIndices() const; // In BVH order
   const std::vector<Material>& getMaterials() const;
   const std::vector<unsigned int>& getTriangleMaterialIds() const;
   const std::vector<MeshDescriptor>& getMeshDescriptors() const;
@@ -25,12 +28,25 @@ public:
   
   const AABB& getBbox() const;
   const std::vector<Node>& getBVH() const;
+  const NativeWideBVH& getWideBVH() const;
+  const BinaryBVH& getBinaryBVH() const;
+  const TwoLevelBVH& getTwoLevelBVH() const; // Empty unless built with instancing, then the BVHs above are empty
   const std::string& getFileName() const;
+
+  // Moves the vertices and refits the BVH, or rebuilds it once the SAH cost grew past refitRebuildRatio.
+  // The new vertices replace getVertices(), so they are in the same order and the same normalized space.
+  void refit(const std::vector<Vertex>& newVertices);
 private:
+  friend class ModelCache;
+
   void initialize(const aiScene *scene);
+  void buildTwoLevelBVH(const aiScene *scene, const std::vector<std::pair<int, int>>& meshRanges, const glm::fmat4& normalization);
+  void buildBVH(const std::vector<glm::uvec3>& sourceIndices, std::vector<unsigned int> sourceMaterialIds);
 
-  std::vector<Triangle> triangles;
-  std::vector<MeshDescriptor> meshDescriptors; // For GL drawing
+  // Triangles are three indices into the vertices, which are shared by all meshes
+  std::vector<Vertex> vertices;
+  std::vector<glm::uvec3> triangleIndices;
+  std::vector<MeshDescriptor> meshDescriptors; // For GL drawing, these index the vertices directly
 
   std::vector<Material> materials;
   std::vector<unsigned int> triangleMaterialIds;
@@ -41,6 +57,14 @@ private:
 
   AABB boundingBox;
   std::vector<Node> bvh;
+  NativeWideBVH wideBVH; // For CPU traversal
+  BinaryBVH binaryBVH;   // For CPU packet traversal
+  TwoLevelBVH twoLevelBVH;
+
+  BVHBuildParameters bvhParameters;
+  std::vector<unsigned int> triangleSourceIds; // Loaded triangle of every BVH triangle
+  unsigned int nSourceTriangles;
+  float builtSAHCost;
 };
 
 #endif
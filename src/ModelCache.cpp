@@ -0,0 +1,425 @@
+#include "ModelCache.hpp"
+
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <cstdio>
+#include <chrono>
+
+#include <sys/stat.h>
+
+namespace
+{
+  const unsigned long long FNV_OFFSET = 0xcbf29ce484222325ull;
+  const unsigned long long FNV_PRIME = 0x100000001b3ull;
+
+  // FNV-1a over 64 bit words, the bytewise variant is too slow for models of several hundred MB
+  unsigned long long hashBytes(const char* data, const std::size_t size, unsigned long long hash = FNV_OFFSET)
+  {
+    std::size_t i = 0;
+
+    for (; i + 8 <= size; i += 8)
+    {
+      unsigned long long word;
+      std::memcpy(&word, data + i, 8);
+
+      hash = (hash ^ word) * FNV_PRIME;
+      hash ^= hash >> 32;
+    }
+
+    for (; i < size; ++i)
+      hash = (hash ^ static_cast<unsigned char>(data[i])) * FNV_PRIME;
+
+    return hash;
+  }
+
+  template <typename T>
+  unsigned long long hashValue(const T& value, const unsigned long long hash)
+  {
+    return hashBytes(reinterpret_cast<const char*>(&value), sizeof(T), hash);
+  }
+
+  // Hashes the whole file in chunks. Lines starting with one of prefixes are collected on the way,
+  // the unfinished last line of a chunk continues in the next one.
+  bool hashFile(const std::string& path, unsigned long long& hash, const std::vector<std::string>& prefixes, std::vector<std::string>& lines)
+  {
+    std::ifstream in(path, std::ios::binary);
+
+    if (!in.is_open())
+      return false;
+
+    std::vector<char> buffer(MODEL_CACHE_CHUNK_SIZE);
+    std::string line;
+
+    const auto keepLine = [&]()
+    {
+      const std::size_t first = line.find_first_not_of(" \t");
+
+      for (const auto& prefix : prefixes)
+      {
+        if (first != std::string::npos && line.compare(first, prefix.size(), prefix) == 0)
+        {
+          lines.push_back(line.substr(first));
+          break;
+        }
+      }
+
+      line.clear();
+    };
+
+    while (in)
+    {
+      in.read(buffer.data(), buffer.size());
+      const std::size_t size = in.gcount();
+
+      hash = hashBytes(buffer.data(), size, hash);
+
+      const char* p = buffer.data();
+      const char* end = p + size;
+
+      while (p < end)
+      {
+        const char* newline = static_cast<const char*>(std::memchr(p, '\n', end - p));
+        const char* lineEnd = newline ? newline : end;
+
+        // Vertex and face lines are by far the most, they are skipped without a copy
+        if (!line.empty() || (lineEnd > p && *p != 'v' && *p != 'f'))
+          line.append(p, lineEnd);
+
+        if (!newline)
+          break;
+
+        keepLine();
+        p = newline + 1;
+      }
+    }
+
+    keepLine();
+
+    return true;
+  }
+
+  // Words after the statement keyword
+  std::vector<std::string> arguments(const std::string& line)
+  {
+    std::istringstream words(line);
+    std::vector<std::string> result;
+    std::string word;
+
+    words >> word;
+
+    while (words >> word)
+      result.push_back(word);
+
+    return result;
+  }
+
+  std::string directoryOf(const std::string& path)
+  {
+    const std::size_t slash = path.find_last_of('/');
+
+    return slash == std::string::npos ? "" : path.substr(0, slash + 1);
+  }
+
+  // Size and modification time, a missing file hashes differently than any existing one
+  unsigned long long hashFileStatus(const std::string& path, unsigned long long hash)
+  {
+    struct stat st;
+
+    if (stat(path.c_str(), &st) != 0)
+      return hashValue(-1, hash);
+
+    hash = hashValue(static_cast<long long>(st.st_size), hash);
+    hash = hashValue(static_cast<long long>(st.st_mtime), hash);
+
+    return hash;
+  }
+
+  struct CacheHeader
+  {
+    unsigned int magic;
+    unsigned int version;
+    unsigned long long key;
+
+    // Guards against caches written by a build with a different struct layout
+    unsigned int vertexSize;
+    unsigned int nodeSize;
+    unsigned int materialSize;
+
+    unsigned int nSourceTriangles;
+    unsigned long long nVertices;
+    unsigned long long nTriangles;
+    unsigned long long nNodes;
+    unsigned long long nMaterials;
+    unsigned long long nMaterialIds;
+    unsigned long long nSourceIds;
+    unsigned long long nMeshDescriptors;
+    float builtSAHCost;
+  };
+
+  // Reads the arrays straight into their vectors. Counts are checked against the bytes left, so a
+  // corrupt header can't make it allocate more than the file holds.
+  class CacheReader
+  {
+  public:
+    CacheReader(std::ifstream& in, const unsigned long long size) : in(in), remaining(size) {};
+
+    template <typename T>
+    bool read(T& value)
+    {
+      return read(reinterpret_cast<char*>(&value), sizeof(T));
+    }
+
+    template <typename T>
+    bool read(std::vector<T>& values, const unsigned long long n)
+    {
+      if (remaining / sizeof(T) < n)
+        return false;
+
+      values.resize(n);
+
+      return read(reinterpret_cast<char*>(values.data()), n * sizeof(T));
+    }
+
+  private:
+    bool read(char* data, const unsigned long long size)
+    {
+      if (remaining < size)
+        return false;
+
+      in.read(data, size);
+      remaining -= size;
+
+      return in.good();
+    }
+
+    std::ifstream& in;
+    unsigned long long remaining;
+  };
+
+  template <typename T>
+  void write(std::ofstream& out, const std::vector<T>& values)
+  {
+    out.write(reinterpret_cast<const char*>(values.data()), values.size() * sizeof(T));
+  }
+
+  template <typename T>
+  void write(std::ofstream& out, const T& value)
+  {
+    out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+  }
+}
+
+ModelCache::ModelCache(const std::string& modelPath, const BVHBuildParameters& parameters, const std::string& directory)
+  : modelPath(modelPath), cachePath(), parameters(parameters), key(0), valid(false)
+{
+  if (directory.empty())
+  {
+    cachePath = modelPath + MODEL_CACHE_EXTENSION;
+  }
+  else
+  {
+    // Models with the same name in different directories get their own cache file
+    const std::size_t slash = modelPath.find_last_of('/');
+    const std::string baseName = slash == std::string::npos ? modelPath : modelPath.substr(slash + 1);
+
+    std::ostringstream path;
+    path << directory << "/" << baseName << "-" << std::hex << std::setw(16) << std::setfill('0') << hashBytes(modelPath.data(), modelPath.size()) << MODEL_CACHE_EXTENSION;
+    cachePath = path.str();
+  }
+
+  // The materials and textures assimp reads for the model are part of the key. The .mtl files are
+  // small and hashed in full, the textures by their size and modification time.
+  std::vector<std::string> materialLibraries;
+
+  key = FNV_OFFSET;
+
+  if (!hashFile(modelPath, key, { "mtllib" }, materialLibraries))
+    return;
+
+  for (const auto& statement : materialLibraries)
+  {
+    for (const auto& library : arguments(statement))
+    {
+      const std::string libraryPath = directoryOf(modelPath) + library;
+      std::vector<std::string> textureMaps;
+
+      if (!hashFile(libraryPath, key, { "map_", "bump", "disp", "decal", "refl", "norm" }, textureMaps))
+      {
+        key = hashValue(-1, key);
+        continue;
+      }
+
+      // The file name is the last word, the options come before it
+      for (const auto& map : textureMaps)
+      {
+        const std::vector<std::string> words = arguments(map);
+
+        if (!words.empty())
+          key = hashFileStatus(directoryOf(libraryPath) + words.back(), key);
+      }
+    }
+  }
+
+  key = hashValue(static_cast<int>(parameters.splitMode), key);
+  key = hashValue(parameters.spatialSplitBudget, key);
+  key = hashValue(parameters.treeletPasses, key);
+  key = hashValue(parameters.earlySplitThreshold, key);
+  key = hashValue(parameters.traversalCost, key);
+  key = hashValue(parameters.intersectionCost, key);
+  key = hashValue(parameters.minLeafSize, key);
+  key = hashValue(parameters.maxLeafSize, key);
+  valid = true;
+}
+
+ModelCache::~ModelCache()
+{
+
+}
+
+const std::string& ModelCache::getCachePath() const
+{
+  return cachePath;
+}
+
+bool ModelCache::load(Model& model) const
+{
+  if (!valid)
+    return false;
+
+  const auto loadStart = std::chrono::high_resolution_clock::now();
+
+  std::ifstream file(cachePath, std::ios::binary | std::ios::ate);
+
+  if (!file.is_open())
+    return false;
+
+  const unsigned long long size = file.tellg();
+  file.seekg(0);
+
+  CacheReader reader(file, size);
+  CacheHeader header;
+
+  if (!reader.read(header)
+      || header.magic != MODEL_CACHE_MAGIC
+      || header.version != MODEL_CACHE_VERSION
+      || header.key != key
+      || header.vertexSize != sizeof(Vertex)
+      || header.nodeSize != sizeof(Node)
+      || header.materialSize != sizeof(Material))
+  {
+    std::cout << "BVH cache " << cachePath << " is stale, rebuilding" << std::endl;
+    return false;
+  }
+
+  Model cached;
+
+  bool ok = reader.read(cached.vertices, header.nVertices)
+      && reader.read(cached.triangleIndices, header.nTriangles)
+      && reader.read(cached.bvh, header.nNodes)
+      && reader.read(cached.materials, header.nMaterials)
+      && reader.read(cached.triangleMaterialIds, header.nMaterialIds)
+      && reader.read(cached.triangleSourceIds, header.nSourceIds);
+
+  cached.meshDescriptors.resize(ok ? header.nMeshDescriptors : 0);
+
+  for (auto& d : cached.meshDescriptors)
+  {
+    unsigned long long nVertexIds = 0;
+
+    ok = ok && reader.read(d.materialIdx) && reader.read(nVertexIds) && reader.read(d.vertexIds, nVertexIds);
+  }
+
+  if (!ok)
+  {
+    std::cout << "BVH cache " << cachePath << " is truncated, rebuilding" << std::endl;
+    return false;
+  }
+
+  cached.fileName = modelPath;
+  cached.bvhParameters = parameters;
+  cached.nSourceTriangles = header.nSourceTriangles;
+  cached.builtSAHCost = header.builtSAHCost;
+  cached.wideBVH.build(cached.bvh);
+  cached.binaryBVH.build(cached.bvh, parameters.nodeLayout);
+
+  model = std::move(cached);
+
+  const auto loadEnd = std::chrono::high_resolution_clock::now();
+  std::cout << "Loaded BVH cache " << cachePath << " in " << std::chrono::duration<float, std::milli>(loadEnd - loadStart).count() << " ms" << std::endl;
+
+  return true;
+}
+
+bool ModelCache::store(const Model& model) const
+{
+  if (!valid)
+    return false;
+
+  CacheHeader header;
+  std::memset(&header, 0, sizeof(header));
+
+  header.magic = MODEL_CACHE_MAGIC;
+  header.version = MODEL_CACHE_VERSION;
+  header.key = key;
+  header.vertexSize = sizeof(Vertex);
+  header.nodeSize = sizeof(Node);
+  header.materialSize = sizeof(Material);
+  header.nSourceTriangles = model.nSourceTriangles;
+  header.nVertices = model.vertices.size();
+  header.nTriangles = model.triangleIndices.size();
+  header.nNodes = model.bvh.size();
+  header.nMaterials = model.materials.size();
+  header.nMaterialIds = model.triangleMaterialIds.size();
+  header.nSourceIds = model.triangleSourceIds.size();
+  header.nMeshDescriptors = model.meshDescriptors.size();
+  header.builtSAHCost = model.builtSAHCost;
+
+  // Written next to the final file and renamed, so a concurrent load never sees half a cache
+  const std::string tmpPath = cachePath + ".tmp";
+
+  {
+    std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+
+    if (!out.is_open())
+    {
+      std::cerr << "Couldn't write BVH cache " << cachePath << std::endl;
+      return false;
+    }
+
+    write(out, header);
+    write(out, model.vertices);
+    write(out, model.triangleIndices);
+    write(out, model.bvh);
+    write(out, model.materials);
+    write(out, model.triangleMaterialIds);
+    write(out, model.triangleSourceIds);
+
+    for (const auto& d : model.meshDescriptors)
+    {
+      write(out, d.materialIdx);
+      write(out, static_cast<unsigned long long>(d.vertexIds.size()));
+      write(out, d.vertexIds);
+    }
+
+    if (!out.good())
+    {
+      out.close();
+      std::remove(tmpPath.c_str());
+      std::cerr << "Couldn't write BVH cache " << cachePath << std::endl;
+      return false;
+    }
+  }
+
+  if (std::rename(tmpPath.c_str(), cachePath.c_str()) != 0)
+  {
+    std::remove(tmpPath.c_str());
+    std::cerr << "Couldn't write BVH cache " << cachePath << std::endl;
+    return false;
+  }
+
+  std::cout << "Wrote BVH cache " << cachePath << std::endl;
+
+  return true;
+}
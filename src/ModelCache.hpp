@@ -0,0 +1,35 @@
+#ifndef MODELCACHE_HPP
+#define MODELCACHE_HPP
+
+#include <string>
+
+#include "Model.hpp"
+#include "BVHBuilder.hpp"
+
+#define MODEL_CACHE_MAGIC 0x48564243u // "CBVH"
+#define MODEL_CACHE_VERSION 2u
+#define MODEL_CACHE_EXTENSION ".bvhcache"
+#define MODEL_CACHE_CHUNK_SIZE (1 << 20) // Bytes hashed at once, a multiple of the 8 byte hash words
+
+// Binary snapshot of a loaded model and its BVH. The cache is keyed by a hash of the model file, its
+// materials and textures and the build parameters, a stale or foreign cache file is simply rebuilt.
+class ModelCache
+{
+public:
+  ModelCache(const std::string& modelPath, const BVHBuildParameters& parameters, const std::string& directory = "");
+  ~ModelCache();
+
+  bool load(Model& model) const;
+  bool store(const Model& model) const;
+
+  const std::string& getCachePath() const;
+
+private:
+  std::string modelPath;
+  std::string cachePath;
+  BVHBuildParameters parameters;
+  unsigned long long key;
+  bool valid;
+};
+
+#endif // MODELCACHE_HPP
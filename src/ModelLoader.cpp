@@ -1,6 +1,43 @@
 #include "ModelLoader.hpp"
+#include "ModelCache.hpp"
 
-ModelLoader::ModelLoader()
+#include "assimp/ProgressHandler.hpp"
+
+namespace
+{
+  // Assimp aborts the import once Update() returns false
+  class ImportProgressHandler : public Assimp::ProgressHandler
+  {
+  public:
+    ImportProgressHandler(LoadProgress& progress) : progress(progress) {};
+
+    bool Update(float percentage) override
+    {
+      progress.fraction = percentage;
+
+      return !progress.cancelled;
+    }
+
+  private:
+    LoadProgress& progress;
+  };
+
+  void setStage(LoadProgress* progress, const LoadStage stage, const float fraction)
+  {
+    if (!progress)
+      return;
+
+    progress->stage = stage;
+    progress->fraction = fraction;
+  }
+
+  bool isCancelled(const LoadProgress* progress)
+  {
+    return progress && progress->cancelled;
+  }
+}
+
+ModelLoader::ModelLoader() : bvhParameters(), cacheEnabled(true), cacheDirectory()
 {
 
 }
@@ -9,22 +46,81 @@ ModelLoader::~ModelLoader()
 {
 }
 
-Model ModelLoader::loadOBJ(const std::string& path)
+Model ModelLoader::loadOBJ(const std::string& path, LoadProgress* progress)
+{
+  // The cache only holds the flattened model and BVH
+  if (!cacheEnabled || bvhParameters.instancing)
+    return importOBJ(path, progress);
+
+  setStage(progress, LOAD_CACHE, -1.f);
+
+  const ModelCache cache(path, bvhParameters, cacheDirectory);
+
+  Model model;
+
+  if (cache.load(model))
+    return isCancelled(progress) ? Model() : model;
+
+  model = importOBJ(path, progress);
+
+  if (!model.getTriangleIndices().empty())
+    cache.store(model);
+
+  return model;
+}
+
+Model ModelLoader::importOBJ(const std::string& path, LoadProgress* progress)
 {
+  if (isCancelled(progress))
+    return Model();
+
+  setStage(progress, LOAD_IMPORT, 0.f);
+
+  // The importer owns the handler, passing nullptr restores its default one
+  if (progress)
+    importer.SetProgressHandler(new ImportProgressHandler(*progress));
+
   const aiScene* model = importer.ReadFile( path,
         aiProcess_CalcTangentSpace       |
         aiProcess_JoinIdenticalVertices  |
         aiProcess_Triangulate            |
         aiProcess_GenNormals);
 
+  if (progress)
+    importer.SetProgressHandler(nullptr);
+
+  if (isCancelled(progress))
+  {
+    std::cout << "Cancelled loading " << path << std::endl;
+    return Model();
+  }
+
   if (!model)
   {
     std::cerr << "Error loading file: " << importer.GetErrorString() << std::endl;
     return Model();
   }
 
-  auto sc = Model(model, path);
+  setStage(progress, LOAD_BUILD, -1.f);
+
+  auto sc = Model(model, path, bvhParameters);
+
+  if (isCancelled(progress))
+  {
+    std::cout << "Cancelled loading " << path << std::endl;
+    return Model();
+  }
 
   return sc;
 }
 
+void ModelLoader::setBVHBuildParameters(const BVHBuildParameters& parameters)
+{
+  this->bvhParameters = parameters;
+}
+
+void ModelLoader::setCache(const bool enabled, const std::string& directory)
+{
+  this->cacheEnabled = enabled;
+  this->cacheDirectory = directory;
+}
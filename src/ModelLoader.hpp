@@ -5,18 +5,46 @@
 #include "assimp/postprocess.h"
 #include "assimp/scene.h"
 
+#include <atomic>
+
 #include "Model.hpp"
 
+enum LoadStage
+{
+  LOAD_CACHE,
+  LOAD_IMPORT,
+  LOAD_BUILD
+};
+
+// Shared with a load running on another thread. Cancelling is honoured while assimp imports and
+// between the stages, a BVH build that has started runs to the end and its result is dropped.
+struct LoadProgress
+{
+  std::atomic<int> stage;
+  std::atomic<float> fraction; // Of the current stage, negative if unknown
+  std::atomic<bool> cancelled;
+
+  LoadProgress() : stage(LOAD_CACHE), fraction(0.f), cancelled(false) {};
+};
+
 class ModelLoader
 {
 public:
   ModelLoader();
   ~ModelLoader();
   
-  Model loadOBJ(const std::string& path);
+  // An empty model is returned if the load fails or is cancelled
+  Model loadOBJ(const std::string& path, LoadProgress* progress = nullptr);
+  void setBVHBuildParameters(const BVHBuildParameters& parameters);
+  void setCache(const bool enabled, const std::string& directory = ""); // Next to the model if no directory is given
   
 private:
+  Model importOBJ(const std::string& path, LoadProgress* progress);
+
   Assimp::Importer importer;
+  BVHBuildParameters bvhParameters;
+  bool cacheEnabled;
+  std::string cacheDirectory;
 };
 
 #endif // SCENELOADER_HPP
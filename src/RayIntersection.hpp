@@ -0,0 +1,137 @@
+#ifndef RAYINTERSECTION_HPP
+#define RAYINTERSECTION_HPP
+
+#include <cmath>
+#include <algorithm>
+#include <array>
+#include <vector>
+
+#include "Utils.hpp"
+#include "Triangle.hpp"
+
+// Host versions of the intersection routines in CudaRenderer.cu, shared by the CPU traversals
+
+#define INTERSECT_EPSILON 0.0000001f
+
+// Möller-Trumbore, same as the CUDA version
+inline bool rayTriangleIntersection(const Ray& ray, const glm::fvec3& vertex0, const glm::fvec3& vertex1, const glm::fvec3& vertex2, float& t, glm::fvec2& uv)
+{
+  const glm::fvec3 edge1 = vertex1 - vertex0;
+  const glm::fvec3 edge2 = vertex2 - vertex0;
+
+  const glm::fvec3 h = glm::cross(ray.direction, edge2);
+  const float a = glm::dot(edge1, h);
+
+  if (a > -INTERSECT_EPSILON && a < INTERSECT_EPSILON)
+    return false;
+
+  const float f = 1.f / a;
+  const glm::fvec3 s = ray.origin - vertex0;
+  const float u = f * glm::dot(s, h);
+
+  if (u < 0.f || u > 1.0f)
+    return false;
+
+  const glm::fvec3 q = glm::cross(s, edge1);
+  const float v = f * glm::dot(ray.direction, q);
+
+  if (v < 0.0f || u + v > 1.0f)
+    return false;
+
+  t = f * glm::dot(edge2, q);
+
+  if (t > INTERSECT_EPSILON)
+  {
+    uv = glm::fvec2(u, v);
+    return true;
+  }
+  else
+    return false;
+}
+
+inline bool rayTriangleIntersection(const Ray& ray, const Triangle& triangle, float& t, glm::fvec2& uv)
+{
+  return rayTriangleIntersection(ray, triangle.vertices[0].p, triangle.vertices[1].p, triangle.vertices[2].p, t, uv);
+}
+
+// Only the positions are fetched, the rest of the vertices stays out of the cache
+inline bool rayTriangleIntersection(const Ray& ray, const IndexedTriangles& triangles, const unsigned int triIdx, float& t, glm::fvec2& uv)
+{
+  return rayTriangleIntersection(ray, triangles.position(triIdx, 0), triangles.position(triIdx, 1), triangles.position(triIdx, 2), t, uv);
+}
+
+inline glm::fvec3 safeInverse(const glm::fvec3& direction)
+{
+  glm::fvec3 inverse;
+
+  // Keeps the slab distances finite, 0 * inf would turn into NaN in the quantized test
+  for (unsigned int a = 0; a < 3; ++a)
+    inverse[a] = 1.f / (std::abs(direction[a]) > 1e-12f ? direction[a] : std::copysign(1e-12f, direction[a]));
+
+  return inverse;
+}
+
+// Slab test, tNear is the entry distance clamped to the ray origin
+inline bool intersectBox(const AABB& box, const glm::fvec3& origin, const glm::fvec3& inverseDirection, const float tMax, float& tNear)
+{
+  const glm::fvec3 t0 = (box.min - origin) * inverseDirection;
+  const glm::fvec3 t1 = (box.max - origin) * inverseDirection;
+  const glm::fvec3 tSmall = glm::min(t0, t1);
+  const glm::fvec3 tBig = glm::max(t0, t1);
+
+  tNear = std::max(std::max(tSmall.x, tSmall.y), std::max(tSmall.z, 0.f));
+  const float tFar = std::min(std::min(tBig.x, tBig.y), tBig.z);
+
+  return tNear <= tFar && tNear < tMax;
+}
+
+// Node stack of the traversals. Usual depths fit the fixed part, deeper trees continue on the heap
+// instead of dropping nodes.
+template <typename T, int N>
+class TraversalStack
+{
+public:
+  TraversalStack() : size(0) {};
+
+  void push(const T& value)
+  {
+    if (size < N)
+      local[size] = value;
+    else
+      overflow.push_back(value);
+
+    ++size;
+  }
+
+  T pop()
+  {
+    --size;
+
+    if (size < N)
+      return local[size];
+
+    const T value = overflow.back();
+    overflow.pop_back();
+
+    return value;
+  }
+
+  bool empty() const
+  {
+    return size == 0;
+  }
+
+private:
+  std::array<T, N> local;
+  std::vector<T> overflow;
+  int size;
+};
+
+// A node and the distance at which the ray enters it
+struct TraversalEntry
+{
+  int nodeIdx;
+  float t;
+};
+
+#endif // RAYINTERSECTION_HPP
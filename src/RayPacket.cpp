@@ -0,0 +1,384 @@
+#include "RayPacket.hpp"
+#include "RayIntersection.hpp"
+
+#include <limits>
+
+#ifdef __AVX2__
+  #include <immintrin.h>
+#endif
+
+namespace
+{
+  // Bounds of the packet's origins and inverse directions. With one direction sign per axis all rays
+  // enter and leave a box through the same slabs, so interval arithmetic bounds their distances.
+  struct Frustum
+  {
+    bool coherent;
+    glm::fvec3 originMin;
+    glm::fvec3 originMax;
+    glm::fvec3 inverseMin;
+    glm::fvec3 inverseMax;
+    float tMax;
+  };
+
+  Frustum computeFrustum(const RayPacket& packet)
+  {
+    Frustum frustum;
+    frustum.coherent = true;
+    frustum.originMin = glm::fvec3(std::numeric_limits<float>::max());
+    frustum.originMax = glm::fvec3(-std::numeric_limits<float>::max());
+    frustum.inverseMin = glm::fvec3(std::numeric_limits<float>::max());
+    frustum.inverseMax = glm::fvec3(-std::numeric_limits<float>::max());
+    frustum.tMax = 0.f;
+
+    for (int l = 0; l < RAY_PACKET_SIZE; ++l)
+    {
+      if (!(packet.active & (1u << l)))
+        continue;
+
+      for (unsigned int a = 0; a < 3; ++a)
+      {
+        frustum.originMin[a] = std::min(frustum.originMin[a], packet.origin[a][l]);
+        frustum.originMax[a] = std::max(frustum.originMax[a], packet.origin[a][l]);
+        frustum.inverseMin[a] = std::min(frustum.inverseMin[a], packet.inverseDirection[a][l]);
+        frustum.inverseMax[a] = std::max(frustum.inverseMax[a], packet.inverseDirection[a][l]);
+      }
+
+      frustum.tMax = std::max(frustum.tMax, packet.tMax[l]);
+    }
+
+    for (unsigned int a = 0; a < 3; ++a)
+      frustum.coherent = frustum.coherent && (frustum.inverseMin[a] > 0.f || frustum.inverseMax[a] < 0.f);
+
+    return frustum;
+  }
+
+  // Smallest and largest product of two intervals
+  inline float intervalMin(const float aMin, const float aMax, const float bMin, const float bMax)
+  {
+    return std::min(std::min(aMin * bMin, aMin * bMax), std::min(aMax * bMin, aMax * bMax));
+  }
+
+  inline float intervalMax(const float aMin, const float aMax, const float bMin, const float bMax)
+  {
+    return std::max(std::max(aMin * bMin, aMin * bMax), std::max(aMax * bMin, aMax * bMax));
+  }
+
+  // True if no ray of the packet can hit the box. Every ray enters after the lower bound of the
+  // entry distances and leaves before the upper bound of the exit distances.
+  inline bool frustumMisses(const Frustum& frustum, const AABB& box)
+  {
+    if (!frustum.coherent)
+      return false;
+
+    float tEnter = 0.f;
+    float tExit = frustum.tMax;
+
+    for (unsigned int a = 0; a < 3; ++a)
+    {
+      const bool positive = frustum.inverseMin[a] > 0.f;
+      const float enter = positive ? box.min[a] : box.max[a];
+      const float exit = positive ? box.max[a] : box.min[a];
+
+      tEnter = std::max(tEnter, intervalMin(enter - frustum.originMax[a], enter - frustum.originMin[a], frustum.inverseMin[a], frustum.inverseMax[a]));
+      tExit = std::min(tExit, intervalMax(exit - frustum.originMax[a], exit - frustum.originMin[a], frustum.inverseMin[a], frustum.inverseMax[a]));
+    }
+
+    return tEnter > tExit;
+  }
+
+  struct PacketHits
+  {
+    float t[RAY_PACKET_SIZE];
+    float u[RAY_PACKET_SIZE];
+    float v[RAY_PACKET_SIZE];
+    int triangleIdx[RAY_PACKET_SIZE];
+  };
+
+#ifdef __AVX2__
+  // Same arithmetic as intersectBox for eight rays, returns the lanes of mask that hit the box closer than their best hit
+  inline unsigned int intersectBox(const AABB& box, const RayPacket& packet, const PacketHits& hits, const unsigned int mask)
+  {
+    __m256 tNear = _mm256_setzero_ps();
+    __m256 tFar = _mm256_set1_ps(std::numeric_limits<float>::max());
+
+    for (unsigned int a = 0; a < 3; ++a)
+    {
+      const __m256 o = _mm256_load_ps(packet.origin[a]);
+      const __m256 id = _mm256_load_ps(packet.inverseDirection[a]);
+
+      const __m256 t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(box.min[a]), o), id);
+      const __m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(box.max[a]), o), id);
+
+      tNear = _mm256_max_ps(tNear, _mm256_min_ps(t0, t1));
+      tFar = _mm256_min_ps(tFar, _mm256_max_ps(t0, t1));
+    }
+
+    const __m256 hit = _mm256_and_ps(_mm256_cmp_ps(tNear, tFar, _CMP_LE_OQ), _mm256_cmp_ps(tNear, _mm256_loadu_ps(hits.t), _CMP_LT_OQ));
+
+    return _mm256_movemask_ps(hit) & mask;
+  }
+
+  inline __m256 dot(const __m256 ax, const __m256 ay, const __m256 az, const __m256 bx, const __m256 by, const __m256 bz)
+  {
+    return _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ax, bx), _mm256_mul_ps(ay, by)), _mm256_mul_ps(az, bz));
+  }
+
+  inline __m256 crossComponent(const __m256 a1, const __m256 a2, const __m256 b1, const __m256 b2)
+  {
+    return _mm256_sub_ps(_mm256_mul_ps(a1, b2), _mm256_mul_ps(b1, a2));
+  }
+
+  // Möller-Trumbore for eight rays against one triangle, in the operation order of rayTriangleIntersection
+  inline unsigned int intersectTriangle(const IndexedTriangles& triangles, const int triIdx, const RayPacket& packet, PacketHits& hits, const unsigned int mask)
+  {
+    const glm::fvec3 vertex0 = triangles.position(triIdx, 0);
+    const glm::fvec3 edge1 = triangles.position(triIdx, 1) - vertex0;
+    const glm::fvec3 edge2 = triangles.position(triIdx, 2) - vertex0;
+
+    const __m256 e1x = _mm256_set1_ps(edge1.x), e1y = _mm256_set1_ps(edge1.y), e1z = _mm256_set1_ps(edge1.z);
+    const __m256 e2x = _mm256_set1_ps(edge2.x), e2y = _mm256_set1_ps(edge2.y), e2z = _mm256_set1_ps(edge2.z);
+
+    const __m256 dx = _mm256_load_ps(packet.direction[0]);
+    const __m256 dy = _mm256_load_ps(packet.direction[1]);
+    const __m256 dz = _mm256_load_ps(packet.direction[2]);
+
+    const __m256 hx = crossComponent(dy, dz, e2y, e2z);
+    const __m256 hy = crossComponent(dz, dx, e2z, e2x);
+    const __m256 hz = crossComponent(dx, dy, e2x, e2y);
+
+    const __m256 a = dot(e1x, e1y, e1z, hx, hy, hz);
+    const __m256 f = _mm256_div_ps(_mm256_set1_ps(1.f), a);
+
+    const __m256 sx = _mm256_sub_ps(_mm256_load_ps(packet.origin[0]), _mm256_set1_ps(vertex0.x));
+    const __m256 sy = _mm256_sub_ps(_mm256_load_ps(packet.origin[1]), _mm256_set1_ps(vertex0.y));
+    const __m256 sz = _mm256_sub_ps(_mm256_load_ps(packet.origin[2]), _mm256_set1_ps(vertex0.z));
+
+    const __m256 u = _mm256_mul_ps(f, dot(sx, sy, sz, hx, hy, hz));
+
+    const __m256 qx = crossComponent(sy, sz, e1y, e1z);
+    const __m256 qy = crossComponent(sz, sx, e1z, e1x);
+    const __m256 qz = crossComponent(sx, sy, e1x, e1y);
+
+    const __m256 v = _mm256_mul_ps(f, dot(dx, dy, dz, qx, qy, qz));
+    const __m256 t = _mm256_mul_ps(f, dot(e2x, e2y, e2z, qx, qy, qz));
+
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 one = _mm256_set1_ps(1.f);
+    const __m256 epsilon = _mm256_set1_ps(INTERSECT_EPSILON);
+
+    __m256 hit = _mm256_or_ps(_mm256_cmp_ps(a, _mm256_set1_ps(-INTERSECT_EPSILON), _CMP_LE_OQ), _mm256_cmp_ps(a, epsilon, _CMP_GE_OQ));
+    hit = _mm256_and_ps(hit, _mm256_cmp_ps(u, zero, _CMP_GE_OQ));
+    hit = _mm256_and_ps(hit, _mm256_cmp_ps(u, one, _CMP_LE_OQ));
+    hit = _mm256_and_ps(hit, _mm256_cmp_ps(v, zero, _CMP_GE_OQ));
+    hit = _mm256_and_ps(hit, _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_LE_OQ));
+    hit = _mm256_and_ps(hit, _mm256_cmp_ps(t, epsilon, _CMP_GT_OQ));
+    hit = _mm256_and_ps(hit, _mm256_cmp_ps(t, _mm256_loadu_ps(hits.t), _CMP_LT_OQ));
+
+    const unsigned int hitMask = _mm256_movemask_ps(hit) & mask;
+
+    if (!hitMask)
+      return 0;
+
+    hit = _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_and_si256(_mm256_set1_epi32(hitMask), _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128)), _mm256_setzero_si256()));
+
+    _mm256_storeu_ps(hits.t, _mm256_blendv_ps(_mm256_loadu_ps(hits.t), t, hit));
+    _mm256_storeu_ps(hits.u, _mm256_blendv_ps(_mm256_loadu_ps(hits.u), u, hit));
+    _mm256_storeu_ps(hits.v, _mm256_blendv_ps(_mm256_loadu_ps(hits.v), v, hit));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(hits.triangleIdx), _mm256_blendv_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(hits.triangleIdx)), _mm256_set1_epi32(triIdx), _mm256_castps_si256(hit)));
+
+    return hitMask;
+  }
+#else
+  // Branch free loops over the lanes, which the compiler turns into SSE code
+  inline unsigned int intersectBox(const AABB& box, const RayPacket& packet, const PacketHits& hits, const unsigned int mask)
+  {
+    float tNear[RAY_PACKET_SIZE];
+    float tFar[RAY_PACKET_SIZE];
+
+    for (int l = 0; l < RAY_PACKET_SIZE; ++l)
+    {
+      tNear[l] = 0.f;
+      tFar[l] = std::numeric_limits<float>::max();
+    }
+
+    for (unsigned int a = 0; a < 3; ++a)
+    {
+      for (int l = 0; l < RAY_PACKET_SIZE; ++l)
+      {
+        const float t0 = (box.min[a] - packet.origin[a][l]) * packet.inverseDirection[a][l];
+        const float t1 = (box.max[a] - packet.origin[a][l]) * packet.inverseDirection[a][l];
+
+        tNear[l] = std::max(tNear[l], std::min(t0, t1));
+        tFar[l] = std::min(tFar[l], std::max(t0, t1));
+      }
+    }
+
+    unsigned int hitMask = 0;
+
+    for (int l = 0; l < RAY_PACKET_SIZE; ++l)
+      hitMask |= (unsigned int) (tNear[l] <= tFar[l] && tNear[l] < hits.t[l]) << l;
+
+    return hitMask & mask;
+  }
+
+  inline unsigned int intersectTriangle(const IndexedTriangles& triangles, const int triIdx, const RayPacket& packet, PacketHits& hits, const unsigned int mask)
+  {
+    const glm::fvec3 vertex0 = triangles.position(triIdx, 0);
+    const glm::fvec3 edge1 = triangles.position(triIdx, 1) - vertex0;
+    const glm::fvec3 edge2 = triangles.position(triIdx, 2) - vertex0;
+
+    float tHit[RAY_PACKET_SIZE];
+    float uHit[RAY_PACKET_SIZE];
+    float vHit[RAY_PACKET_SIZE];
+    unsigned int hitMask = 0;
+
+    for (int l = 0; l < RAY_PACKET_SIZE; ++l)
+    {
+      const glm::fvec3 direction(packet.direction[0][l], packet.direction[1][l], packet.direction[2][l]);
+      const glm::fvec3 s = glm::fvec3(packet.origin[0][l], packet.origin[1][l], packet.origin[2][l]) - vertex0;
+
+      const glm::fvec3 h = glm::cross(direction, edge2);
+      const float a = glm::dot(edge1, h);
+      const float f = 1.f / a;
+      const glm::fvec3 q = glm::cross(s, edge1);
+
+      uHit[l] = f * glm::dot(s, h);
+      vHit[l] = f * glm::dot(direction, q);
+      tHit[l] = f * glm::dot(edge2, q);
+
+      const bool hit = (a <= -INTERSECT_EPSILON || a >= INTERSECT_EPSILON)
+          && uHit[l] >= 0.f && uHit[l] <= 1.f && vHit[l] >= 0.f && uHit[l] + vHit[l] <= 1.f
+          && tHit[l] > INTERSECT_EPSILON && tHit[l] < hits.t[l];
+
+      hitMask |= (unsigned int) hit << l;
+    }
+
+    hitMask &= mask;
+
+    for (unsigned int m = hitMask; m; m &= m - 1)
+    {
+      const int l = __builtin_ctz(m);
+
+      hits.t[l] = tHit[l];
+      hits.u[l] = uHit[l];
+      hits.v[l] = vHit[l];
+      hits.triangleIdx[l] = triIdx;
+    }
+
+    return hitMask;
+  }
+#endif
+}
+
+RayPacket::RayPacket() : active(0)
+{
+  // Unused lanes get a valid ray so that the SIMD tests never see garbage
+  for (unsigned int a = 0; a < 3; ++a)
+  {
+    for (int l = 0; l < RAY_PACKET_SIZE; ++l)
+    {
+      origin[a][l] = 0.f;
+      direction[a][l] = 1.f;
+      inverseDirection[a][l] = 1.f;
+    }
+  }
+
+  for (int l = 0; l < RAY_PACKET_SIZE; ++l)
+    tMax[l] = 0.f;
+}
+
+void RayPacket::set(const int lane, const Ray& ray, const float maxT)
+{
+  const glm::fvec3 inverse = safeInverse(ray.direction);
+
+  for (unsigned int a = 0; a < 3; ++a)
+  {
+    origin[a][lane] = ray.origin[a];
+    direction[a][lane] = ray.direction[a];
+    inverseDirection[a][lane] = inverse[a];
+  }
+
+  tMax[lane] = maxT;
+  active |= 1u << lane;
+}
+
+void intersectPacket(const BinaryBVH& bvh, const IndexedTriangles& triangles, const RayPacket& packet, const bool anyHit, RaycastResult* results)
+{
+  PacketHits hits;
+
+  for (int l = 0; l < RAY_PACKET_SIZE; ++l)
+  {
+    hits.t[l] = packet.tMax[l];
+    hits.u[l] = 0.f;
+    hits.v[l] = 0.f;
+    hits.triangleIdx[l] = -1;
+  }
+
+  unsigned int active = packet.active;
+
+  const Frustum frustum = computeFrustum(packet);
+
+  const std::vector<LayoutNode>& nodes = bvh.getNodes();
+
+  TraversalStack<int, RAY_PACKET_STACK_SIZE> stack;
+
+  if (!nodes.empty())
+    stack.push(0);
+
+  while (!stack.empty() && active)
+  {
+    const LayoutNode& node = nodes[stack.pop()];
+
+    if (frustumMisses(frustum, node.bbox))
+      continue;
+
+    unsigned int mask = intersectBox(node.bbox, packet, hits, active);
+
+    if (!mask)
+      continue;
+
+    if (node.leftIndex == -1)
+    {
+      for (int ti = node.startTri; ti < node.startTri + node.nTri && mask; ++ti)
+      {
+        const unsigned int hitMask = intersectTriangle(triangles, ti, packet, hits, mask);
+
+        // Rays that found an occluder are done
+        if (anyHit)
+        {
+          mask &= ~hitMask;
+          active &= ~hitMask;
+        }
+      }
+
+      continue;
+    }
+
+    // The first ray's direction along the axis that separates the children the most decides which one is nearer
+    const AABB& left = nodes[node.leftIndex].bbox;
+    const AABB& right = nodes[node.rightIndex].bbox;
+    const glm::fvec3 separation = (right.min + right.max) - (left.min + left.max);
+
+    int axis = std::abs(separation.x) > std::abs(separation.y) ? 0 : 1;
+    axis = std::abs(separation.z) > std::abs(separation[axis]) ? 2 : axis;
+
+    const bool leftFirst = packet.direction[axis][__builtin_ctz(mask)] * separation[axis] >= 0.f;
+
+    stack.push(leftFirst ? node.rightIndex : node.leftIndex);
+    stack.push(leftFirst ? node.leftIndex : node.rightIndex);
+  }
+
+  for (int l = 0; l < RAY_PACKET_SIZE; ++l)
+  {
+    results[l] = RaycastResult();
+
+    if (hits.triangleIdx[l] == -1)
+      continue;
+
+    const glm::fvec3 origin(packet.origin[0][l], packet.origin[1][l], packet.origin[2][l]);
+    const glm::fvec3 direction(packet.direction[0][l], packet.direction[1][l], packet.direction[2][l]);
+
+    results[l] = RaycastResult(hits.triangleIdx[l], hits.t[l], glm::fvec2(hits.u[l], hits.v[l]), origin + direction * hits.t[l]);
+  }
+}
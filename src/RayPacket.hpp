@@ -0,0 +1,33 @@
+#ifndef RAYPACKET_HPP
+#define RAYPACKET_HPP
+
+#include <vector>
+
+#include "Utils.hpp"
+#include "Triangle.hpp"
+#include "BinaryBVH.hpp"
+
+// One AVX register of rays
+#define RAY_PACKET_SIZE 8
+#define RAY_PACKET_STACK_SIZE 256
+
+// Rays stored per component so that a box or a triangle is tested against all lanes at once
+struct alignas(32) RayPacket
+{
+  float origin[3][RAY_PACKET_SIZE];
+  float direction[3][RAY_PACKET_SIZE];
+  float inverseDirection[3][RAY_PACKET_SIZE];
+  float tMax[RAY_PACKET_SIZE];
+  unsigned int active; // Lanes holding a ray
+
+  RayPacket();
+
+  void set(const int lane, const Ray& ray, const float maxT);
+};
+
+// Traverses the BVH with all rays of the packet together. Boxes that the bounding frustum of
+// a coherent packet misses are culled without testing the single rays. Lanes without a ray get an
+// empty result.
+void intersectPacket(const BinaryBVH& bvh, const IndexedTriangles& triangles, const RayPacket& packet, const bool anyHit, RaycastResult* results);
+
+#endif // RAYPACKET_HPP
@@ -0,0 +1,19 @@
+#ifndef RENDERCONSTANTS_HPP
+#define RENDERCONSTANTS_HPP
+
+// Shared by the CUDA and CPU renderers so that both produce the same images
+
+#define OFFSET_EPSILON 0.00001f
+#define BIGT 99999.f
+
+#define RT_SHADOWSAMPLING 8
+#define RT_SECONDARY_RAYS 3
+#define AIR_INDEX 1.f
+
+#define REFLECTIVE_BIT 0x80000000
+#define REFRACTIVE_BIT 0x40000000
+#define INSIDE_BIT 0x20000000
+
+#define PT_BOUNCES 6
+
+#endif
@@ -0,0 +1,187 @@
+#include "TileScheduler.hpp"
+
+#include <algorithm>
+#include <numeric>
+#include <chrono>
+
+namespace
+{
+  // Position of (x, y) along the Hilbert curve through an n x n grid, n a power of two
+  unsigned int hilbertIndex(const unsigned int n, unsigned int x, unsigned int y)
+  {
+    unsigned int d = 0;
+
+    for (unsigned int s = n / 2; s > 0; s /= 2)
+    {
+      const unsigned int rx = (x & s) > 0;
+      const unsigned int ry = (y & s) > 0;
+
+      d += s * s * ((3 * rx) ^ ry);
+
+      // Rotate the quadrant so that the curve continues in the sub grid
+      if (ry == 0)
+      {
+        if (rx == 1)
+        {
+          x = n - 1 - x;
+          y = n - 1 - y;
+        }
+
+        std::swap(x, y);
+      }
+    }
+
+    return d;
+  }
+
+  // Quadrants in the order of a U, so that the halves of a split tile stay next to each other
+  const glm::ivec2 QUADRANTS[4] = {glm::ivec2(0, 0), glm::ivec2(1, 0), glm::ivec2(1, 1), glm::ivec2(0, 1)};
+}
+
+TileScheduler::TileScheduler() : pool(), tiles(), costs(), canvasSize(0)
+{
+}
+
+TileScheduler::~TileScheduler()
+{
+}
+
+const std::vector<Tile>& TileScheduler::getTiles() const
+{
+  return tiles;
+}
+
+void TileScheduler::reset()
+{
+  tiles.clear();
+  costs.clear();
+}
+
+void TileScheduler::createTiles(const glm::ivec2& size)
+{
+  const int tilesX = (size.x + CPU_TILE_SIZE - 1) / CPU_TILE_SIZE;
+  const int tilesY = (size.y + CPU_TILE_SIZE - 1) / CPU_TILE_SIZE;
+
+  unsigned int n = 1;
+
+  while (n < (unsigned int) std::max(tilesX, tilesY))
+    n *= 2;
+
+  std::vector<std::pair<unsigned int, Tile>> ordered;
+
+  for (int y = 0; y < tilesY; ++y)
+  {
+    for (int x = 0; x < tilesX; ++x)
+      ordered.push_back(std::make_pair(hilbertIndex(n, x, y), Tile{glm::ivec2(x, y) * CPU_TILE_SIZE, CPU_TILE_SIZE}));
+  }
+
+  std::sort(ordered.begin(), ordered.end(), [](const std::pair<unsigned int, Tile>& a, const std::pair<unsigned int, Tile>& b) { return a.first < b.first; });
+
+  tiles.clear();
+
+  for (const auto& t : ordered)
+    tiles.push_back(t.second);
+
+  costs.assign(tiles.size(), 0.f);
+  canvasSize = size;
+}
+
+void TileScheduler::refineTiles()
+{
+  const float total = std::accumulate(costs.begin(), costs.end(), 0.f);
+  const float target = total / ((pool.getNThreads() + 1) * CPU_TILES_PER_THREAD); // The calling thread helps
+
+  std::vector<Tile> refined;
+  std::vector<float> refinedCosts;
+
+  for (unsigned int i = 0; i < tiles.size(); ++i)
+  {
+    const Tile& tile = tiles[i];
+
+    if (costs[i] > target && tile.size > CPU_MIN_TILE_SIZE)
+    {
+      const int half = tile.size / 2;
+      std::vector<Tile> quadrants;
+
+      for (const glm::ivec2& q : QUADRANTS)
+      {
+        const glm::ivec2 origin = tile.origin + q * half;
+
+        if (origin.x < canvasSize.x && origin.y < canvasSize.y)
+          quadrants.push_back(Tile{origin, half});
+      }
+
+      for (const Tile& q : quadrants)
+      {
+        refined.push_back(q);
+        refinedCosts.push_back(costs[i] / quadrants.size());
+      }
+
+      continue;
+    }
+
+    // Four consecutive quadrants of the same parent are merged back if the parent is cheap enough
+    if (tile.size < CPU_TILE_SIZE && i + 3 < tiles.size() && tile.origin.x % (2 * tile.size) == 0 && tile.origin.y % (2 * tile.size) == 0)
+    {
+      bool siblings = true;
+
+      for (unsigned int q = 1; q < 4; ++q)
+        siblings = siblings && tiles[i + q].size == tile.size && tiles[i + q].origin == tile.origin + QUADRANTS[q] * tile.size;
+
+      const float parentCost = costs[i] + costs[i + 1] + costs[i + 2] + costs[i + 3];
+
+      if (siblings && parentCost < target)
+      {
+        refined.push_back(Tile{tile.origin, 2 * tile.size});
+        refinedCosts.push_back(parentCost);
+        i += 3;
+
+        continue;
+      }
+    }
+
+    refined.push_back(tile);
+    refinedCosts.push_back(costs[i]);
+  }
+
+  tiles.swap(refined);
+  costs.swap(refinedCosts);
+}
+
+void TileScheduler::renderRange(const int first, const int last, TaskGroup& group, const std::function<void(const Tile& tile)>& renderTile)
+{
+  // The second halves go to the back of this worker's deque. Thieves take the oldest and biggest one
+  // from the front, the worker itself continues with the tiles right after its own.
+  int end = last;
+
+  while (end - first > 1)
+  {
+    const int middle = (first + end) / 2;
+
+    group.run([this, middle, end, &group, &renderTile] { renderRange(middle, end, group, renderTile); });
+    end = middle;
+  }
+
+  const auto start = std::chrono::high_resolution_clock::now();
+
+  renderTile(tiles[first]);
+
+  const auto stop = std::chrono::high_resolution_clock::now();
+  costs[first] = std::chrono::duration<float>(stop - start).count();
+}
+
+void TileScheduler::render(const glm::ivec2& size, const std::function<void(const Tile& tile)>& renderTile)
+{
+  if (size.x <= 0 || size.y <= 0)
+    return;
+
+  if (tiles.empty() || size != canvasSize)
+    createTiles(size);
+  else
+    refineTiles();
+
+  TaskGroup group(pool);
+
+  group.run([this, &group, &renderTile] { renderRange(0, tiles.size(), group, renderTile); });
+  group.wait();
+}
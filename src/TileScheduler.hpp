@@ -0,0 +1,48 @@
+#ifndef TILESCHEDULER_HPP
+#define TILESCHEDULER_HPP
+
+#include <vector>
+#include <functional>
+
+#include <glm/glm.hpp>
+
+#include "WorkStealingPool.hpp"
+
+#define CPU_TILE_SIZE 32
+#define CPU_MIN_TILE_SIZE 8 // A multiple of the primary ray packet's pixel block
+#define CPU_TILES_PER_THREAD 8
+
+struct Tile
+{
+  glm::ivec2 origin;
+  int size;
+};
+
+// Renders the canvas in square tiles on its own work stealing pool. The tiles follow a Hilbert curve
+// and every worker splits its range of the curve in halves: it keeps the neighbouring tiles for
+// itself while idle workers steal the biggest halves. The measured time of each tile refines the
+// tiling for the next frame, expensive tiles are split in quadrants and cheap quadrants merged again.
+class TileScheduler
+{
+public:
+  TileScheduler();
+  ~TileScheduler();
+
+  // Returns when renderTile has run for every tile of a canvas of this size
+  void render(const glm::ivec2& size, const std::function<void(const Tile& tile)>& renderTile);
+  void reset(); // Back to uniform tiles, e.g. for a new scene
+
+  const std::vector<Tile>& getTiles() const;
+
+private:
+  void createTiles(const glm::ivec2& size);
+  void refineTiles();
+  void renderRange(const int first, const int last, TaskGroup& group, const std::function<void(const Tile& tile)>& renderTile);
+
+  WorkStealingPool pool;
+  std::vector<Tile> tiles;
+  std::vector<float> costs; // Seconds per tile in the last frame
+  glm::ivec2 canvasSize;
+};
+
+#endif // TILESCHEDULER_HPP
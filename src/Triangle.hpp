@@ -63,4 +63,23 @@ struct Triangle {
   }
 };
 
+// Triangles as three indices into a vertex buffer shared by the whole model. Does not own the buffers.
+struct IndexedTriangles
+{
+  const Vertex* vertices;
+  const glm::uvec3* indices;
+
+  CUDA_FUNCTION IndexedTriangles() : vertices(nullptr), indices(nullptr) {};
+  CUDA_FUNCTION IndexedTriangles(const Vertex* vertices, const glm::uvec3* indices) : vertices(vertices), indices(indices) {};
+
+  CUDA_FUNCTION inline const glm::fvec3& position(const unsigned int triIdx, const unsigned int corner) const {
+    return vertices[indices[triIdx][corner]].p;
+  }
+
+  CUDA_FUNCTION inline Triangle operator[](const unsigned int triIdx) const {
+    const glm::uvec3 idx = indices[triIdx];
+    return Triangle(vertices[idx.x], vertices[idx.y], vertices[idx.z]);
+  }
+};
+
 #endif
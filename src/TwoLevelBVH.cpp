@@ -0,0 +1,207 @@
+#include "TwoLevelBVH.hpp"
+#include "RayIntersection.hpp"
+
+#include <cmath>
+#include <limits>
+
+namespace
+{
+  AABB transformBox(const AABB& box, const glm::fmat4& transform)
+  {
+    AABB result;
+    result.min = glm::fvec3(std::numeric_limits<float>::max());
+    result.max = glm::fvec3(-std::numeric_limits<float>::max());
+
+    for (unsigned int c = 0; c < 8; ++c)
+    {
+      const glm::fvec3 corner(c & 1 ? box.max.x : box.min.x, c & 2 ? box.max.y : box.min.y, c & 4 ? box.max.z : box.min.z);
+      result.add(glm::fvec3(transform * glm::fvec4(corner, 1.f)));
+    }
+
+    return result;
+  }
+}
+
+TwoLevelBVH::TwoLevelBVH()
+{
+  // There are few instances, the full binned SAH is cheap
+  topLevelParameters.splitMode = SplitMode::BINNED_SAH;
+  topLevelParameters.printStatistics = false;
+}
+
+TwoLevelBVH::~TwoLevelBVH()
+{
+
+}
+
+unsigned int TwoLevelBVH::addMesh(std::vector<Vertex> vertices, const std::vector<glm::uvec3>& indices, const int materialIdx, const BVHBuildParameters& parameters)
+{
+  // One summary is printed for the whole scene instead
+  BVHBuildParameters meshParameters = parameters;
+  meshParameters.printStatistics = false;
+
+  BVHBuilder builder;
+  builder.build(meshParameters, vertices, indices, std::vector<unsigned int>(indices.size(), 0));
+
+  MeshBVH mesh;
+  mesh.bvh = builder.getBVH();
+  mesh.vertices = std::move(vertices);
+  mesh.triangleIndices = builder.getTriangleIndices();
+  mesh.bbox = mesh.bvh.empty() ? AABB() : mesh.bvh[0].bbox;
+  mesh.materialIdx = materialIdx;
+  mesh.wideBVH.build(mesh.bvh, false);
+
+  meshes.push_back(std::move(mesh));
+
+  return meshes.size() - 1;
+}
+
+unsigned int TwoLevelBVH::addInstance(const unsigned int meshIdx, const glm::fmat4& transform)
+{
+  MeshInstance instance;
+  instance.meshIdx = meshIdx;
+
+  instances.push_back(instance);
+  setInstanceTransform(instances.size() - 1, transform);
+
+  return instances.size() - 1;
+}
+
+void TwoLevelBVH::setInstanceTransform(const unsigned int instanceIdx, const glm::fmat4& transform)
+{
+  MeshInstance& instance = instances[instanceIdx];
+
+  instance.transform = transform;
+  instance.inverseTransform = glm::inverse(transform);
+  instance.bbox = transformBox(meshes[instance.meshIdx].bbox, transform);
+}
+
+void TwoLevelBVH::buildTopLevel()
+{
+  std::vector<AABB> bounds(instances.size());
+
+  for (std::size_t i = 0; i < instances.size(); ++i)
+    bounds[i] = instances[i].bbox;
+
+  BVHBuilder builder;
+  builder.build(topLevelParameters, bounds);
+
+  topLevelBVH = builder.getBVH();
+  instanceOrder = builder.getTriangleSourceIds();
+}
+
+void TwoLevelBVH::printStatistics() const
+{
+  std::size_t meshBytes = 0;
+  std::size_t flatBytes = 0;
+
+  for (const auto& mesh : meshes)
+    meshBytes += mesh.vertices.size() * sizeof(Vertex) + mesh.triangleIndices.size() * sizeof(glm::uvec3) + mesh.bvh.size() * sizeof(Node) + mesh.wideBVH.getNodes().size() * sizeof(WideNode<WIDE_BVH_WIDTH>);
+
+  for (const auto& instance : instances)
+    flatBytes += meshes[instance.meshIdx].vertices.size() * sizeof(Vertex) + meshes[instance.meshIdx].triangleIndices.size() * sizeof(glm::uvec3);
+
+  std::cout << "Two level BVH: " << meshes.size() << " meshes, " << instances.size() << " instances, "
+            << (meshBytes + topLevelBVH.size() * sizeof(Node) + instances.size() * sizeof(MeshInstance)) / (1024.f * 1024.f) << " MiB ("
+            << flatBytes / (1024.f * 1024.f) << " MiB of triangles if flattened)" << std::endl;
+}
+
+RaycastResult TwoLevelBVH::intersect(const Ray& ray, const float maxT, const bool anyHit, int& instanceIdx) const
+{
+  RaycastResult result;
+  instanceIdx = -1;
+
+  if (topLevelBVH.empty())
+    return result;
+
+  const glm::fvec3 inverseDirection = safeInverse(ray.direction);
+
+  float tMin = maxT;
+  float tRoot;
+
+  if (!intersectBox(topLevelBVH[0].bbox, ray.origin, inverseDirection, tMin, tRoot))
+    return result;
+
+  TraversalStack<TraversalEntry, TOP_LEVEL_STACK_SIZE> stack;
+  stack.push(TraversalEntry{0, tRoot});
+
+  while (!stack.empty())
+  {
+    const TraversalEntry entry = stack.pop();
+
+    if (entry.t > tMin)
+      continue;
+
+    const int nodeIdx = entry.nodeIdx;
+    const Node& node = topLevelBVH[nodeIdx];
+
+    if (node.rightIndex == -1)
+    {
+      for (int i = node.startTri; i < node.startTri + node.nTri; ++i)
+      {
+        const MeshInstance& instance = instances[instanceOrder[i]];
+        const MeshBVH& mesh = meshes[instance.meshIdx];
+
+        // The object space direction is not normalized, so t stays the same in both spaces
+        const Ray objectRay(glm::fvec3(instance.inverseTransform * glm::fvec4(ray.origin, 1.f)), glm::fvec3(instance.inverseTransform * glm::fvec4(ray.direction, 0.f)));
+        const RaycastResult hit = mesh.wideBVH.intersect(objectRay, IndexedTriangles(mesh.vertices.data(), mesh.triangleIndices.data()), tMin, anyHit);
+
+        if (hit && hit.t < tMin)
+        {
+          tMin = hit.t;
+          result = hit;
+          instanceIdx = instanceOrder[i];
+
+          if (anyHit)
+            break;
+        }
+      }
+
+      if (anyHit && instanceIdx != -1)
+        break;
+
+      continue;
+    }
+
+    const int children[2] = {nodeIdx + 1, node.rightIndex};
+    float tNear[2];
+    bool hit[2];
+
+    for (int c = 0; c < 2; ++c)
+      hit[c] = intersectBox(topLevelBVH[children[c]].bbox, ray.origin, inverseDirection, tMin, tNear[c]);
+
+    // The closer child is pushed last so it is visited first
+    const int first = hit[0] && hit[1] && tNear[1] < tNear[0] ? 1 : 0;
+
+    for (int c : {1 - first, first})
+    {
+      if (hit[c])
+        stack.push(TraversalEntry{children[c], tNear[c]});
+    }
+  }
+
+  if (instanceIdx != -1)
+    result.point = ray.origin + ray.direction * result.t;
+
+  return result;
+}
+
+const std::vector<MeshBVH>& TwoLevelBVH::getMeshes() const
+{
+  return meshes;
+}
+
+const std::vector<MeshInstance>& TwoLevelBVH::getInstances() const
+{
+  return instances;
+}
+
+const std::vector<Node>& TwoLevelBVH::getTopLevelBVH() const
+{
+  return topLevelBVH;
+}
+
+bool TwoLevelBVH::empty() const
+{
+  return instances.empty();
+}
@@ -0,0 +1,64 @@
+#ifndef TWOLEVELBVH_HPP
+#define TWOLEVELBVH_HPP
+
+#include <vector>
+
+#include "Utils.hpp"
+#include "Triangle.hpp"
+#include "BVHBuilder.hpp"
+#include "WideBVH.hpp"
+
+#define TOP_LEVEL_STACK_SIZE 64
+
+// Bottom level: one BVH per unique mesh, in object space
+struct MeshBVH
+{
+  std::vector<Vertex> vertices;
+  std::vector<glm::uvec3> triangleIndices; // In BVH order
+  std::vector<Node> bvh;
+  NativeWideBVH wideBVH;
+  AABB bbox;
+  int materialIdx;
+};
+
+struct MeshInstance
+{
+  unsigned int meshIdx;
+  glm::fmat4 transform; // Object to world
+  glm::fmat4 inverseTransform;
+  AABB bbox;            // World space
+};
+
+// Instances share the bottom level BVH of their mesh, so memory grows with the unique geometry.
+// Moving an instance only rebuilds the top level over the instance bounds.
+class TwoLevelBVH
+{
+public:
+  TwoLevelBVH();
+  ~TwoLevelBVH();
+
+  // The indices refer to the given vertices
+  unsigned int addMesh(std::vector<Vertex> vertices, const std::vector<glm::uvec3>& indices, const int materialIdx, const BVHBuildParameters& parameters);
+  unsigned int addInstance(const unsigned int meshIdx, const glm::fmat4& transform);
+  void setInstanceTransform(const unsigned int instanceIdx, const glm::fmat4& transform);
+  void buildTopLevel();
+  void printStatistics() const;
+
+  // The triangle index refers to the BVH order of the hit instance's mesh
+  RaycastResult intersect(const Ray& ray, const float maxT, const bool anyHit, int& instanceIdx) const;
+
+  const std::vector<MeshBVH>& getMeshes() const;
+  const std::vector<MeshInstance>& getInstances() const;
+  const std::vector<Node>& getTopLevelBVH() const;
+  bool empty() const;
+
+private:
+  std::vector<MeshBVH> meshes;
+  std::vector<MeshInstance> instances;
+
+  std::vector<Node> topLevelBVH;
+  std::vector<unsigned int> instanceOrder; // Instance of every top level leaf slot
+  BVHBuildParameters topLevelParameters;
+};
+
+#endif // TWOLEVELBVH_HPP
@@ -7,6 +7,7 @@
 #include "imgui.h"
 
 #include "Utils.hpp"
+#include "ModelLoader.hpp"
 #include "imgui_impl_glfw_gl3.h"
 
 UI::UI()
@@ -25,7 +26,7 @@ UI::~UI()
   ImGui_ImplGlfwGL3_Shutdown();
 }
 
-void UI::draw(const enum ActiveRenderer activeRenderer, const enum DebugMode debugMode)
+void UI::draw(const enum ActiveRenderer activeRenderer, const enum DebugMode debugMode, LoadProgress* loadProgress, const float samplesPerSecond)
 {
   ImGui_ImplGlfwGL3_NewFrame();
 
@@ -45,6 +46,18 @@ void UI::draw(const enum ActiveRenderer activeRenderer, const enum DebugMode deb
           ImGui::Text("Renderer (enter): OpenGL");
           break;
 
+        case CPU_RAYTRACER:
+          ImGui::Text("Renderer (enter): CPU raytracer");
+          break;
+
+        case CPU_PATHTRACER:
+          ImGui::Text("Renderer (enter): CPU pathtracer");
+          break;
+
+        case CPU_WAVEFRONT_PATHTRACER:
+          ImGui::Text("Renderer (enter): CPU wavefront pathtracer");
+          break;
+
 #ifdef ENABLE_CUDA
         case RAYTRACER:
           ImGui::Text("Renderer (enter): Raytracer");
@@ -59,6 +72,9 @@ void UI::draw(const enum ActiveRenderer activeRenderer, const enum DebugMode deb
           break;
       }
 
+      if (samplesPerSecond > 0.f)
+        ImGui::Text("%.2f Msamples/s", samplesPerSecond * 1e-6f);
+
       switch (debugMode)
       {
         case DEBUG_RAYTRACE:
@@ -77,6 +93,24 @@ void UI::draw(const enum ActiveRenderer activeRenderer, const enum DebugMode deb
       ImGui::Text("Open scene file: Ctrl+O");
       ImGui::Text("Save scene file: Ctrl+S");
 
+      if (loadProgress)
+      {
+        const char* stages[] = {"Reading BVH cache", "Importing model", "Building BVH"};
+        const float fraction = loadProgress->fraction;
+
+        ImGui::Separator();
+        ImGui::Text("%s", stages[loadProgress->stage]);
+
+        // The cache and the BVH build don't report their progress
+        if (fraction >= 0.f)
+          ImGui::ProgressBar(fraction, ImVec2(200.f, 0.f));
+
+        if (loadProgress->cancelled)
+          ImGui::Text("Cancelling...");
+        else if (ImGui::Button("Cancel (Esc)"))
+          loadProgress->cancelled = true;
+      }
+
 
       if (ImGui::BeginPopupContextWindow())
       {
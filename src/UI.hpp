@@ -4,13 +4,18 @@
 #include "GLTexture.hpp"
 
 class GLFWwindow;
+struct LoadProgress;
 
 enum ActiveRenderer {
-  GL
+  GL,
+  CPU_RAYTRACER,
+  CPU_PATHTRACER,
+  CPU_WAVEFRONT_PATHTRACER,
 #ifdef ENABLE_CUDA
-  , RAYTRACER,
-  PATHTRACER
+  RAYTRACER,
+  PATHTRACER,
 #endif
+  RENDERER_COUNT
 };
 
 enum DebugMode
@@ -28,7 +33,8 @@ public:
 
   void init(GLFWwindow* window);
 
-  void draw(const enum ActiveRenderer activeRenderer, const enum DebugMode debugMode);
+  // A progress bar with a cancel button is shown while loadProgress is set, the CPU renderers report their samplesPerSecond
+  void draw(const enum ActiveRenderer activeRenderer, const enum DebugMode debugMode, LoadProgress* loadProgress = nullptr, const float samplesPerSecond = 0.f);
   void resize(const glm::ivec2 newSize);
   float getDTime();
 private:
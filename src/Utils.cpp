@@ -126,3 +126,9 @@ CUDA_FUNCTION void AABB::add(const glm::fvec3 v)
   min = glm::min(min, v);
   max = glm::max(max, v);
 }
+
+CUDA_FUNCTION void AABB::add(const AABB& b)
+{
+  min = glm::min(min, b.min);
+  max = glm::max(max, b.max);
+}
@@ -94,6 +94,7 @@ struct AABB
 
   CUDA_FUNCTION void add(const Triangle& v);
   CUDA_FUNCTION void add(const glm::fvec3 v);
+  CUDA_FUNCTION void add(const AABB& b);
   CUDA_FUNCTION float area() const;
   CUDA_FUNCTION unsigned int maxAxis() const;
 };
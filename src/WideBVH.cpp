@@ -0,0 +1,511 @@
+#include "WideBVH.hpp"
+#include "RayIntersection.hpp"
+
+#include <array>
+#include <limits>
+#include <cmath>
+#include <cstring>
+
+#if defined(__AVX2__) || defined(__SSE4_1__)
+  #include <immintrin.h>
+#endif
+
+namespace
+{
+  // Return a bit mask of the children hit closer than tMax and write their entry distances to tNear
+  template <unsigned int Width>
+  inline unsigned int intersectChildren(const WideNode<Width>& node, const glm::fvec3& origin, const glm::fvec3& inverseDirection, const float tMax, float* tNear)
+  {
+    unsigned int mask = 0;
+
+    for (int i = 0; i < node.nChildren; ++i)
+    {
+      float t0 = 0.f;
+      float t1 = tMax;
+
+      for (unsigned int a = 0; a < 3; ++a)
+      {
+        const float ta = (node.bboxMin[a][i] - origin[a]) * inverseDirection[a];
+        const float tb = (node.bboxMax[a][i] - origin[a]) * inverseDirection[a];
+
+        t0 = std::max(t0, std::min(ta, tb));
+        t1 = std::min(t1, std::max(ta, tb));
+      }
+
+      tNear[i] = t0;
+
+      if (t0 <= t1)
+        mask |= 1u << i;
+    }
+
+    return mask;
+  }
+
+  // The child bounds are origin + q * 2^exponent, so the slab distance is q * scale + offset
+  template <unsigned int Width>
+  inline unsigned int intersectChildren(const QuantizedWideNode<Width>& node, const glm::fvec3& origin, const glm::fvec3& inverseDirection, const float tMax, float* tNear)
+  {
+    float scale[3], offset[3];
+
+    for (unsigned int a = 0; a < 3; ++a)
+    {
+      scale[a] = std::ldexp(inverseDirection[a], node.exponent[a]);
+      offset[a] = (node.origin[a] - origin[a]) * inverseDirection[a];
+    }
+
+    unsigned int mask = 0;
+
+    for (int i = 0; i < node.nChildren; ++i)
+    {
+      float t0 = 0.f;
+      float t1 = tMax;
+
+      for (unsigned int a = 0; a < 3; ++a)
+      {
+        const float ta = node.qMin[a][i] * scale[a] + offset[a];
+        const float tb = node.qMax[a][i] * scale[a] + offset[a];
+
+        t0 = std::max(t0, std::min(ta, tb));
+        t1 = std::min(t1, std::max(ta, tb));
+      }
+
+      tNear[i] = t0;
+
+      if (t0 <= t1)
+        mask |= 1u << i;
+    }
+
+    return mask;
+  }
+
+#ifdef __SSE4_1__
+  inline unsigned int intersectChildren(const WideNode<4>& node, const glm::fvec3& origin, const glm::fvec3& inverseDirection, const float tMax, float* tNear)
+  {
+    __m128 t0 = _mm_setzero_ps();
+    __m128 t1 = _mm_set1_ps(tMax);
+
+    for (unsigned int a = 0; a < 3; ++a)
+    {
+      const __m128 o = _mm_set1_ps(origin[a]);
+      const __m128 id = _mm_set1_ps(inverseDirection[a]);
+
+      const __m128 ta = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.bboxMin[a]), o), id);
+      const __m128 tb = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.bboxMax[a]), o), id);
+
+      t0 = _mm_max_ps(t0, _mm_min_ps(ta, tb));
+      t1 = _mm_min_ps(t1, _mm_max_ps(ta, tb));
+    }
+
+    _mm_storeu_ps(tNear, t0);
+
+    return _mm_movemask_ps(_mm_cmple_ps(t0, t1)) & ((1u << node.nChildren) - 1);
+  }
+
+  inline __m128 dequantize(const unsigned char* q, const __m128 scale, const __m128 offset)
+  {
+    int packed;
+    std::memcpy(&packed, q, sizeof(int));
+
+    const __m128 v = _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(packed)));
+
+    return _mm_add_ps(_mm_mul_ps(v, scale), offset);
+  }
+
+  inline unsigned int intersectChildren(const QuantizedWideNode<4>& node, const glm::fvec3& origin, const glm::fvec3& inverseDirection, const float tMax, float* tNear)
+  {
+    __m128 t0 = _mm_setzero_ps();
+    __m128 t1 = _mm_set1_ps(tMax);
+
+    for (unsigned int a = 0; a < 3; ++a)
+    {
+      const __m128 scale = _mm_set1_ps(std::ldexp(inverseDirection[a], node.exponent[a]));
+      const __m128 offset = _mm_set1_ps((node.origin[a] - origin[a]) * inverseDirection[a]);
+
+      const __m128 ta = dequantize(node.qMin[a], scale, offset);
+      const __m128 tb = dequantize(node.qMax[a], scale, offset);
+
+      t0 = _mm_max_ps(t0, _mm_min_ps(ta, tb));
+      t1 = _mm_min_ps(t1, _mm_max_ps(ta, tb));
+    }
+
+    _mm_storeu_ps(tNear, t0);
+
+    return _mm_movemask_ps(_mm_cmple_ps(t0, t1)) & ((1u << node.nChildren) - 1);
+  }
+#endif
+
+#ifdef __AVX2__
+  inline unsigned int intersectChildren(const WideNode<8>& node, const glm::fvec3& origin, const glm::fvec3& inverseDirection, const float tMax, float* tNear)
+  {
+    __m256 t0 = _mm256_setzero_ps();
+    __m256 t1 = _mm256_set1_ps(tMax);
+
+    for (unsigned int a = 0; a < 3; ++a)
+    {
+      const __m256 o = _mm256_set1_ps(origin[a]);
+      const __m256 id = _mm256_set1_ps(inverseDirection[a]);
+
+      const __m256 ta = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.bboxMin[a]), o), id);
+      const __m256 tb = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.bboxMax[a]), o), id);
+
+      t0 = _mm256_max_ps(t0, _mm256_min_ps(ta, tb));
+      t1 = _mm256_min_ps(t1, _mm256_max_ps(ta, tb));
+    }
+
+    _mm256_storeu_ps(tNear, t0);
+
+    return _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ)) & ((1u << node.nChildren) - 1);
+  }
+
+  inline __m256 dequantize(const unsigned char* q, const __m256 scale, const __m256 offset)
+  {
+    long long packed;
+    std::memcpy(&packed, q, sizeof(long long));
+
+    const __m256 v = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_cvtsi64_si128(packed)));
+
+    return _mm256_fmadd_ps(v, scale, offset);
+  }
+
+  inline unsigned int intersectChildren(const QuantizedWideNode<8>& node, const glm::fvec3& origin, const glm::fvec3& inverseDirection, const float tMax, float* tNear)
+  {
+    __m256 t0 = _mm256_setzero_ps();
+    __m256 t1 = _mm256_set1_ps(tMax);
+
+    for (unsigned int a = 0; a < 3; ++a)
+    {
+      const __m256 scale = _mm256_set1_ps(std::ldexp(inverseDirection[a], node.exponent[a]));
+      const __m256 offset = _mm256_set1_ps((node.origin[a] - origin[a]) * inverseDirection[a]);
+
+      const __m256 ta = dequantize(node.qMin[a], scale, offset);
+      const __m256 tb = dequantize(node.qMax[a], scale, offset);
+
+      t0 = _mm256_max_ps(t0, _mm256_min_ps(ta, tb));
+      t1 = _mm256_min_ps(t1, _mm256_max_ps(ta, tb));
+    }
+
+    _mm256_storeu_ps(tNear, t0);
+
+    return _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ)) & ((1u << node.nChildren) - 1);
+  }
+#endif
+
+  template <unsigned int Width, typename WideNodeType>
+  RaycastResult traverse(const std::vector<WideNodeType>& nodes, const Ray& ray, const IndexedTriangles& triangles, const float maxT, const bool anyHit)
+  {
+    RaycastResult result;
+
+    if (nodes.empty())
+      return result;
+
+    const glm::fvec3 inverseDirection = safeInverse(ray.direction);
+
+    float tMin = maxT;
+    int minTriIdx = -1;
+    glm::fvec2 minUV;
+
+    TraversalStack<TraversalEntry, WIDE_BVH_STACK_SIZE> stack;
+    stack.push(TraversalEntry{0, 0.f});
+
+    while (!stack.empty())
+    {
+      const TraversalEntry entry = stack.pop();
+
+      // A closer hit was found after this node was pushed
+      if (entry.t > tMin)
+        continue;
+
+      const WideNodeType& node = nodes[entry.nodeIdx];
+
+      std::array<float, Width> tNear;
+      unsigned int mask = intersectChildren(node, ray.origin, inverseDirection, tMin, tNear.data());
+
+      std::array<int, Width> hits;
+      int nHits = 0;
+
+      while (mask)
+      {
+        const int i = __builtin_ctz(mask);
+        mask &= mask - 1;
+
+        if (node.nTri[i] > 0)
+        {
+          for (int ti = node.child[i]; ti < node.child[i] + node.nTri[i]; ++ti)
+          {
+            float t;
+            glm::fvec2 uv;
+
+            if (rayTriangleIntersection(ray, triangles, ti, t, uv) && t < tMin)
+            {
+              tMin = t;
+              minTriIdx = ti;
+              minUV = uv;
+
+              if (anyHit)
+                break;
+            }
+          }
+
+          if (anyHit && minTriIdx != -1)
+            break;
+        }
+        else
+        {
+          // Insertion sort, farthest first
+          int j = nHits++;
+
+          for (; j > 0 && tNear[hits[j - 1]] < tNear[i]; --j)
+            hits[j] = hits[j - 1];
+
+          hits[j] = i;
+        }
+      }
+
+      if (anyHit && minTriIdx != -1)
+        break;
+
+      // The closest child ends up on top of the stack
+      for (int h = 0; h < nHits; ++h)
+        stack.push(TraversalEntry{node.child[hits[h]], tNear[hits[h]]});
+    }
+
+    if (minTriIdx == -1)
+      return result;
+
+    result.point = ray.origin + ray.direction * tMin;
+    result.t = tMin;
+    result.triangleIdx = minTriIdx;
+    result.uv = minUV;
+
+    return result;
+  }
+}
+
+template <unsigned int Width>
+WideBVH<Width>::WideBVH()
+{
+
+}
+
+template <unsigned int Width>
+WideBVH<Width>::WideBVH(const std::vector<Node>& bvh)
+{
+  build(bvh);
+}
+
+template <unsigned int Width>
+WideBVH<Width>::~WideBVH()
+{
+
+}
+
+template <unsigned int Width>
+void WideBVH<Width>::build(const std::vector<Node>& bvh, const bool printStatistics)
+{
+  nodes.clear();
+
+  if (bvh.empty() || bvh[0].nTri == 0)
+    return;
+
+  nodes.reserve(bvh.size() / (Width - 1) + 1);
+  collapse(bvh, 0);
+
+  if (printStatistics)
+    std::cout << "BVH" << Width << " nodes: " << nodes.size() << " (" << nodes.size() * sizeof(WideNode<Width>) << " bytes)" << std::endl;
+}
+
+// Pulls the grandchildren of the largest inner child up until all slots are used. Larger
+// children are more likely to be hit, so opening them removes the most traversal steps.
+template <unsigned int Width>
+int WideBVH<Width>::collapse(const std::vector<Node>& bvh, const int binaryIdx)
+{
+  std::array<int, Width> children;
+  int nChildren = 0;
+
+  if (bvh[binaryIdx].rightIndex == -1)
+  {
+    children[nChildren++] = binaryIdx;
+  }
+  else
+  {
+    children[nChildren++] = binaryIdx + 1;
+    children[nChildren++] = bvh[binaryIdx].rightIndex;
+  }
+
+  while (nChildren < static_cast<int>(Width))
+  {
+    int largest = -1;
+    float largestArea = -1.f;
+
+    for (int i = 0; i < nChildren; ++i)
+    {
+      const Node& c = bvh[children[i]];
+
+      if (c.rightIndex != -1 && c.bbox.area() > largestArea)
+      {
+        largest = i;
+        largestArea = c.bbox.area();
+      }
+    }
+
+    if (largest == -1)
+      break;
+
+    const int opened = children[largest];
+    children[largest] = opened + 1;
+    children[nChildren++] = bvh[opened].rightIndex;
+  }
+
+  const int idx = nodes.size();
+  nodes.push_back(WideNode<Width>());
+
+  WideNode<Width> node;
+  node.nChildren = nChildren;
+
+  for (unsigned int i = 0; i < Width; ++i)
+  {
+    const bool used = static_cast<int>(i) < nChildren;
+    const Node& c = bvh[used ? children[i] : 0];
+
+    for (unsigned int a = 0; a < 3; ++a)
+    {
+      node.bboxMin[a][i] = used ? c.bbox.min[a] : std::numeric_limits<float>::max();
+      node.bboxMax[a][i] = used ? c.bbox.max[a] : -std::numeric_limits<float>::max();
+    }
+
+    node.child[i] = used ? c.startTri : 0;
+    node.nTri[i] = used ? c.nTri : 0;
+  }
+
+  for (int i = 0; i < nChildren; ++i)
+  {
+    if (bvh[children[i]].rightIndex != -1)
+    {
+      node.child[i] = collapse(bvh, children[i]);
+      node.nTri[i] = 0;
+    }
+  }
+
+  nodes[idx] = node;
+
+  return idx;
+}
+
+template <unsigned int Width>
+RaycastResult WideBVH<Width>::intersect(const Ray& ray, const IndexedTriangles& triangles, const float maxT, const bool anyHit) const
+{
+  return traverse<Width>(nodes, ray, triangles, maxT, anyHit);
+}
+
+template <unsigned int Width>
+const std::vector<WideNode<Width>>& WideBVH<Width>::getNodes() const
+{
+  return nodes;
+}
+
+template <unsigned int Width>
+QuantizedWideBVH<Width>::QuantizedWideBVH()
+{
+
+}
+
+template <unsigned int Width>
+QuantizedWideBVH<Width>::QuantizedWideBVH(const WideBVH<Width>& wideBVH)
+{
+  build(wideBVH);
+}
+
+template <unsigned int Width>
+QuantizedWideBVH<Width>::~QuantizedWideBVH()
+{
+
+}
+
+template <unsigned int Width>
+void QuantizedWideBVH<Width>::build(const WideBVH<Width>& wideBVH, const bool printStatistics)
+{
+  const std::vector<WideNode<Width>>& wideNodes = wideBVH.getNodes();
+
+  nodes.resize(wideNodes.size());
+
+#pragma omp parallel for
+  for (int ni = 0; ni < static_cast<int>(wideNodes.size()); ++ni)
+  {
+    const WideNode<Width>& wide = wideNodes[ni];
+    QuantizedWideNode<Width>& node = nodes[ni];
+
+    node.nChildren = wide.nChildren;
+
+    for (unsigned int a = 0; a < 3; ++a)
+    {
+      float lo = std::numeric_limits<float>::max();
+      float hi = -std::numeric_limits<float>::max();
+
+      for (int i = 0; i < wide.nChildren; ++i)
+      {
+        lo = std::min(lo, wide.bboxMin[a][i]);
+        hi = std::max(hi, wide.bboxMax[a][i]);
+      }
+
+      // Smallest power of two step that spans the node in 255 steps
+      int exponent = hi > lo ? static_cast<int>(std::ceil(std::log2((hi - lo) / 255.f))) : -126;
+      exponent = glm::clamp(exponent, -126, 127);
+
+      while (exponent < 127 && lo + 255.f * std::ldexp(1.f, exponent) < hi)
+        ++exponent;
+
+      const float step = std::ldexp(1.f, exponent);
+
+      node.origin[a] = lo;
+      node.exponent[a] = static_cast<signed char>(exponent);
+
+      for (unsigned int i = 0; i < Width; ++i)
+      {
+        if (static_cast<int>(i) >= wide.nChildren)
+        {
+          node.qMin[a][i] = 0;
+          node.qMax[a][i] = 0;
+          continue;
+        }
+
+        int qMin = glm::clamp(static_cast<int>(std::floor((wide.bboxMin[a][i] - lo) / step)), 0, 255);
+        int qMax = glm::clamp(static_cast<int>(std::ceil((wide.bboxMax[a][i] - lo) / step)), 0, 255);
+
+        while (qMin > 0 && lo + qMin * step > wide.bboxMin[a][i])
+          --qMin;
+
+        while (qMax < 255 && lo + qMax * step < wide.bboxMax[a][i])
+          ++qMax;
+
+        node.qMin[a][i] = static_cast<unsigned char>(qMin);
+        node.qMax[a][i] = static_cast<unsigned char>(qMax);
+      }
+    }
+
+    for (unsigned int i = 0; i < Width; ++i)
+    {
+      node.child[i] = wide.child[i];
+      node.nTri[i] = wide.nTri[i];
+    }
+  }
+
+  if (printStatistics)
+    std::cout << "Quantized BVH" << Width << " nodes: " << nodes.size() << " (" << nodes.size() * sizeof(QuantizedWideNode<Width>) << " bytes)" << std::endl;
+}
+
+template <unsigned int Width>
+RaycastResult QuantizedWideBVH<Width>::intersect(const Ray& ray, const IndexedTriangles& triangles, const float maxT, const bool anyHit) const
+{
+  return traverse<Width>(nodes, ray, triangles, maxT, anyHit);
+}
+
+template <unsigned int Width>
+const std::vector<QuantizedWideNode<Width>>& QuantizedWideBVH<Width>::getNodes() const
+{
+  return nodes;
+}
+
+template class WideBVH<4>;
+template class WideBVH<8>;
+template class QuantizedWideBVH<4>;
+template class QuantizedWideBVH<8>;
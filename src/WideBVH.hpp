@@ -0,0 +1,83 @@
+#ifndef WIDEBVH_HPP
+#define WIDEBVH_HPP
+
+#include <vector>
+
+#include "Utils.hpp"
+#include "Triangle.hpp"
+
+// Set by CMake so that every translation unit agrees on the node layout
+#ifndef WIDE_BVH_WIDTH
+  #define WIDE_BVH_WIDTH 4
+#endif
+
+#define WIDE_BVH_STACK_SIZE 256
+
+// Child bounds are stored per axis so that all children are tested against a ray
+// with one SIMD instruction per slab.
+template <unsigned int Width>
+struct alignas(32) WideNode
+{
+  float bboxMin[3][Width];
+  float bboxMax[3][Width];
+  int child[Width];    // Index of the child node, or the first triangle of a leaf
+  int nTri[Width];     // 0 for inner nodes
+  int nChildren;       // Slots [0, nChildren) are in use
+};
+
+// Child bounds as 8 bit offsets from the node origin in steps of 2^exponent per axis.
+// The offsets are rounded outwards so the decoded boxes always contain the full precision ones.
+template <unsigned int Width>
+struct QuantizedWideNode
+{
+  float origin[3];
+  signed char exponent[3];
+  unsigned char nChildren;
+  unsigned char qMin[3][Width];
+  unsigned char qMax[3][Width];
+  int child[Width];
+  int nTri[Width];
+};
+
+template <unsigned int Width>
+class WideBVH
+{
+public:
+  WideBVH();
+  WideBVH(const std::vector<Node>& bvh);
+  ~WideBVH();
+
+  void build(const std::vector<Node>& bvh, const bool printStatistics = true);
+  RaycastResult intersect(const Ray& ray, const IndexedTriangles& triangles, const float maxT, const bool anyHit) const;
+
+  const std::vector<WideNode<Width>>& getNodes() const;
+
+private:
+  int collapse(const std::vector<Node>& bvh, const int binaryIdx);
+
+  std::vector<WideNode<Width>> nodes;
+};
+
+template <unsigned int Width>
+class QuantizedWideBVH
+{
+public:
+  QuantizedWideBVH();
+  QuantizedWideBVH(const WideBVH<Width>& wideBVH);
+  ~QuantizedWideBVH();
+
+  void build(const WideBVH<Width>& wideBVH, const bool printStatistics = true);
+  RaycastResult intersect(const Ray& ray, const IndexedTriangles& triangles, const float maxT, const bool anyHit) const;
+
+  const std::vector<QuantizedWideNode<Width>>& getNodes() const;
+
+private:
+  std::vector<QuantizedWideNode<Width>> nodes;
+};
+
+typedef WideBVH<4> BVH4;
+typedef WideBVH<8> BVH8;
+typedef WideBVH<WIDE_BVH_WIDTH> NativeWideBVH;
+typedef QuantizedWideBVH<WIDE_BVH_WIDTH> NativeQuantizedWideBVH;
+
+#endif // WIDEBVH_HPP
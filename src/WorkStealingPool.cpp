@@ -0,0 +1,183 @@
+#include "WorkStealingPool.hpp"
+
+namespace
+{
+  thread_local WorkStealingPool* workerPool = nullptr;
+  thread_local unsigned int workerIndex = 0;
+}
+
+WorkStealingPool::WorkStealingPool(const unsigned int nThreads) : queuedTasks(0), nextQueue(0), stopping(false)
+{
+  const unsigned int n = nThreads > 0 ? nThreads : 1;
+
+  for (unsigned int i = 0; i < n; ++i)
+    queues.push_back(std::unique_ptr<TaskQueue>(new TaskQueue()));
+
+  for (unsigned int i = 0; i < n; ++i)
+    threads.push_back(std::thread(&WorkStealingPool::workerLoop, this, i));
+}
+
+WorkStealingPool::~WorkStealingPool()
+{
+  {
+    std::lock_guard<std::mutex> lock(sleepMutex);
+    stopping = true;
+  }
+
+  sleepCondition.notify_all();
+
+  for (auto& t : threads)
+    t.join();
+}
+
+bool WorkStealingPool::isWorkerThread()
+{
+  return workerPool != nullptr;
+}
+
+unsigned int WorkStealingPool::getNThreads() const
+{
+  return threads.size();
+}
+
+void WorkStealingPool::submit(std::function<void()> task)
+{
+  // Tasks spawned by a worker stay on its own deque, others are spread round robin
+  const unsigned int qi = workerPool == this ? workerIndex : nextQueue++ % queues.size();
+
+  {
+    std::lock_guard<std::mutex> lock(queues[qi]->mutex);
+    queues[qi]->tasks.push_back(std::move(task));
+  }
+
+  ++queuedTasks;
+
+  {
+    std::lock_guard<std::mutex> lock(sleepMutex);
+  }
+
+  sleepCondition.notify_one();
+}
+
+bool WorkStealingPool::popTask(const unsigned int index, std::function<void()>& task)
+{
+  TaskQueue& queue = *queues[index];
+  std::lock_guard<std::mutex> lock(queue.mutex);
+
+  if (queue.tasks.empty())
+    return false;
+
+  task = std::move(queue.tasks.back());
+  queue.tasks.pop_back();
+  --queuedTasks;
+
+  return true;
+}
+
+bool WorkStealingPool::stealTask(const unsigned int thief, std::function<void()>& task)
+{
+  const unsigned int n = queues.size();
+
+  for (unsigned int i = 1; i <= n; ++i)
+  {
+    const unsigned int victim = (thief + i) % n;
+
+    if (victim == thief)
+      continue;
+
+    TaskQueue& queue = *queues[victim];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+
+    if (queue.tasks.empty())
+      continue;
+
+    // The oldest task is usually the biggest one
+    task = std::move(queue.tasks.front());
+    queue.tasks.pop_front();
+    --queuedTasks;
+
+    return true;
+  }
+
+  return false;
+}
+
+bool WorkStealingPool::tryRunTask()
+{
+  std::function<void()> task;
+
+  if (workerPool == this)
+  {
+    if (!popTask(workerIndex, task) && !stealTask(workerIndex, task))
+      return false;
+  }
+  else if (!stealTask(queues.size(), task))
+  {
+    return false;
+  }
+
+  task();
+
+  return true;
+}
+
+void WorkStealingPool::workerLoop(const unsigned int index)
+{
+  workerPool = this;
+  workerIndex = index;
+
+  while (!stopping)
+  {
+    if (tryRunTask())
+      continue;
+
+    std::unique_lock<std::mutex> lock(sleepMutex);
+    sleepCondition.wait(lock, [this] { return stopping || queuedTasks > 0; });
+  }
+}
+
+TaskGroup::TaskGroup(WorkStealingPool& pool) : pool(pool), pending(0), exceptionMutex(), exception()
+{
+
+}
+
+TaskGroup::~TaskGroup()
+{
+  while (pending > 0)
+  {
+    if (!pool.tryRunTask())
+      std::this_thread::yield();
+  }
+}
+
+void TaskGroup::run(std::function<void()> task)
+{
+  ++pending;
+
+  pool.submit([this, task]
+  {
+    try
+    {
+      task();
+    }
+    catch (...)
+    {
+      std::lock_guard<std::mutex> lock(exceptionMutex);
+      exception = std::current_exception();
+    }
+
+    --pending;
+  });
+}
+
+void TaskGroup::wait()
+{
+  while (pending > 0)
+  {
+    if (!pool.tryRunTask())
+      std::this_thread::yield();
+  }
+
+  if (exception)
+    std::rethrow_exception(exception);
+}
@@ -0,0 +1,73 @@
+#ifndef WORKSTEALINGPOOL_HPP
+#define WORKSTEALINGPOOL_HPP
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <exception>
+
+// Every worker owns a deque. Workers push and pop their own tasks from the back
+// and steal from the front of the other deques when they run dry.
+class WorkStealingPool
+{
+public:
+  WorkStealingPool(const unsigned int nThreads = std::thread::hardware_concurrency());
+  WorkStealingPool(const WorkStealingPool& that) = delete;
+  WorkStealingPool& operator=(const WorkStealingPool& that) = delete;
+  ~WorkStealingPool();
+
+  static WorkStealingPool& getInstance() {static WorkStealingPool pool; return pool;}
+  static bool isWorkerThread();
+
+  void submit(std::function<void()> task);
+  bool tryRunTask();
+  unsigned int getNThreads() const;
+
+private:
+  struct TaskQueue
+  {
+    std::mutex mutex;
+    std::deque<std::function<void()>> tasks;
+  };
+
+  void workerLoop(const unsigned int index);
+  bool popTask(const unsigned int index, std::function<void()>& task);
+  bool stealTask(const unsigned int thief, std::function<void()>& task);
+
+  std::vector<std::unique_ptr<TaskQueue>> queues;
+  std::vector<std::thread> threads;
+
+  std::mutex sleepMutex;
+  std::condition_variable sleepCondition;
+  std::atomic<int> queuedTasks;
+  std::atomic<unsigned int> nextQueue;
+  std::atomic<bool> stopping;
+};
+
+// Tracks a set of tasks submitted to a pool. wait() executes queued tasks
+// instead of blocking so tasks may spawn and wait for subtasks recursively.
+class TaskGroup
+{
+public:
+  TaskGroup(WorkStealingPool& pool);
+  TaskGroup(const TaskGroup& that) = delete;
+  TaskGroup& operator=(const TaskGroup& that) = delete;
+  ~TaskGroup();
+
+  void run(std::function<void()> task);
+  void wait();
+
+private:
+  WorkStealingPool& pool;
+  std::atomic<int> pending;
+
+  std::mutex exceptionMutex;
+  std::exception_ptr exception;
+};
+
+#endif // WORKSTEALINGPOOL_HPP
@@ -4,28 +4,181 @@
 #include "cxxopts.hpp"
 
 #include "App.hpp"
+#include "BVHBenchmark.hpp"
+#include "BVHStatistics.hpp"
 
 int main(int argc, char * argv[]) {
 
+#ifdef __AVX2__
+  // Built with ENABLE_AVX, fail with a message instead of an illegal instruction later on
+  if (!__builtin_cpu_supports("avx2") || !__builtin_cpu_supports("fma"))
+  {
+    std::cerr << "This build uses AVX2 and FMA, which this CPU doesn't support. Rebuild with -DENABLE_AVX=OFF. Exiting..." << std::endl;
+    return EXIT_FAILURE;
+  }
+#endif
+
   bool batch_render = false;
 
   cxxopts::Options options(argv[0], "");
 
   options.add_options()
     ("b,batch",     "Batch render",         cxxopts::value<bool>(batch_render))
-    ("r,renderer",  "Renderer type",        cxxopts::value<std::string>())
+    ("r,renderer",  "Renderer type (raytrace, pathtrace, cpu-raytrace, cpu-pathtrace, cpu-wavefront)", cxxopts::value<std::string>())
     ("p,paths",     "Number of paths",      cxxopts::value<int>())
     ("s,scene",     "Scene file",           cxxopts::value<std::string>(),  "FILE")
-    ("o,output",    "Output file",          cxxopts::value<std::string>(),  "FILE");
+    ("o,output",    "Output file",          cxxopts::value<std::string>(),  "FILE")
+    ("bvh",         "BVH split mode (median, sah, binned, sbvh, lbvh, hlbvh, ploc)", cxxopts::value<std::string>(), "MODE")
+    ("sbvh-budget", "Extra triangle references allowed for spatial splits, relative to the triangle count", cxxopts::value<float>(), "FRACTION")
+    ("bvh-optimize", "Treelet restructuring passes run after the BVH build", cxxopts::value<int>(), "PASSES")
+    ("bvh-traversal-cost", "Cost model: cost of visiting an inner node", cxxopts::value<float>(), "COST")
+    ("bvh-intersection-cost", "Cost model: cost of testing one triangle", cxxopts::value<float>(), "COST")
+    ("bvh-min-leaf", "Nodes with at most this many triangles become leaves", cxxopts::value<int>(), "N")
+    ("bvh-max-leaf", "Nodes with more triangles are always split", cxxopts::value<int>(), "N")
+    ("early-split", "Split triangles whose box area exceeds this multiple of the average before the BVH build", cxxopts::value<float>(), "RATIO")
+    ("bvh-refit-ratio", "Rebuild instead of refitting the BVH once its SAH cost grew past this multiple of the built cost, 0 never rebuilds", cxxopts::value<float>(), "RATIO")
+    ("bvh-layout",  "Node layout of the BVH the CPU ray packets traverse (df, sib, veb)", cxxopts::value<std::string>(), "LAYOUT")
+    ("instancing",  "CPU tracing through a two level BVH with one bottom level BVH per unique mesh instead of the flat BVH")
+    ("bvh-cache",   "Directory for BVH cache files, next to the model by default", cxxopts::value<std::string>(), "DIR")
+    ("no-bvh-cache", "Always rebuild the BVH and don't write cache files")
+    ("bvh-stats",   "Build the BVH for a model without the cache, report its quality and exit", cxxopts::value<std::string>(), "FILE")
+    ("bvh-bench",   "Report BVH memory use and CPU trace throughput for a model and exit", cxxopts::value<std::string>(), "FILE")
+    ("bvh-refit",   "Twist a model over several frames, refit its BVH every frame, report the SAH cost and exit", cxxopts::value<std::string>(), "FILE");
 
 
 
     auto optres = options.parse(argc, argv);
 
+    BVHBuildParameters bvhParameters;
+
+    if (optres.count("bvh"))
+    {
+      const std::string mode = optres["bvh"].as<std::string>();
+
+      if (mode == "median")
+        bvhParameters.splitMode = SplitMode::OBJECT_MEDIAN;
+      else if (mode == "sah")
+        bvhParameters.splitMode = SplitMode::SAH;
+      else if (mode == "binned")
+        bvhParameters.splitMode = SplitMode::BINNED_SAH;
+      else if (mode == "sbvh")
+        bvhParameters.splitMode = SplitMode::SBVH;
+      else if (mode == "lbvh")
+        bvhParameters.splitMode = SplitMode::LBVH;
+      else if (mode == "hlbvh")
+        bvhParameters.splitMode = SplitMode::HLBVH;
+      else if (mode == "ploc")
+        bvhParameters.splitMode = SplitMode::PLOC;
+      else
+      {
+        std::cerr << "Unknown BVH split mode: " << mode << std::endl;
+        return 1;
+      }
+    }
+
+    if (optres.count("sbvh-budget"))
+      bvhParameters.spatialSplitBudget = optres["sbvh-budget"].as<float>();
+
+    if (optres.count("bvh-optimize"))
+      bvhParameters.treeletPasses = optres["bvh-optimize"].as<int>();
+
+    if (optres.count("bvh-traversal-cost"))
+      bvhParameters.traversalCost = optres["bvh-traversal-cost"].as<float>();
+
+    if (optres.count("bvh-intersection-cost"))
+      bvhParameters.intersectionCost = optres["bvh-intersection-cost"].as<float>();
+
+    if (optres.count("bvh-min-leaf"))
+      bvhParameters.minLeafSize = optres["bvh-min-leaf"].as<int>();
+
+    if (optres.count("bvh-max-leaf"))
+      bvhParameters.maxLeafSize = optres["bvh-max-leaf"].as<int>();
+
+    if (bvhParameters.minLeafSize < 1 || bvhParameters.maxLeafSize < bvhParameters.minLeafSize)
+    {
+      std::cerr << "BVH leaf sizes need 1 <= min <= max" << std::endl;
+      return 1;
+    }
+
+    if (optres.count("early-split"))
+      bvhParameters.earlySplitThreshold = optres["early-split"].as<float>();
+
+    if (optres.count("bvh-refit-ratio"))
+      bvhParameters.refitRebuildRatio = optres["bvh-refit-ratio"].as<float>();
+
+    if (optres.count("bvh-layout"))
+    {
+      const std::string layout = optres["bvh-layout"].as<std::string>();
+
+      if (layout == "df")
+        bvhParameters.nodeLayout = NodeLayout::DEPTH_FIRST;
+      else if (layout == "sib")
+        bvhParameters.nodeLayout = NodeLayout::SIBLING_ADJACENT;
+      else if (layout == "veb")
+        bvhParameters.nodeLayout = NodeLayout::VAN_EMDE_BOAS;
+      else
+      {
+        std::cerr << "Unknown BVH node layout: " << layout << std::endl;
+        return 1;
+      }
+    }
+
+    if (optres.count("instancing"))
+      bvhParameters.instancing = true;
+
+    const bool useCache = !optres.count("no-bvh-cache");
+    const std::string cacheDirectory = optres.count("bvh-cache") ? optres["bvh-cache"].as<std::string>() : "";
+
+    if (optres.count("bvh-stats"))
+    {
+      // The statistics are taken of the flat BVH
+      BVHBuildParameters flatParameters = bvhParameters;
+      flatParameters.instancing = false;
+
+      ModelLoader loader;
+      loader.setBVHBuildParameters(flatParameters);
+      loader.setCache(false);
+
+      const Model model = loader.loadOBJ(optres["bvh-stats"].as<std::string>());
+      std::cout << computeBVHStatistics(model.getBVH(), model.getVertices(), model.getTriangleIndices());
+
+      return 0;
+    }
+
+    if (optres.count("bvh-bench"))
+    {
+      BVHBuildParameters flatParameters = bvhParameters;
+      flatParameters.instancing = false;
+
+      ModelLoader loader;
+      loader.setBVHBuildParameters(flatParameters);
+      loader.setCache(useCache, cacheDirectory);
+
+      const Model model = loader.loadOBJ(optres["bvh-bench"].as<std::string>());
+      benchmarkBVH(model);
+
+      return 0;
+    }
+
+    if (optres.count("bvh-refit"))
+    {
+      // Refitting needs the flat BVH
+      BVHBuildParameters flatParameters = bvhParameters;
+      flatParameters.instancing = false;
+
+      ModelLoader loader;
+      loader.setBVHBuildParameters(flatParameters);
+      loader.setCache(useCache, cacheDirectory);
+
+      Model model = loader.loadOBJ(optres["bvh-refit"].as<std::string>());
+      benchmarkRefit(model);
+
+      return 0;
+    }
+
 
     if (batch_render)
     {
-#ifdef ENABLE_CUDA
       if (!optres.count("renderer"))
       {
         std::cerr << "No renderer specified" << std::endl;
@@ -51,7 +204,21 @@ int main(int argc, char * argv[]) {
       std::string renderer = optres["renderer"].as<std::string>();
       int paths = 0;
 
-      if (renderer == "pathtrace")
+#ifndef ENABLE_CUDA
+      if (renderer != "cpu-raytrace" && renderer != "cpu-pathtrace" && renderer != "cpu-wavefront")
+      {
+        std::cerr << "Compiled without CUDA support, only the cpu-raytrace, cpu-pathtrace and cpu-wavefront renderers are available. Exiting..." << std::endl;
+        return EXIT_FAILURE;
+      }
+#endif
+
+      if (bvhParameters.instancing && renderer != "cpu-raytrace" && renderer != "cpu-pathtrace" && renderer != "cpu-wavefront")
+      {
+        std::cerr << "Instancing is only supported by the cpu-raytrace, cpu-pathtrace and cpu-wavefront renderers" << std::endl;
+        return 1;
+      }
+
+      if (renderer == "pathtrace" || renderer == "cpu-pathtrace" || renderer == "cpu-wavefront")
       {
         if (!optres.count("paths"))
         {
@@ -64,15 +231,32 @@ int main(int argc, char * argv[]) {
       try
       {
         App& app = App::getInstance();
+        app.setBVHBuildParameters(bvhParameters);
+        app.setModelCache(useCache, cacheDirectory);
 
-        if (renderer == "raytrace")
+        if (renderer == "cpu-raytrace")
+        {
+          app.cpuRayTraceToFile(scenefile, output);
+        }
+        else if (renderer == "cpu-pathtrace")
+        {
+          app.cpuPathTraceToFile(scenefile, output, paths);
+        }
+        else if (renderer == "cpu-wavefront")
+        {
+          app.cpuPathTraceToFile(scenefile, output, paths, true);
+        }
+#ifdef ENABLE_CUDA
+        else if (renderer == "raytrace")
         {
           app.rayTraceToFile(scenefile, output);
         }
         else if (renderer == "pathtrace")
         {
           app.pathTraceToFile(scenefile, output, paths);
-        }else
+        }
+#endif
+        else
           std::cout << "Unknown renderer" << std::endl;
 
       }
@@ -80,15 +264,13 @@ int main(int argc, char * argv[]) {
       {
         std::cout << e.what() << std::endl;
       }
-#else
-    std::cerr << "Compiled without CUDA support, no batch rendering possible. Exiting..." << std::endl;
-    return EXIT_FAILURE;
-#endif
   }else{
 
     try
     {
       App& app = App::getInstance();
+      app.setBVHBuildParameters(bvhParameters);
+      app.setModelCache(useCache, cacheDirectory);
 
       if (fileExists(LAST_SCENEFILE_NAME))
         app.loadSceneFile(LAST_SCENEFILE_NAME);